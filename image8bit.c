@@ -22,9 +22,26 @@
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "instrumentation.h"
+#include "threadpool.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_AVX2 1   // AVX2 kernels are compiled, and used if the cpu has it
+#endif
 
 // The data structure
 //
@@ -37,6 +54,13 @@
 // For example, in a 100-pixel wide image (img->width == 100),
 //   pixel position (x,y) = (33,0) is stored in img->pixel[33];
 //   pixel position (x,y) = (22,1) is stored in img->pixel[122].
+//
+// Rows are img->stride pixels apart, which is the width, except for
+// wide images, whose rows are padded to a multiple of 64 bytes (see
+// "Pixel buffers" below), and for views (see ImageView): a view shares
+// the pixels of a rectangle of its parent image, so pixel (x,y) of the
+// view is stored in img->pixel[y*img->stride + x], with
+// img->stride == parent's stride.
 // 
 // Clients should use images only through variables of type Image,
 // which are pointers to the image structure, and should not access the
@@ -44,18 +68,62 @@
 
 // Maximum value you can store in a pixel (maximum maxval accepted)
 const uint8 PixMax = 255;
-static size_t count_locate = 0;
-static size_t count_blur = 0;
 
 
+// Summary statistics of the pixels of an image
+struct pixelStats {
+  uint8 min, max;
+  uint64_t sum;
+};
+
 // Internal structure for storing 8-bit graymap images
 struct image {
   int width;
   int height;
   int maxval;   // maximum gray value (pixels with maxval are pure WHITE)
   uint8* pixel; // pixel data (a raster scan)
+  int stride;   // distance between rows in pixel (>= width)
+  Image parent; // views: the image that owns the pixels (NULL otherwise)
+  int views;    // number of views of this image
+  // Images loaded by ImageLoadMapped: pixel points into a private mapping
+  // of the file, [map, map+mapLen[.  map==NULL for pooled pixels.
+  uint8* map;
+  size_t mapLen;
+  // Cached pyramid level (see ImagePyramidLevel): down is this image
+  // halved, built when the pixels had version downVersion
+  unsigned long version;  // incremented when the pixels change (owners only)
+  Image down;
+  unsigned long downVersion;
+  // Cached statistics (see ImageStats), valid if statsValid and the
+  // pixels still have version statsVersion
+  struct pixelStats stats;
+  int statsValid;
+  unsigned long statsVersion;
+  // Cached histogram (see ImageHistogram): 256 counts, or NULL
+  uint64_t* hist;
+  unsigned long histVersion;
 };
 
+// Address of row y of img
+static inline uint8* rowPtr(Image img, int y) {
+  return img->pixel + (size_t)y * img->stride;
+}
+
+// Number of pixels of img
+static inline unsigned long numPixels(Image img) {
+  return (unsigned long)img->width * img->height;
+}
+
+// Version of the pixels of img (a view shares its owner's pixels)
+static inline unsigned long versionOf(Image img) {
+  return (img->parent != NULL ? img->parent : img)->version;
+}
+
+// The pixels of img changed: cached data derived from them is stale
+static inline void touch(Image img) {
+  (img->parent != NULL ? img->parent : img)->version++;
+}
+
 // This module follows "design-by-contract" principles.
 // Read `Design-by-Contract.md` for more details.
 
@@ -143,38 +211,241 @@ static int check(int condition, const char* failmsg) {
 }
 
 
+// Use AVX2 row kernels (set by ImageInit if the cpu supports them)
+static int useAVX2 = 0;
+
+
 /// Init Image library.  (Call once!)
-/// Currently, simply calibrate instrumentation and set names of counters.
+/// Calibrate instrumentation, set names of counters and start the
+/// worker threads (one per online processor).
 void ImageInit(void) { ///
   InstrCalibrate();
   InstrName[0] = "pixmem";  // InstrCount[0] will count pixel array acesses
+  InstrName[1] = "poolhit";   // InstrCount[1] will count recycled pixel buffers
+  InstrName[2] = "poolmiss";  // InstrCount[2] will count newly allocated ones
+  InstrName[3] = "cmp";       // InstrCount[3] will count pixel comparisons in searches
+  InstrName[4] = "blurops";   // InstrCount[4] will count blur operations
   // Name other counters here...
   
+#ifdef HAVE_AVX2
+  __builtin_cpu_init();
+  useAVX2 = __builtin_cpu_supports("avx2");
+#endif
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  ImageSetThreads(ncpu > 0 ? (int)ncpu : 1);
+}
+
+/// Set the number of threads used by image operations.
+/// nthreads <= 1 makes all operations run serially in the calling thread.
+/// Results do not depend on the number of threads.
+/// On success, returns nonzero.
+/// On failure, returns 0, errCause is set and operations run serially.
+int ImageSetThreads(int nthreads) { ///
+  return check( PoolStart(nthreads), "Starting worker threads failed" );
+}
+
+/// Number of threads used by image operations.
+int ImageThreads(void) { ///
+  return PoolThreads();
 }
 
 // Macros to simplify accessing instrumentation counters:
 #define PIXMEM InstrCount[0]
+#define POOLHIT InstrCount[1]
+#define POOLMISS InstrCount[2]
+#define LOCATECMP InstrCount[3]
+#define BLUROPS InstrCount[4]
 // Add more macros here...
 
+// Add n to a counter from code that may run in several threads at once
+// (each thread has its own counters: see instrumentation.h)
+#define COUNT(counter, n) ((counter) += (unsigned long)(n))
+
+// Profile the calls of an entry point (see InstrOpBegin).
+// PROFILE(pixels, rd, wr), at the start of the function, times the call
+// until the function returns, by whatever return, and records it with the
+// pixels processed and the bytes of pixels read and written (each pixel
+// once, as the operation needs them, not the actual memory traffic).
+// Only operations on whole images are profiled: per-pixel functions such
+// as ImageGetPixel would be slower than the timer.
+struct profile {
+  InstrSpan span;
+  unsigned long pixels, rd, wr;
+};
+
+static inline void profileEnd(struct profile* p) {
+  InstrOpEnd(p->span, p->pixels, p->rd, p->wr);
+}
+
+#define PROFILE(pixels, rd, wr) \
+  static int profOp = -1; \
+  struct profile profCall __attribute__((cleanup(profileEnd))) = \
+    { InstrOpBegin(&profOp, __func__), (unsigned long)(pixels), (unsigned long)(rd), (unsigned long)(wr) }
+
 // TIP: Search for PIXMEM or InstrCount to see where it is incremented!
 
 
+// Parallel execution
+//
+// Operations that process rows independently split them in contiguous
+// bands, which are run by the thread pool (see threadpool.h).
+// Each band does exactly the same computation as the serial loop would on
+// those rows, so results never depend on the number of threads.
+// Bands may update the counters directly: each thread has its own.
+
+// Below this number of pixels, starting the workers does not pay off
+#define PARALLEL_MIN_PIXELS (1L << 16)
+
+// Body of a banded loop: processes items [lo, hi[, which form band number band
+typedef void (*BandBody)(void* arg, int band, int lo, int hi);
+
+struct bandJob {
+  int n;          // number of items (usually rows)
+  int nbands;     // number of bands
+  BandBody body;
+  void* arg;
+};
+
+// First item of band i when n items are split in nbands
+static inline int bandStart(int n, int nbands, int i) {
+  return (int)((long long)n * i / nbands);
+}
+
+static void bandRun(void* arg, int i) {
+  struct bandJob* job = (struct bandJob*)arg;
+  job->body(job->arg, i,
+            bandStart(job->n, job->nbands, i), bandStart(job->n, job->nbands, i + 1));
+}
+
+// Number of bands to split n items in, for an operation on npixels pixels
+static int numBands(long npixels, int n) {
+  if (npixels < PARALLEL_MIN_PIXELS) return 1;
+  int nbands = PoolThreads();
+  return nbands < n ? nbands : (n > 0 ? n : 1);
+}
+
+// Run body over the n items split in nbands bands
+static void forBands(int n, int nbands, BandBody body, void* arg) {
+  if (nbands <= 1) {
+    body(arg, 0, 0, n);
+    return;
+  }
+  struct bandJob job = { n, nbands, body, arg };
+  PoolFor(nbands, bandRun, &job);
+}
+
+
 /// Image management functions
 
-/// Create a new black image.
-///   width, height : the dimensions of the new image.
-///   maxval: the maximum gray level (corresponding to white).
-/// Requires: width and height must be non-negative, maxval > 0.
-/// 
-/// On success, a new image is returned.
-/// (The caller is responsible for destroying the returned image!)
-/// On failure, returns NULL and errno/errCause are set accordingly.
-Image ImageCreate(int width, int height, uint8 maxval) { ///
-  assert (width >= 0);
-  assert (height >= 0);
-  assert (0 < maxval && maxval <= PixMax);
-  // Insert your code here!
-  
+// Pixel buffers
+//
+// Rotations, crops, blurs and pyramids create and destroy many images of
+// the same few sizes.  Instead of going back to malloc every time, the
+// pixel buffers of destroyed images are kept in a pool, in size classes
+// (powers of 2), and handed out again to the next image that needs a
+// buffer of the same class.  Pages of a buffer past the pixels actually
+// used are never touched, so the rounding costs address space, not memory.
+//
+// Buffers are 64-byte aligned (a cache line, and two AVX2 registers), and
+// the rows of wide images are padded to a multiple of 64 bytes, so every
+// row starts aligned.  Narrow rows stay packed: padding them would waste
+// too much.  Buffers are not cleared: only ImageCreate, which promises a
+// black image, zeroes the pixels.
+
+#define ROW_ALIGN 64
+#define ROW_PAD_MIN 512                // rows narrower than this are not padded
+#define POOL_MIN_CLASS 6               // smallest buffer: 64 bytes
+#define POOL_CLASSES 48
+#define POOL_LIMIT (256UL << 20)       // bytes kept in the pool, at most
+
+// Free buffers of each class, linked through their first bytes
+static pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER;
+static void* poolFree[POOL_CLASSES];
+static size_t poolBytes = 0;
+
+// Distance between rows of a new image of the given width
+static int strideFor(int width) {
+  if (width < ROW_PAD_MIN) return width;
+  return (int)(((long)width + ROW_ALIGN - 1) / ROW_ALIGN * ROW_ALIGN);
+}
+
+// Size class of a buffer of n bytes: its capacity is 2^class bytes
+static int poolClass(size_t n) {
+  int c = POOL_MIN_CLASS;
+  while (((size_t)1 << c) < n) c++;
+  return c;
+}
+
+// Get a buffer of at least n bytes, from the pool if possible.
+// Returns NULL if there is no memory (and errno is set).
+static uint8* poolGet(size_t n) {
+  int c = poolClass(n);
+  if (c >= POOL_CLASSES) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  pthread_mutex_lock(&poolLock);
+  void* buf = poolFree[c];
+  if (buf != NULL) {
+    poolFree[c] = *(void**)buf;
+    poolBytes -= (size_t)1 << c;
+  }
+  pthread_mutex_unlock(&poolLock);
+  if (buf != NULL) {
+    COUNT(POOLHIT, 1);
+    return (uint8*)buf;
+  }
+  COUNT(POOLMISS, 1);
+  int err = posix_memalign(&buf, ROW_ALIGN, (size_t)1 << c);
+  if (err != 0) {
+    errno = err;  // posix_memalign não altera errno
+    return NULL;
+  }
+  return (uint8*)buf;
+}
+
+// Return a buffer of n bytes (as requested from poolGet) to the pool.
+// If the pool is full, the buffer is freed.
+static void poolPut(uint8* buf, size_t n) {
+  if (buf == NULL) return;
+  int c = poolClass(n);
+  size_t cap = (size_t)1 << c;
+  pthread_mutex_lock(&poolLock);
+  int keep = poolBytes + cap <= POOL_LIMIT;
+  if (keep) {
+    *(void**)buf = poolFree[c];
+    poolFree[c] = buf;
+    poolBytes += cap;
+  }
+  pthread_mutex_unlock(&poolLock);
+  if (!keep) {
+    errsave = errno;
+    free(buf);
+    errno = errsave;
+  }
+}
+
+/// Release the pixel buffers kept for reuse by destroyed images.
+/// Images destroyed afterwards refill the pool.
+/// Should never fail, and preserves global errno/errCause.
+void ImagePoolTrim(void) { ///
+  int err = errno;
+  pthread_mutex_lock(&poolLock);
+  for (int c = 0; c < POOL_CLASSES; c++) {
+    while (poolFree[c] != NULL) {
+      void* buf = poolFree[c];
+      poolFree[c] = *(void**)buf;
+      free(buf);
+    }
+  }
+  poolBytes = 0;
+  pthread_mutex_unlock(&poolLock);
+  errno = err;
+}
+
+// Nova imagem com os pixeis por inicializar (para quem os vai escrever todos).
+// Em caso de falha, retorna NULL e errno/errCause ficam definidos.
+static Image imageNew(int width, int height, uint8 maxval) {
   Image newImg = (Image)malloc(sizeof(struct image));
 
   if (newImg == NULL)
@@ -186,20 +457,49 @@ Image ImageCreate(int width, int height, uint8 maxval) { ///
   newImg->height = height; // Define a altura da imagem
   newImg->width = width; // Define a largura da imagem
   newImg->maxval = maxval; // Define o valor máximo de cinza
-  newImg->pixel = (uint8*)malloc(width * height * sizeof(uint8));
+  newImg->stride = strideFor(width);  // Linhas largas alinhadas a 64 bytes
+  newImg->parent = NULL;   // A imagem é dona dos seus pixeis
+  newImg->views = 0;
+  newImg->map = NULL;      // Os pixeis não vêm de um ficheiro mapeado
+  newImg->mapLen = 0;
+  newImg->version = 0;
+  newImg->down = NULL;     // Pirâmide ainda não construída
+  newImg->statsValid = 0;  // Estatísticas ainda não calculadas
+  newImg->hist = NULL;
+  newImg->pixel = poolGet((size_t)newImg->stride * height);
 
   if (newImg->pixel == NULL)
   {
     errCause = "Falha na alocação de memória para os pixeis"; // Define a mensagem de erro
+    errsave = errno;
     free(newImg); // Liberta a memória alocada para a estrutura da imagem
+    errno = errsave;
     return NULL;
   }
+  return newImg;
+}
 
-// Inicializa todos os pixels da imagem com o valor mínimo de intensidade (0) como padrão
-  for (int i = 0; i < width * height; i++) {
-        newImg->pixel[i] = 0;
-        count_blur++;           // número de operações onde o pixel[i] = 0
-  }
+/// Create a new black image.
+///   width, height : the dimensions of the new image.
+///   maxval: the maximum gray level (corresponding to white).
+/// Requires: width and height must be non-negative, maxval > 0.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageCreate(int width, int height, uint8 maxval) { ///
+  assert (width >= 0);
+  assert (height >= 0);
+  assert (0 < maxval && maxval <= PixMax);
+  PROFILE((unsigned long)width * height, 0, (unsigned long)width * height);
+  // Insert your code here!
+  
+  Image newImg = imageNew(width, height, maxval);
+  if (newImg == NULL) return NULL;
+
+  // Inicializa todos os pixels da imagem com o valor mínimo de intensidade (0) como padrão
+  // (o buffer pode vir do pool, com os pixeis de uma imagem destruída)
+  memset(newImg->pixel, 0, (size_t)newImg->stride * height);
   return newImg;
 }
 
@@ -210,16 +510,28 @@ Image ImageCreate(int width, int height, uint8 maxval) { ///
 /// If (*imgp)==NULL, no operation is performed.
 /// Ensures: (*imgp)==NULL.
 /// Should never fail, and should preserve global errno/errCause.
+/// The pixel buffer is kept for reuse by new images (see ImagePoolTrim).
 
 
-void ImageDestroy(Image* imgp) {
+void ImageDestroy(Image* imgp) { ///
     assert(imgp != NULL);
+    if (*imgp == NULL) return;
+    assert((*imgp)->views == 0);  // As vistas têm de ser destruídas antes
 
-    // Insert your code here!
-
-    // Liberta a lista de pixels
-    free((*imgp)->pixel);
+    // Devolve a lista de pixels ao pool (ou desfaz o mapeamento do ficheiro).
+    // Os pixeis de uma vista pertencem à imagem mãe.
+    if ((*imgp)->parent != NULL) {
+      (*imgp)->parent->views--;
+    } else if ((*imgp)->map != NULL) {
+      errsave = errno;
+      munmap((*imgp)->map, (*imgp)->mapLen);
+      errno = errsave;
+    } else {
+      poolPut((*imgp)->pixel, (size_t)(*imgp)->stride * (*imgp)->height);
+    }
     (*imgp)->pixel = NULL;
+    ImageDestroy(&(*imgp)->down);  // e a pirâmide
+    free((*imgp)->hist);           // e o histograma
 
     // Liberta a estrutura da imagem
     free(*imgp);
@@ -245,36 +557,58 @@ static int skipComments(FILE* f) {
 }
 
 
+// Parse the header of a raw PGM file, leaving f at the first pixel.
+// On success, returns nonzero and sets (*w, *h, *maxval).
+// On failure, returns 0 and errCause is set.
+static int readHeader(FILE* f, int* w, int* h, int* maxval) {
+  char c;
+  return
+  check( fscanf(f, "P%c ", &c) == 1 && c == '5' , "Invalid file format" ) &&
+  skipComments(f) >= 0 &&
+  check( fscanf(f, "%d ", w) == 1 && *w >= 0 , "Invalid width" ) &&
+  skipComments(f) >= 0 &&
+  check( fscanf(f, "%d ", h) == 1 && *h >= 0 , "Invalid height" ) &&
+  skipComments(f) >= 0 &&
+  check( fscanf(f, "%d", maxval) == 1 && 0 < *maxval && *maxval <= (int)PixMax , "Invalid maxval" ) &&
+  check( fscanf(f, "%c", &c) == 1 && isspace(c) , "Whitespace expected" );
+}
+
+// Ler os pixeis de img de f (linha a linha, se as linhas tiverem enchimento)
+static int readPixels(Image img, FILE* f) {
+  size_t w = (size_t)img->width;
+  if (img->stride == img->width) {
+    return fread(img->pixel, sizeof(uint8), w * img->height, f) == w * img->height;
+  }
+  for (int y = 0; y < img->height; y++) {
+    if (fread(rowPtr(img, y), sizeof(uint8), w, f) != w) return 0;
+  }
+  return 1;
+}
+
 /// Load a raw PGM file.
 /// Only 8 bit PGM files are accepted.
 /// On success, a new image is returned.
 /// (The caller is responsible for destroying the returned image!)
 /// On failure, returns NULL and errno/errCause are set accordingly.
-
-
 Image ImageLoad(const char* filename) { ///
+  PROFILE(0, 0, 0);
   int w, h;
   int maxval;
-  char c;
   FILE* f = NULL;
   Image img = NULL;
 
   int success = 
   check( (f = fopen(filename, "rb")) != NULL, "Open failed" ) &&
   // Parse PGM header
-  check( fscanf(f, "P%c ", &c) == 1 && c == '5' , "Invalid file format" ) &&
-  skipComments(f) >= 0 &&
-  check( fscanf(f, "%d ", &w) == 1 && w >= 0 , "Invalid width" ) &&
-  skipComments(f) >= 0 &&
-  check( fscanf(f, "%d ", &h) == 1 && h >= 0 , "Invalid height" ) &&
-  skipComments(f) >= 0 &&
-  check( fscanf(f, "%d", &maxval) == 1 && 0 < maxval && maxval <= (int)PixMax , "Invalid maxval" ) &&
-  check( fscanf(f, "%c", &c) == 1 && isspace(c) , "Whitespace expected" ) &&
-  // Allocate image
-  (img = ImageCreate(w, h, (uint8)maxval)) != NULL &&
+  readHeader(f, &w, &h, &maxval) &&
+  // Allocate image (all pixels are read below)
+  (img = imageNew(w, h, (uint8)maxval)) != NULL &&
   // Read pixels
-  check( fread(img->pixel, sizeof(uint8), w*h, f) == w*h , "Reading pixels" );
+  check( readPixels(img, f) , "Reading pixels" );
   PIXMEM += (unsigned long)(w*h);  // count pixel memory accesses
+  if (success) {
+    profCall.pixels = profCall.rd = profCall.wr = numPixels(img);
+  }
 
   // Cleanup
   if (!success) {
@@ -286,26 +620,181 @@ Image ImageLoad(const char* filename) { ///
   return img;
 }
 
+/// Load a raw PGM file by mapping it into memory.
+/// Same as ImageLoad, but the pixels are not read: the image uses a
+/// private (copy-on-write) mapping of the file, so pages are only read
+/// when first accessed, and changes to the image never reach the file.
+/// Falls back to ImageLoad for files that are not regular files.
+/// The file must not be truncated while the image exists (ImageSave
+/// to the same file is safe, it copies the pixels first).
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageLoadMapped(const char* filename) { ///
+  PROFILE(0, 0, 0);
+  int w, h;
+  int maxval;
+  FILE* f = NULL;
+  Image img = NULL;
+  struct stat st;
+  long offset = 0;
+
+  int success =
+  check( (f = fopen(filename, "rb")) != NULL, "Open failed" ) &&
+  check( fstat(fileno(f), &st) == 0, "Stat failed" );
+  if (success && !S_ISREG(st.st_mode)) {
+    // Pipes e dispositivos não se podem mapear
+    fclose(f);
+    return ImageLoad(filename);
+  }
+  success = success &&
+  // Parse PGM header
+  readHeader(f, &w, &h, &maxval) &&
+  check( (offset = ftell(f)) >= 0, "Tell failed" ) &&
+  check( (size_t)st.st_size - (size_t)offset >= (size_t)w * h, "Reading pixels" ) &&
+  check( (img = (Image)malloc(sizeof(struct image))) != NULL, "Falha na alocação de memória para a estrutura da imagem" );
+  if (success) {
+    img->width = w;
+    img->height = h;
+    img->maxval = maxval;
+    img->stride = w;
+    img->parent = NULL;
+    img->views = 0;
+    img->version = 0;
+    img->down = NULL;
+    img->statsValid = 0;
+    img->hist = NULL;
+    img->mapLen = (size_t)offset + (size_t)w * h;
+    void* map = mmap(NULL, img->mapLen, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(f), 0);
+    success = check( map != MAP_FAILED, "Mapping failed" );
+    img->map = success ? (uint8*)map : NULL;
+    img->pixel = success ? img->map + offset : NULL;
+    profCall.pixels = numPixels(img);  // nada é lido ainda
+  }
+
+  // Cleanup
+  if (!success) {
+    errsave = errno;
+    free(img);
+    img = NULL;
+    errno = errsave;
+  }
+  if (f != NULL) fclose(f);
+  return img;
+}
+
+// Os ficheiros guardados não são reescritos: é escrito um ficheiro
+// temporário novo na mesma diretoria, que no fim toma o lugar do ficheiro
+// (rename).  Assim, as imagens mapeadas do ficheiro antigo (que pode ser
+// a fonte do que se guarda) continuam a ver os seus pixeis, e o ficheiro
+// fica intacto se a escrita falhar.
+
+// Abrir para escrita o ficheiro temporário que vai substituir filename.
+// Fica em *name o caminho do ficheiro a substituir e em *tmp o do
+// temporário, a terminar com replaceEnd.
+// Retorna NULL em caso de erro (e *name e *tmp ficam NULL).
+static FILE* replaceBegin(const char* filename, char** name, char** tmp) {
+  static unsigned long serial = 0;  // para nomes temporários diferentes
+  struct stat st;
+  int fd = -1;
+  FILE* f = NULL;
+  *name = NULL;
+  *tmp = NULL;
+  // Um ficheiro existente é substituído com as mesmas permissões (como
+  // com fopen); se for uma ligação simbólica, é substituído o ficheiro
+  // para onde aponta
+  errsave = errno;
+  int exists = stat(filename, &st) == 0;
+  errno = errsave;
+  int success =
+  check( (*name = exists ? realpath(filename, NULL) : strdup(filename)) != NULL, "Open failed" ) &&
+  check( (*tmp = (char*)malloc(strlen(*name) + 64)) != NULL,
+         "Falha na alocação de memória para o nome do ficheiro" );
+  while (success && fd < 0) {
+    sprintf(*tmp, "%s.%ld.%lu.tmp", *name, (long)getpid(),
+            __atomic_fetch_add(&serial, 1, __ATOMIC_RELAXED));
+    fd = open(*tmp, O_WRONLY | O_CREAT | O_EXCL, 0666);
+    success = fd >= 0 || check( errno == EEXIST, "Open failed" );
+  }
+  if (success) errno = errsave;
+  success = success &&
+  check( !exists || fchmod(fd, st.st_mode & 07777) == 0, "Open failed" ) &&
+  check( (f = fdopen(fd, "wb")) != NULL, "Open failed" );
+  if (!success) {
+    errsave = errno;
+    if (fd >= 0) {
+      close(fd);
+      unlink(*tmp);
+    }
+    free(*tmp);
+    free(*name);
+    *tmp = NULL;
+    *name = NULL;
+    errno = errsave;
+  }
+  return f;
+}
+
+// Terminar a substituição começada por replaceBegin (depois de fechar o
+// ficheiro): se success, o temporário toma o lugar do ficheiro; senão,
+// ou se isso falhar, é apagado.  Liberta *name e *tmp (se *tmp==NULL,
+// só liberta *name).  Retorna success, ou 0 se a substituição falhar.
+static int replaceEnd(char** name, char** tmp, int success) {
+  if (*tmp != NULL) {
+    success = success && check( rename(*tmp, *name) == 0, "Rename failed" );
+    if (!success) {
+      int saved = errno;  // (os chamadores podem estar a usar errsave)
+      unlink(*tmp);
+      errno = saved;
+    }
+  }
+  free(*tmp);
+  free(*name);
+  *tmp = NULL;
+  *name = NULL;
+  return success;
+}
+
+// Escrever os pixeis de img em f (linha a linha, se img for uma vista)
+static int writePixels(Image img, FILE* f) {
+  size_t w = (size_t)img->width;
+  if (img->stride == img->width) {
+    return fwrite(img->pixel, sizeof(uint8), w * img->height, f) == w * img->height;
+  }
+  for (int y = 0; y < img->height; y++) {
+    if (fwrite(rowPtr(img, y), sizeof(uint8), w, f) != w) return 0;
+  }
+  return 1;
+}
+
 /// Save image to PGM file.
+/// The image is written to a new file in the same directory, which then
+/// replaces filename, so filename may be a file that images are mapped from.
 /// On success, returns nonzero.
 /// On failure, returns 0, errno/errCause are set appropriately, and
-/// a partial and invalid file may be left in the system.
+/// filename is left untouched.
 int ImageSave(Image img, const char* filename) { ///
   assert (img != NULL);
+  PROFILE(numPixels(img), numPixels(img), numPixels(img));
   int w = img->width;
   int h = img->height;
   uint8 maxval = img->maxval;
   FILE* f = NULL;
+  char* name = NULL;
+  char* tmp = NULL;
 
   int success =
-  check( (f = fopen(filename, "wb")) != NULL, "Open failed" ) &&
+  (f = replaceBegin(filename, &name, &tmp)) != NULL &&
   check( fprintf(f, "P5\n%d %d\n%u\n", w, h, maxval) > 0, "Writing header failed" ) &&
-  check( fwrite(img->pixel, sizeof(uint8), w*h, f) == w*h, "Writing pixels failed" ); 
+  check( writePixels(img, f), "Writing pixels failed" );
   PIXMEM += (unsigned long)(w*h);  // count pixel memory accesses
 
   // Cleanup
-  if (f != NULL) fclose(f);
-  return success;
+  if (f != NULL) {
+    int closed = fclose(f) == 0;
+    success = success && check( closed, "Writing pixels failed" );
+  }
+  return replaceEnd(&name, &tmp, success);
 }
 
 
@@ -313,6 +802,12 @@ int ImageSave(Image img, const char* filename) { ///
 
 /// These functions do not modify the image and never fail.
 
+/// Check if img is a view of another image (see ImageView).
+int ImageIsView(Image img) { ///
+  assert (img != NULL);
+  return img->parent != NULL;
+}
+
 /// Get image width
 int ImageWidth(Image img) { ///
   assert (img != NULL);
@@ -331,33 +826,145 @@ int ImageMaxval(Image img) { ///
   return img->maxval;
 }
 
+// Estatísticas dos pixeis
+//
+// Calculadas numa só passagem, 16 (SSE2) ou 32 (AVX2) pixeis de cada vez:
+// pminub/pmaxub para o mínimo e o máximo, e psadbw (contra zero) para a
+// soma.  Ficam guardadas na imagem até os pixeis mudarem (ver touch).
+
+// Juntar as estatísticas dos pixeis p[i..n[ a *s
+static inline void statsRowScalar(const uint8* p, size_t i, size_t n, struct pixelStats* s) {
+  for (; i < n; i++) {
+    if (p[i] < s->min) s->min = p[i];
+    if (p[i] > s->max) s->max = p[i];
+    s->sum += p[i];
+  }
+}
+
+#ifdef __SSE2__
+// Versões SSE2/AVX2: tratam os blocos inteiros a partir de i e retornam
+// onde pararam
+static size_t statsRowSSE2(const uint8* p, size_t i, size_t n, struct pixelStats* s) {
+  if (i + 16 > n) return i;
+  __m128i vmin = _mm_set1_epi8((char)s->min);
+  __m128i vmax = _mm_set1_epi8((char)s->max);
+  __m128i vsum = _mm_setzero_si128();
+  __m128i zero = _mm_setzero_si128();
+  for (; i + 16 <= n; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(p + i));
+    vmin = _mm_min_epu8(vmin, v);
+    vmax = _mm_max_epu8(vmax, v);
+    vsum = _mm_add_epi64(vsum, _mm_sad_epu8(v, zero));
+  }
+  uint8 lanes[16];
+  _mm_storeu_si128((__m128i*)lanes, vmin);
+  for (int k = 0; k < 16; k++) if (lanes[k] < s->min) s->min = lanes[k];
+  _mm_storeu_si128((__m128i*)lanes, vmax);
+  for (int k = 0; k < 16; k++) if (lanes[k] > s->max) s->max = lanes[k];
+  s->sum += (uint64_t)_mm_cvtsi128_si64(vsum) + (uint64_t)_mm_cvtsi128_si64(_mm_unpackhi_epi64(vsum, vsum));
+  return i;
+}
+#endif
+
+#ifdef HAVE_AVX2
+__attribute__((target("avx2")))
+static size_t statsRowAVX2(const uint8* p, size_t i, size_t n, struct pixelStats* s) {
+  if (i + 32 > n) return i;
+  __m256i vmin = _mm256_set1_epi8((char)s->min);
+  __m256i vmax = _mm256_set1_epi8((char)s->max);
+  __m256i vsum = _mm256_setzero_si256();
+  __m256i zero = _mm256_setzero_si256();
+  for (; i + 32 <= n; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i*)(p + i));
+    vmin = _mm256_min_epu8(vmin, v);
+    vmax = _mm256_max_epu8(vmax, v);
+    vsum = _mm256_add_epi64(vsum, _mm256_sad_epu8(v, zero));
+  }
+  uint8 lanes[32];
+  _mm256_storeu_si256((__m256i*)lanes, vmin);
+  for (int k = 0; k < 32; k++) if (lanes[k] < s->min) s->min = lanes[k];
+  _mm256_storeu_si256((__m256i*)lanes, vmax);
+  for (int k = 0; k < 32; k++) if (lanes[k] > s->max) s->max = lanes[k];
+  __m128i s2 = _mm_add_epi64(_mm256_castsi256_si128(vsum), _mm256_extracti128_si256(vsum, 1));
+  s->sum += (uint64_t)_mm_cvtsi128_si64(s2) + (uint64_t)_mm_cvtsi128_si64(_mm_unpackhi_epi64(s2, s2));
+  return i;
+}
+#endif
+
+// Juntar as estatísticas dos n pixeis de p a *s
+static void statsRow(const uint8* p, size_t n, struct pixelStats* s) {
+  size_t i = 0;
+#ifdef HAVE_AVX2
+  if (useAVX2) i = statsRowAVX2(p, i, n, s);
+#endif
+#ifdef __SSE2__
+  i = statsRowSSE2(p, i, n, s);
+#endif
+  statsRowScalar(p, i, n, s);
+}
+
+struct statsArgs {
+  Image img;
+  struct pixelStats* part;  // por faixa
+};
+
+static void statsBand(void* arg, int band, int y0, int y1) {
+  struct statsArgs* args = (struct statsArgs*)arg;
+  struct pixelStats s = { 255, 0, 0 };
+  for (int y = y0; y < y1; y++) {
+    statsRow(rowPtr(args->img, y), (size_t)args->img->width, &s);
+  }
+  args->part[band] = s;
+  COUNT(PIXMEM, (unsigned long)(y1 - y0) * args->img->width);
+}
+
+// Estatísticas de img, calculadas só se os pixeis mudaram desde a última vez
+static const struct pixelStats* pixelStats(Image img) {
+  if (img->statsValid && img->statsVersion == versionOf(img)) return &img->stats;
+  int height = img->height;
+  int nbands = numBands((long)img->width * height, height);
+  struct pixelStats part[nbands];
+  struct statsArgs args = { img, part };
+  forBands(height, nbands, statsBand, &args);
+  struct pixelStats s = { 255, 0, 0 };
+  for (int i = 0; i < nbands; i++) {
+    if (part[i].min < s.min) s.min = part[i].min;
+    if (part[i].max > s.max) s.max = part[i].max;
+    s.sum += part[i].sum;
+  }
+  img->stats = s;
+  img->statsVersion = versionOf(img);
+  img->statsValid = 1;
+  return &img->stats;
+}
+
 /// Pixel stats
 /// Find the minimum and maximum gray levels in image.
 /// On return,
 /// *min is set to the minimum gray level in the image,
 /// *max is set to the maximum.
+/// The statistics are cached with the image until its pixels change, so
+/// repeated calls cost O(1).
+/// Requires: the image is not empty.
 void ImageStats(Image img, uint8* min, uint8* max) { ///
   assert (img != NULL);
   assert (min != NULL); // Verificar se *min é diferente de NULL
   assert (max != NULL); // Verificar se *max é diferente de NULL 
-// Insert your code here!
-
-  *min = *max = ImageGetPixel(img, 0, 0); // Inicializa *min e *max com o valor do primeiro pixel da imagem
-  int height = img->height; // Obtém a altura da imagem
-  int width = img->width; // Obtém a largura da imagem
-
-  // Percorrer todos os pixels da imagem
-  for (int i = 0;i < height; i++) {
-    for (int j = 0; j < width; j++) {
-      uint8 pixel = ImageGetPixel(img, j, i); // Obtém o valor do pixel
-      if (pixel < *min) {
-        *min = pixel; // Caso seja menor que *min este passa a ter o valor do pixel
-      }
-      if (pixel > *max) {
-        *max = pixel; // Caso seja maior que *max este passa a ter o valor do pixel
-      }  
-    }
-  }
+  assert (img->width > 0 && img->height > 0);
+  PROFILE(numPixels(img), numPixels(img), 0);
+
+  const struct pixelStats* s = pixelStats(img);
+  *min = s->min;
+  *max = s->max;
+}
+
+/// Mean gray level of the image (0 for an empty image).
+/// Cached with the image, like ImageStats.
+double ImageMean(Image img) { ///
+  assert (img != NULL);
+  long n = (long)img->width * img->height;
+  if (n == 0) return 0.0;
+  return (double)pixelStats(img)->sum / n;
 }
 
 /// Check if pixel position (x,y) is inside img.
@@ -370,7 +977,8 @@ int ImageValidPos(Image img, int x, int y) { ///
 int ImageValidRect(Image img, int x, int y, int w, int h) { ///
   assert (img != NULL);
   // Insert your code here!
-  return ImageValidPos(img, x, y) && (0 <= w && w < img->width) && (0 <= h && h < img->height); // Verifica se a posição (x,y) é válida e verifica se a largura e altura são maiores que 0 e menores que a largura e altura da imagem.
+  // Verifica se o canto (x,y) e as dimensões são não negativos e se o retângulo não passa dos limites da imagem
+  return (0 <= x && 0 <= w && w <= img->width - x) && (0 <= y && 0 <= h && h <= img->height - y);
 }
 /// Pixel get & set operations
 
@@ -381,12 +989,12 @@ int ImageValidRect(Image img, int x, int y, int w, int h) { ///
 
 // Transform (x, y) coords into linear pixel index.
 // This internal function is used in ImageGetPixel / ImageSetPixel. 
-// The returned index must satisfy (0 <= index < img->width*img->height)
-static inline int G(Image img, int x, int y) {
-  int index = y * img->width + x;
+// The returned index must satisfy (0 <= index < img->stride*img->height)
+static inline size_t G(Image img, int x, int y) {
+  size_t index = (size_t)y * img->stride + x;
   // Insert your code here!
   //printf("\nwidth: %d, height: %d, x: %d, y: %d, index: %d", img->width,img->height,x,y,index);
-  assert (0 <= index && index < img->width*img->height);
+  assert (index < (size_t)img->stride*img->height);
   return index;
 }
 
@@ -403,6 +1011,7 @@ void ImageSetPixel(Image img, int x, int y, uint8 level) { ///
   assert (ImageValidPos(img, x, y));
   PIXMEM += 1;  // count one pixel access (store)
   img->pixel[G(img, x, y)] = level;
+  touch(img);
 } 
 
 /// Pixel transformations
@@ -412,95 +1021,510 @@ void ImageSetPixel(Image img, int x, int y, uint8 level) { ///
 /// All of these functions modify the image in-place: no allocation involved.
 /// They never fail.
 
+// Row kernels
+//
+// Each pixel transformation is applied one row at a time by a row kernel.
+// The scalar version of each kernel is the reference; the SSE2 (16 pixels
+// per instruction) and AVX2 (32 pixels per instruction) versions process
+// the longest prefix of the row that fills whole vectors and give exactly
+// the same results.  The scalar version finishes the row.
 
-/// Transform image to negative image.
-/// This transforms dark pixels to light pixels and vice-versa,
-/// resulting in a "photographic negative" effect.
+// Negativo: p = maxval - p (módulo 256, como a versão escalar)
+static void negRowScalar(uint8* p, size_t n, uint8 maxval) {
+  for (size_t i = 0; i < n; i++) {
+    p[i] = (uint8)(maxval - p[i]);
+  }
+}
 
-// transformar imagens na sua versão negativa. Inverte os niveis de pixel. pixeis escuros -> pixeis claros
-void ImageNegative(Image img) { ///
-  // verificar se a imagem não é nula para poder prosseguir
-  assert (img != NULL); 
+// Limiar: p = p < thr ? 0 : maxval
+static void thrRowScalar(uint8* p, size_t n, uint8 thr, uint8 maxval) {
+  for (size_t i = 0; i < n; i++) {
+    p[i] = p[i] < thr ? 0 : maxval;
+  }
+}
 
-  // obter info da imagem para eventual uso
-  int width = img->width;
-  int height = img->height;
-  int maxval = img->maxval;
+// Abrilhantamento: p = min(round(p*factor), maxval)
+static void briRowScalar(uint8* p, size_t n, double factor, int maxval) {
+  for (size_t i = 0; i < n; i++) {
+    double brighten = p[i] * factor;
+    // arredondamento (correção erro "byte 90, linha 4")
+    double decimal = brighten - (int)brighten;
+    if (decimal >= 0.5) {
+        brighten = (int)brighten + 1;
+    } else {
+        brighten = (int)brighten;
+    }
 
-  // iterar sobre cada pixel da imagem, para poder aceder a cada pixel individualmente
-  for(int i = 0; i < height; i++){
-    for(int j = 0; j < width; j++){
-      // obter o pixel atual para posteriormente ser alterada a sua cor
-      uint8 actual_pixel = ImageGetPixel(img, j, i);
-      // definir o valor do pixel, calculando o valor do pixel maxval
-      ImageSetPixel(img, j, i, (uint8)(maxval - actual_pixel)); 
+    if(brighten > maxval){
+      brighten = maxval; 
     }
+    p[i] = (uint8)brighten;
   }
 }
 
-/// Apply threshold to image.
-/// Transform all pixels with level<thr to black (0) and
-/// all pixels with level>=thr to white (maxval).
-void ImageThreshold(Image img, uint8 thr) { ///
-  assert (img != NULL);
-  // Insert your code here!
-  // obter info da imagem para eventual uso
-  int height = img->height;
-  int width = img->width;
-  int maxval = img->maxval;
+#ifdef __SSE2__
+// Versões SSE2: retornam o número de pixeis processados (múltiplo de 16)
 
-  // iterar sobre cada pixel da imagem, para poder aceder a cada pixel individualmente
-  for (int i = 0; i < height; i++){
-    for (int j = 0; j < width; j++){
-      // obter o pixel atual nas coordenadas i,j
-      uint8 actual_pixel = ImageGetPixel(img,j,i);
-      // se o pixel actual for menor que thr, o pixel é definido para preto
-      if (actual_pixel < thr){
-        ImageSetPixel(img,j,i,(uint8)(0));
-      
-      } else{
-        ImageSetPixel(img,j,i,(uint8)(maxval)); // caso contrário é definido para o nivel maxval
-      }
-    }
+static size_t negRowSSE2(uint8* p, size_t n, uint8 maxval) {
+  __m128i m = _mm_set1_epi8((char)maxval);
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m128i v = _mm_loadu_si128((__m128i*)(p + i));
+    _mm_storeu_si128((__m128i*)(p + i), _mm_sub_epi8(m, v));
   }
+  return i;
+}
 
+static size_t thrRowSSE2(uint8* p, size_t n, uint8 thr, uint8 maxval) {
+  __m128i t = _mm_set1_epi8((char)thr);
+  __m128i m = _mm_set1_epi8((char)maxval);
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m128i v = _mm_loadu_si128((__m128i*)(p + i));
+    // p >= thr  <=>  max(p, thr) == p  (comparação sem sinal)
+    __m128i ge = _mm_cmpeq_epi8(_mm_max_epu8(v, t), v);
+    _mm_storeu_si128((__m128i*)(p + i), _mm_and_si128(ge, m));
+  }
+  return i;
 }
 
-/// Brighten image by a factor.
-/// Multiply each pixel level by a factor, but saturate at maxval.
-/// This will brighten the image if factor>1.0 and
-/// darken the image if factor<1.0.
-void ImageBrighten(Image img, double factor) { 
-  assert (img != NULL);
-  // ? assert (factor >= 0.0);
-  // Insert your code here!
+// Abrilhantamento de 4 pixeis (inteiros de 32 bits) em vírgula flutuante
+// dupla, com as mesmas operações da versão escalar: o resultado é idêntico.
+static inline __m128i bri4SSE2(__m128i v, __m128d f, __m128d maxv) {
+  const __m128d half = _mm_set1_pd(0.5);
+  const __m128d one = _mm_set1_pd(1.0);
+  __m128d b0 = _mm_mul_pd(_mm_cvtepi32_pd(v), f);
+  __m128d b1 = _mm_mul_pd(_mm_cvtepi32_pd(_mm_shuffle_epi32(v, 0xEE)), f);
+  __m128d t0 = _mm_cvtepi32_pd(_mm_cvttpd_epi32(b0));   // (int)brighten
+  __m128d t1 = _mm_cvtepi32_pd(_mm_cvttpd_epi32(b1));
+  t0 = _mm_add_pd(t0, _mm_and_pd(_mm_cmpge_pd(_mm_sub_pd(b0, t0), half), one));
+  t1 = _mm_add_pd(t1, _mm_and_pd(_mm_cmpge_pd(_mm_sub_pd(b1, t1), half), one));
+  t0 = _mm_min_pd(t0, maxv);
+  t1 = _mm_min_pd(t1, maxv);
+  return _mm_unpacklo_epi64(_mm_cvttpd_epi32(t0), _mm_cvttpd_epi32(t1));
+}
 
-  int height = img->height;
-  int width = img->width;
-  int maxval = img->maxval;
+static size_t briRowSSE2(uint8* p, size_t n, double factor, int maxval) {
+  __m128d f = _mm_set1_pd(factor);
+  __m128d maxv = _mm_set1_pd((double)maxval);
+  __m128i zero = _mm_setzero_si128();
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m128i v = _mm_loadu_si128((__m128i*)(p + i));
+    __m128i lo = _mm_unpacklo_epi8(v, zero);
+    __m128i hi = _mm_unpackhi_epi8(v, zero);
+    __m128i r0 = bri4SSE2(_mm_unpacklo_epi16(lo, zero), f, maxv);
+    __m128i r1 = bri4SSE2(_mm_unpackhi_epi16(lo, zero), f, maxv);
+    __m128i r2 = bri4SSE2(_mm_unpacklo_epi16(hi, zero), f, maxv);
+    __m128i r3 = bri4SSE2(_mm_unpackhi_epi16(hi, zero), f, maxv);
+    __m128i r = _mm_packus_epi16(_mm_packs_epi32(r0, r1), _mm_packs_epi32(r2, r3));
+    _mm_storeu_si128((__m128i*)(p + i), r);
+  }
+  return i;
+}
+#endif
 
-  for (int i = 0; i < height; i++){
-    for (int j = 0; j < width; j++){
-      // obter o pixel atual nas coordenadas i,j
-      uint8 actual_pixel = ImageGetPixel(img,j,i);
-      double brighten = actual_pixel * factor;
-      // arredondamento (correção erro "byte 90, linha 4")
-      double decimal = brighten - (int)brighten;
-      if (decimal >= 0.5) {
-          brighten = (int)brighten + 1;
-      } else {
-          brighten = (int)brighten;
-      }
+#ifdef HAVE_AVX2
+// Versões AVX2: retornam o número de pixeis processados
 
-      if(brighten > maxval){
-        brighten = maxval; 
-      }
-      ImageSetPixel(img,j,i,(uint8)brighten);
-    }
+__attribute__((target("avx2")))
+static size_t negRowAVX2(uint8* p, size_t n, uint8 maxval) {
+  __m256i m = _mm256_set1_epi8((char)maxval);
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m256i v = _mm256_loadu_si256((__m256i*)(p + i));
+    _mm256_storeu_si256((__m256i*)(p + i), _mm256_sub_epi8(m, v));
   }
+  return i;
+}
+
+__attribute__((target("avx2")))
+static size_t thrRowAVX2(uint8* p, size_t n, uint8 thr, uint8 maxval) {
+  __m256i t = _mm256_set1_epi8((char)thr);
+  __m256i m = _mm256_set1_epi8((char)maxval);
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m256i v = _mm256_loadu_si256((__m256i*)(p + i));
+    __m256i ge = _mm256_cmpeq_epi8(_mm256_max_epu8(v, t), v);
+    _mm256_storeu_si256((__m256i*)(p + i), _mm256_and_si256(ge, m));
+  }
+  return i;
+}
+
+// Abrilhantamento de 8 pixeis, 4 por instrução (ver bri4SSE2)
+__attribute__((target("avx2")))
+static inline __m128i bri8AVX2(const uint8* p, __m256d f, __m256d maxv) {
+  const __m256d half = _mm256_set1_pd(0.5);
+  const __m256d one = _mm256_set1_pd(1.0);
+  __m256i v = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)p));
+  __m256d b0 = _mm256_mul_pd(_mm256_cvtepi32_pd(_mm256_castsi256_si128(v)), f);
+  __m256d b1 = _mm256_mul_pd(_mm256_cvtepi32_pd(_mm256_extracti128_si256(v, 1)), f);
+  __m256d t0 = _mm256_cvtepi32_pd(_mm256_cvttpd_epi32(b0));
+  __m256d t1 = _mm256_cvtepi32_pd(_mm256_cvttpd_epi32(b1));
+  t0 = _mm256_add_pd(t0, _mm256_and_pd(_mm256_cmp_pd(_mm256_sub_pd(b0, t0), half, _CMP_GE_OQ), one));
+  t1 = _mm256_add_pd(t1, _mm256_and_pd(_mm256_cmp_pd(_mm256_sub_pd(b1, t1), half, _CMP_GE_OQ), one));
+  t0 = _mm256_min_pd(t0, maxv);
+  t1 = _mm256_min_pd(t1, maxv);
+  return _mm_packs_epi32(_mm256_cvttpd_epi32(t0), _mm256_cvttpd_epi32(t1));
+}
+
+__attribute__((target("avx2")))
+static size_t briRowAVX2(uint8* p, size_t n, double factor, int maxval) {
+  __m256d f = _mm256_set1_pd(factor);
+  __m256d maxv = _mm256_set1_pd((double)maxval);
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m128i r0 = bri8AVX2(p + i, f, maxv);
+    __m128i r1 = bri8AVX2(p + i + 8, f, maxv);
+    _mm_storeu_si128((__m128i*)(p + i), _mm_packus_epi16(r0, r1));
+  }
+  return i;
+}
+#endif
+
+// Row kernels: use the widest vectors available, then finish in scalar
+
+static void negRow(uint8* p, size_t n, uint8 maxval) {
+  size_t i = 0;
+#ifdef HAVE_AVX2
+  if (useAVX2) i += negRowAVX2(p + i, n - i, maxval);
+#endif
+#ifdef __SSE2__
+  i += negRowSSE2(p + i, n - i, maxval);
+#endif
+  negRowScalar(p + i, n - i, maxval);
+}
+
+static void thrRow(uint8* p, size_t n, uint8 thr, uint8 maxval) {
+  size_t i = 0;
+#ifdef HAVE_AVX2
+  if (useAVX2) i += thrRowAVX2(p + i, n - i, thr, maxval);
+#endif
+#ifdef __SSE2__
+  i += thrRowSSE2(p + i, n - i, thr, maxval);
+#endif
+  thrRowScalar(p + i, n - i, thr, maxval);
+}
+
+static void briRow(uint8* p, size_t n, double factor, int maxval) {
+  size_t i = 0;
+  // Os vetores convertem brighten para int32, como (int)brighten: só são
+  // usados quando essa conversão está definida (0 <= p*factor < 2^31)
+  if (factor >= 0.0 && factor * 255.0 < 2147483647.0) {
+#ifdef HAVE_AVX2
+    if (useAVX2) i += briRowAVX2(p + i, n - i, factor, maxval);
+#endif
+#ifdef __SSE2__
+    i += briRowSSE2(p + i, n - i, factor, maxval);
+#endif
+  }
+  briRowScalar(p + i, n - i, factor, maxval);
+}
+
+
+/// Transform image to negative image.
+/// This transforms dark pixels to light pixels and vice-versa,
+/// resulting in a "photographic negative" effect.
+
+// Parâmetros das transformações de pixeis, partilhados pelas faixas
+struct pointArgs {
+  Image img;
+  uint8 thr;      // ImageThreshold
+  double factor;  // ImageBrighten
+};
+
+// Negativo das linhas [y0, y1[
+static void negativeBand(void* arg, int band, int y0, int y1) {
+  Image img = ((struct pointArgs*)arg)->img;
+  unsigned long count = 0;
+  for (int y = y0; y < y1; y++) {
+    negRow(rowPtr(img, y), (size_t)img->width, (uint8)img->maxval);
+    count += 2 * (unsigned long)img->width;  // uma leitura e uma escrita por pixel
+  }
+  COUNT(PIXMEM, count);
+}
+
+// transformar imagens na sua versão negativa. Inverte os niveis de pixel. pixeis escuros -> pixeis claros
+void ImageNegative(Image img) { ///
+  // verificar se a imagem não é nula para poder prosseguir
+  assert (img != NULL); 
+  PROFILE(numPixels(img), numPixels(img), numPixels(img));
+
+  // obter info da imagem para eventual uso
+  int width = img->width;
+  int height = img->height;
+
+  struct pointArgs args = { img, 0, 0.0 };
+  forBands(height, numBands((long)width * height, height), negativeBand, &args);
+  touch(img);
+}
+
+/// Apply threshold to image.
+/// Transform all pixels with level<thr to black (0) and
+/// all pixels with level>=thr to white (maxval).
+
+// Limiarização das linhas [y0, y1[
+static void thresholdBand(void* arg, int band, int y0, int y1) {
+  struct pointArgs* args = (struct pointArgs*)arg;
+  Image img = args->img;
+  unsigned long count = 0;
+  for (int y = y0; y < y1; y++) {
+    thrRow(rowPtr(img, y), (size_t)img->width, args->thr, (uint8)img->maxval);
+    count += 2 * (unsigned long)img->width;  // uma leitura e uma escrita por pixel
+  }
+  COUNT(PIXMEM, count);
+}
+
+void ImageThreshold(Image img, uint8 thr) { ///
+  assert (img != NULL);
+  PROFILE(numPixels(img), numPixels(img), numPixels(img));
+  // obter info da imagem para eventual uso
+  int height = img->height;
+  int width = img->width;
+
+  struct pointArgs args = { img, thr, 0.0 };
+  forBands(height, numBands((long)width * height, height), thresholdBand, &args);
+  touch(img);
+}
+
+/// Brighten image by a factor.
+/// Multiply each pixel level by a factor, but saturate at maxval.
+/// This will brighten the image if factor>1.0 and
+/// darken the image if factor<1.0.
+
+// Abrilhantamento das linhas [y0, y1[
+static void brightenBand(void* arg, int band, int y0, int y1) {
+  struct pointArgs* args = (struct pointArgs*)arg;
+  Image img = args->img;
+  unsigned long count = 0;
+  for (int y = y0; y < y1; y++) {
+    briRow(rowPtr(img, y), (size_t)img->width, args->factor, img->maxval);
+    count += 2 * (unsigned long)img->width;  // uma leitura e uma escrita por pixel
+  }
+  COUNT(PIXMEM, count);
+}
+
+void ImageBrighten(Image img, double factor) { ///
+  assert (img != NULL);
+  PROFILE(numPixels(img), numPixels(img), numPixels(img));
+  // ? assert (factor >= 0.0);
+
+  int height = img->height;
+  int width = img->width;
+
+  struct pointArgs args = { img, 0, factor };
+  forBands(height, numBands((long)width * height, height), brightenBand, &args);
+  touch(img);
 } 
 
 
+/// Lookup tables
+
+// Os construtores aplicam o kernel escalar da operação à própria tabela,
+// por isso a semântica (arredondamentos, maxval) é exatamente a mesma.
+
+/// Set lut to the identity (no operation).
+void ImageLUTIdentity(uint8 lut[256]) { ///
+  assert (lut != NULL);
+  for (int p = 0; p < 256; p++) {
+    lut[p] = (uint8)p;
+  }
+}
+
+/// Append ImageNegative(img) to lut.
+void ImageLUTNegative(Image img, uint8 lut[256]) { ///
+  assert (img != NULL);
+  assert (lut != NULL);
+  negRowScalar(lut, 256, (uint8)img->maxval);
+}
+
+/// Append ImageThreshold(img, thr) to lut.
+void ImageLUTThreshold(Image img, uint8 lut[256], uint8 thr) { ///
+  assert (img != NULL);
+  assert (lut != NULL);
+  thrRowScalar(lut, 256, thr, (uint8)img->maxval);
+}
+
+/// Append ImageBrighten(img, factor) to lut.
+void ImageLUTBrighten(Image img, uint8 lut[256], double factor) { ///
+  assert (img != NULL);
+  assert (lut != NULL);
+  briRowScalar(lut, 256, factor, img->maxval);
+}
+
+struct lutArgs {
+  Image img;
+  const uint8* lut;
+};
+
+// Aplicar a tabela às linhas [y0, y1[
+static void lutRow(uint8* p, int n, const uint8* lut) {
+  for (int x = 0; x < n; x++) {
+    p[x] = lut[p[x]];
+  }
+}
+
+static void lutBand(void* arg, int band, int y0, int y1) {
+  struct lutArgs* args = (struct lutArgs*)arg;
+  Image img = args->img;
+  const uint8* lut = args->lut;
+  unsigned long count = 0;
+  for (int y = y0; y < y1; y++) {
+    lutRow(rowPtr(img, y), img->width, lut);
+    count += 2 * (unsigned long)img->width;  // uma leitura e uma escrita por pixel
+  }
+  COUNT(PIXMEM, count);
+}
+
+/// Replace each pixel level p in img by lut[p].
+void ImageApplyLUT(Image img, const uint8 lut[256]) { ///
+  assert (img != NULL);
+  assert (lut != NULL);
+  PROFILE(numPixels(img), numPixels(img), numPixels(img));
+  int width = img->width;
+  int height = img->height;
+
+  struct lutArgs args = { img, lut };
+  forBands(height, numBands((long)width * height, height), lutBand, &args);
+  touch(img);
+}
+
+
+/// Histograms
+
+// Cada faixa conta os seus pixeis em HIST_LANES sub-histogramas (pixeis
+// seguidos vão para sub-histogramas diferentes, para não esperarem uns
+// pelos outros quando têm o mesmo nível), somados no fim da faixa; os
+// histogramas das faixas são somados depois.  Cada faixa só escreve nos
+// seus histogramas, por isso não há partilha entre threads.
+
+#define HIST_LANES 4
+
+struct histArgs {
+  Image img;
+  uint64_t (*part)[256];  // por faixa
+};
+
+static void histBand(void* arg, int band, int y0, int y1) {
+  struct histArgs* args = (struct histArgs*)arg;
+  Image img = args->img;
+  size_t width = (size_t)img->width;
+  uint64_t lane[HIST_LANES][256];
+  memset(lane, 0, sizeof(lane));
+  for (int y = y0; y < y1; y++) {
+    const uint8* p = rowPtr(img, y);
+    size_t x = 0;
+    for (; x + 8 <= width; x += 8) {
+      // 8 pixeis de uma vez, dois por sub-histograma
+      uint64_t v;
+      memcpy(&v, p + x, sizeof(v));
+      lane[0][v & 0xFF]++;
+      lane[1][(v >> 8) & 0xFF]++;
+      lane[2][(v >> 16) & 0xFF]++;
+      lane[3][(v >> 24) & 0xFF]++;
+      lane[0][(v >> 32) & 0xFF]++;
+      lane[1][(v >> 40) & 0xFF]++;
+      lane[2][(v >> 48) & 0xFF]++;
+      lane[3][v >> 56]++;
+    }
+    for (; x < width; x++) lane[0][p[x]]++;
+  }
+  for (int v = 0; v < 256; v++) {
+    args->part[band][v] = lane[0][v] + lane[1][v] + lane[2][v] + lane[3][v];
+  }
+  COUNT(PIXMEM, (unsigned long)(y1 - y0) * width);
+}
+
+// Histograma de img em hist
+static void histogram(Image img, uint64_t hist[256]) {
+  int height = img->height;
+  int nbands = numBands((long)img->width * height, height);
+  // Os histogramas das faixas (2 KiB cada) ficam no heap, porque o número
+  // de faixas cresce com o de threads.  Sem memória, usa-se uma só faixa.
+  uint64_t one[1][256];
+  uint64_t (*part)[256] = one;
+  if (nbands > 1) {
+    errsave = errno;
+    part = (uint64_t (*)[256])malloc((size_t)nbands * sizeof(*part));
+    errno = errsave;
+    if (part == NULL) {
+      part = one;
+      nbands = 1;
+    }
+  }
+  struct histArgs args = { img, part };
+  forBands(height, nbands, histBand, &args);
+  for (int v = 0; v < 256; v++) {
+    uint64_t c = 0;
+    for (int i = 0; i < nbands; i++) c += part[i][v];
+    hist[v] = c;
+  }
+  if (part != one) free(part);
+}
+
+/// Compute the histogram of an image.
+/// Sets hist[v] to the number of pixels with gray level v, for v in [0, 255].
+/// The histogram is computed in parallel by the worker threads
+/// (see ImageSetThreads), and cached with the image until its pixels
+/// change, so repeated calls cost O(1).
+void ImageHistogram(Image img, uint64_t hist[256]) { ///
+  assert (img != NULL);
+  assert (hist != NULL);
+  PROFILE(numPixels(img), numPixels(img), 0);
+  if (img->hist != NULL && img->histVersion == versionOf(img)) {
+    memcpy(hist, img->hist, 256 * sizeof(uint64_t));
+    return;
+  }
+  histogram(img, hist);
+  // Guardar (se não houver memória, fica por guardar)
+  if (img->hist == NULL) {
+    errsave = errno;
+    img->hist = (uint64_t*)malloc(256 * sizeof(uint64_t));
+    errno = errsave;
+  }
+  if (img->hist != NULL) {
+    memcpy(img->hist, hist, 256 * sizeof(uint64_t));
+    img->histVersion = versionOf(img);
+  }
+}
+
+/// Set lut to the histogram equalization of img.
+/// Level v maps to (cdf(v) - cdf(min)) * maxval / (N - cdf(min)), rounded,
+/// where cdf(v) is the number of pixels with level <= v, min is the
+/// minimum level and N the number of pixels; so the levels spread over
+/// [0, maxval] as evenly as possible.
+/// If all pixels have the same level, lut is the identity.
+void ImageLUTEqualize(Image img, uint8 lut[256]) { ///
+  assert (img != NULL);
+  assert (lut != NULL);
+  uint64_t hist[256];
+  ImageHistogram(img, hist);
+  uint64_t n = (uint64_t)img->width * img->height;
+  uint64_t cdfMin = 0;
+  for (int v = 0; v < 256 && cdfMin == 0; v++) cdfMin = hist[v];
+  ImageLUTIdentity(lut);
+  if (n == cdfMin) return;  // imagem vazia ou de um só nível
+  uint64_t cdf = 0;
+  uint64_t range = n - cdfMin;
+  for (int v = 0; v < 256; v++) {
+    cdf += hist[v];
+    if (cdf >= cdfMin) {
+      lut[v] = (uint8)(((cdf - cdfMin) * 2 * img->maxval + range) / (2 * range));
+    }
+  }
+}
+
+/// Equalize the histogram of the image.
+/// Applies ImageLUTEqualize(img) to img, in a single pass.
+void ImageEqualize(Image img) { ///
+  assert (img != NULL);
+  PROFILE(numPixels(img), numPixels(img), numPixels(img));
+  uint8 lut[256];
+  ImageLUTEqualize(img, lut);
+  ImageApplyLUT(img, lut);
+}
+
+
 /// Geometric transformations
 
 /// These functions apply geometric transformations to an image,
@@ -514,6 +1538,105 @@ void ImageBrighten(Image img, double factor) {
 // Implementation hint: 
 // Call ImageCreate whenever you need a new image!
 
+// Transposição por blocos
+//
+// As rotações de 90 graus e a transposição escrevem cada linha da origem
+// numa coluna do destino.  Percorrer a imagem inteira assim falha a cache
+// (e a TLB) em quase todas as escritas, por isso a imagem é percorrida em
+// blocos de TILE x TILE pixeis, que cabem na cache L1, e cada bloco em
+// sub-blocos de 16x16 transpostos em registos SSE2.
+//
+// O pixel (x,y) da origem vai para a linha r = x (ou W-1-x, se flipRows)
+// e a coluna c = y (ou H-1-y, se flipCols) do destino:
+//   transposição: r = x,     c = y
+//   rotação 90 anti-horária: r = W-1-x, c = y
+//   rotação 90 horária:      r = x,     c = H-1-y
+
+#define TILE 64
+
+struct transposeArgs {
+  Image src, dst;
+  int flipRows, flipCols;
+};
+
+// Transpor pixel a pixel o retângulo [x0, x1[ x [y0, y1[ da origem
+static void transposeScalar(const struct transposeArgs* t, int x0, int x1, int y0, int y1) {
+  int W = t->src->width;
+  int H = t->src->height;
+  for (int y = y0; y < y1; y++) {
+    const uint8* row = rowPtr(t->src, y);
+    int c = t->flipCols ? H - 1 - y : y;
+    for (int x = x0; x < x1; x++) {
+      rowPtr(t->dst, t->flipRows ? W - 1 - x : x)[c] = row[x];
+    }
+  }
+}
+
+#ifdef __SSE2__
+// Transpor o bloco 16x16 com canto (x0,y0) da origem.
+// Quatro rondas a intercalar os bytes das linhas i e i+8 transpõem o bloco.
+static void transpose16SSE2(const struct transposeArgs* t, int x0, int y0) {
+  int W = t->src->width;
+  int H = t->src->height;
+  __m128i a[16], b[16];
+  for (int k = 0; k < 16; k++) {
+    // Com flipCols, as linhas entram por ordem inversa
+    int y = t->flipCols ? y0 + 15 - k : y0 + k;
+    a[k] = _mm_loadu_si128((const __m128i*)(rowPtr(t->src, y) + x0));
+  }
+  for (int round = 0; round < 4; round++) {
+    for (int i = 0; i < 8; i++) {
+      b[2 * i] = _mm_unpacklo_epi8(a[i], a[i + 8]);
+      b[2 * i + 1] = _mm_unpackhi_epi8(a[i], a[i + 8]);
+    }
+    memcpy(a, b, sizeof(a));
+  }
+  int c0 = t->flipCols ? H - 16 - y0 : y0;
+  for (int i = 0; i < 16; i++) {
+    int r = t->flipRows ? W - 1 - (x0 + i) : x0 + i;
+    _mm_storeu_si128((__m128i*)(rowPtr(t->dst, r) + c0), a[i]);
+  }
+}
+#endif
+
+// Transpor as faixas de blocos [lo, hi[ (cada faixa tem TILE linhas da origem)
+static void transposeBand(void* arg, int band, int lo, int hi) {
+  struct transposeArgs* t = (struct transposeArgs*)arg;
+  int W = t->src->width;
+  int H = t->src->height;
+  for (int ty = lo * TILE; ty < hi * TILE && ty < H; ty += TILE) {
+    int ty1 = ty + TILE < H ? ty + TILE : H;
+    for (int tx = 0; tx < W; tx += TILE) {
+      int tx1 = tx + TILE < W ? tx + TILE : W;
+#ifdef __SSE2__
+      // Sub-blocos 16x16 completos em SSE2; as margens pixel a pixel
+      int y16 = ty + (ty1 - ty) / 16 * 16;
+      int x16 = tx + (tx1 - tx) / 16 * 16;
+      for (int y = ty; y < y16; y += 16) {
+        for (int x = tx; x < x16; x += 16) transpose16SSE2(t, x, y);
+      }
+      transposeScalar(t, x16, tx1, ty, y16);
+      transposeScalar(t, tx, tx1, y16, ty1);
+#else
+      transposeScalar(t, tx, tx1, ty, ty1);
+#endif
+    }
+  }
+}
+
+// Nova imagem com a origem transposta (e eventualmente invertida)
+static Image transposeImage(Image img, int flipRows, int flipCols) {
+  int width = img->width;
+  int height = img->height;
+  Image dst = imageNew(height, width, img->maxval);
+  if (dst == NULL) return NULL;
+  struct transposeArgs t = { img, dst, flipRows, flipCols };
+  int ntiles = (height + TILE - 1) / TILE;
+  forBands(ntiles, numBands((long)width * height, ntiles), transposeBand, &t);
+  PIXMEM += 2 * (unsigned long)width * height;  // uma leitura e uma escrita por pixel
+  return dst;
+}
+
 /// Rotate an image.
 /// Returns a rotated version of the image.
 /// The rotation is 90 degrees anti-clockwise.
@@ -524,22 +1647,68 @@ void ImageBrighten(Image img, double factor) {
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageRotate(Image img) { ///
   assert (img != NULL);
-  // Insert your code here!
+  PROFILE(numPixels(img), numPixels(img), numPixels(img));
+  // O pixel (x,y) vai para (y, W-1-x)
+  return transposeImage(img, 1, 0);
+}
 
-  // Obter a largura e altura da imagem para eventual uso
-  int width = img->width;
-  int height = img->height;
+/// Rotate an image 90 degrees clockwise.
+/// Ensures: The original img is not modified.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageRotateCW(Image img) { ///
+  assert (img != NULL);
+  PROFILE(numPixels(img), numPixels(img), numPixels(img));
+  // O pixel (x,y) vai para (H-1-y, x)
+  return transposeImage(img, 0, 1);
+}
 
-  Image rotImg = ImageCreate(height, width, img->maxval);    // Criação nova imagem chamada rotImg
+/// Transpose an image: pixel (x,y) goes to (y,x).
+/// Ensures: The original img is not modified.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageTranspose(Image img) { ///
+  assert (img != NULL);
+  PROFILE(numPixels(img), numPixels(img), numPixels(img));
+  return transposeImage(img, 0, 0);
+}
 
-  // Percorrer todos os pixeis da imagem
-  for (int i = 0; i < height; i++) {
-    for (int j = 0; j < width; j++) {
-      uint8 pixel = ImageGetPixel(img, j, i); // Obter o valor do pixel
-      ImageSetPixel(rotImg, i, width - j - 1, pixel); // Define o valor do pixel na nova imagem
+// Rodar 180 graus as linhas [y0, y1[: cada linha vai invertida para H-1-y
+static void rotate180Band(void* arg, int band, int y0, int y1) {
+  struct transposeArgs* t = (struct transposeArgs*)arg;
+  int width = t->src->width;
+  int height = t->src->height;
+  for (int y = y0; y < y1; y++) {
+    const uint8* src = rowPtr(t->src, y);
+    uint8* dst = rowPtr(t->dst, height - 1 - y);
+    for (int x = 0; x < width; x++) {
+      dst[width - 1 - x] = src[x];
     }
   }
-  return rotImg;  // Retornar a imagem rodada em 90 graus anti-horáriox
+}
+
+/// Rotate an image 180 degrees.
+/// Ensures: The original img is not modified.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageRotate180(Image img) { ///
+  assert (img != NULL);
+  PROFILE(numPixels(img), numPixels(img), numPixels(img));
+  int width = img->width;
+  int height = img->height;
+  Image dst = imageNew(width, height, img->maxval);
+  if (dst == NULL) return NULL;
+  // Sem transposição: as linhas são lidas e escritas seguidas
+  struct transposeArgs t = { img, dst, 1, 1 };
+  forBands(height, numBands((long)width * height, height), rotate180Band, &t);
+  PIXMEM += 2 * (unsigned long)width * height;  // uma leitura e uma escrita por pixel
+  return dst;
 }
 
 /// Mirror an image = flip left-right.
@@ -551,21 +1720,25 @@ Image ImageRotate(Image img) { ///
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageMirror(Image img) { ///
   assert (img != NULL);
+  PROFILE(numPixels(img), numPixels(img), numPixels(img));
   // Insert your code here!
 
   // Obter a largura e altura da imagem para eventual uso
   int width = img->width;
   int height = img->height;
 
-  Image mirrorImg = ImageCreate(height, width, img->maxval); // Criação nova imagem chamada mirrorImg
+  Image mirrorImg = imageNew(width, height, img->maxval); // Criação nova imagem chamada mirrorImg
+  if (mirrorImg == NULL) return NULL;
 
-  // Percorrer todos os pixeis da imagem
+  // Copiar cada linha da imagem pela ordem inversa
   for (int j = 0; j < height; j++) {
+    const uint8* src = rowPtr(img, j);
+    uint8* dst = rowPtr(mirrorImg, j);
     for (int i = 0; i < width; i++) {
-      uint8 pixel = ImageGetPixel(img, j, i); // Obter o valor do pixel
-      ImageSetPixel(mirrorImg, width-j-1, i, pixel); // Define o valor do pixel imagem espelhada
+      dst[width - i - 1] = src[i];
     }
   }
+  PIXMEM += 2 * (unsigned long)width * height;  // uma leitura e uma escrita por pixel
   return mirrorImg; // Retornar a imagem espelhada
 } 
 
@@ -584,46 +1757,91 @@ Image ImageMirror(Image img) { ///
 Image ImageCrop(Image img, int x, int y, int w, int h) { ///
   assert (img != NULL);
   assert (ImageValidRect(img, x, y, w, h)); // retangulo deve estar dentro da imagem original 
+  PROFILE((unsigned long)w * h, (unsigned long)w * h, (unsigned long)w * h);
   // Insert your code here!
   int maxval = img->maxval;
 
-  Image cropImg = ImageCreate(h, w, maxval);  // Criar nova imagem chamada cropImg
+  Image cropImg = imageNew(w, h, maxval);  // Criar nova imagem chamada cropImg (todas as linhas são copiadas)
 
   if(cropImg == NULL){
     errCause = "Erro na criação da imagem!";
     return NULL;
   }
 
+  // Copiar as linhas do retângulo
   for (int i = 0; i < h; i++) {
-    for (int j = 0; j < w; j++) {
-      uint8 pixel = ImageGetPixel(img, x + j, y + i);   // Obter o pixel da imagem cuja posição é (x + j, y + i)
-      ImageSetPixel(cropImg, j, i, pixel);      // Definir o pixel da imagem cortada na posição (j, i)
-      }
-    }
+    memcpy(rowPtr(cropImg, i), rowPtr(img, y + i) + x, (size_t)w);
+  }
+  PIXMEM += 2 * (unsigned long)w * h;  // uma leitura e uma escrita por pixel
   return cropImg;           // Retorna a imagem cortada
 }
 
+/// Create a view of a rectangle of img.
+/// The view is an image of width w and height h whose pixels are the
+/// pixels of the rectangle (x,y,w,h) of img: no pixels are copied, and
+/// changes to the view change img (and vice-versa).
+/// All image operations accept views.
+/// Requires:
+///   The rectangle must be inside img.
+///   The views of img must be destroyed before img.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageView(Image img, int x, int y, int w, int h) { ///
+  assert (img != NULL);
+  assert (ImageValidRect(img, x, y, w, h));
+  Image view = (Image)malloc(sizeof(struct image));
+  if (view == NULL) {
+    errCause = "Falha na alocação de memória para a estrutura da imagem";
+    return NULL;
+  }
+  // A vista de uma vista aponta para a imagem dona dos pixeis
+  Image owner = img->parent != NULL ? img->parent : img;
+  view->width = w;
+  view->height = h;
+  view->maxval = img->maxval;
+  view->pixel = rowPtr(img, y) + x;
+  view->stride = img->stride;
+  view->parent = owner;
+  view->views = 0;
+  view->map = NULL;
+  view->mapLen = 0;
+  view->version = 0;
+  view->down = NULL;
+  view->statsValid = 0;
+  view->hist = NULL;
+  owner->views++;
+  return view;
+}
+
 /// Operations on two images
 
 /// Paste an image into a larger image.
 /// Paste img2 into position (x, y) of img1.
 /// This modifies img1 in-place: no allocation involved.
 /// Requires: img2 must fit inside img1 at position (x, y).
+
+// Colar as linhas [j0, j1[ da img2 nas linhas y+j0.. de img1, a partir da coluna x
+static void pasteRows(Image img1, int x, int y, Image img2, int j0, int j1) {
+  for (int j = j0; j < j1; j++) {
+    memcpy(rowPtr(img1, y + j) + x,
+           rowPtr(img2, j), (size_t)img2->width);
+  }
+  PIXMEM += 2 * (unsigned long)img2->width * (j1 - j0);  // uma leitura e uma escrita por pixel
+}
+
 void ImagePaste(Image img1, int x, int y, Image img2) { ///
   assert(img1 != NULL);
   assert(img2 != NULL);
+  PROFILE(numPixels(img2), numPixels(img2), numPixels(img2));
   // Obter a largura e altura da imagem2 para eventual uso
   int img2_width = ImageWidth(img2);
   int img2_height = ImageHeight(img2);
   assert(ImageValidRect(img1, x, y, img2_width, img2_height)); // Verifica se a imagem2 que vai ser colada cabe dentro da imagem1
 
-  // Percorrer todos os pixeis da imagem2
-  for (int i = 0; i < img2_height; i++) {
-    for (int j = 0; j < img2_width; j++) {
-      uint8 pixel = ImageGetPixel(img2, j, i);  // Obter o valor do pixel da posição (j, i) da img2
-      ImageSetPixel(img1, x + j, y + i, pixel); // Colar o pixel na posição (x+j, y+i) em img1
-    }
-  }
+  pasteRows(img1, x, y, img2, 0, img2_height);
+  touch(img1);
 }
 
 /// Blend an image into a larger image.
@@ -646,29 +1864,196 @@ void ImagePaste(Image img1, int x, int y, Image img2) { ///
 /// Requires: img2 must fit inside img1 at position (x, y).
 /// alpha usually is in [0.0, 1.0], but values outside that interval
 /// may provide interesting effects. Over/underflows should saturate.
-void ImageBlend(Image img1, int x, int y, Image img2, double alpha) {
+struct blendArgs {
+  Image img1;
+  int x, y;
+  Image img2;
+  double alpha;
+};
+
+// Mistura das linhas [j0, j1[ da img2 em img1
+// Misturar n pixeis de p2 em p1
+static void blendRow(uint8* p1, const uint8* p2, int n, double alpha) {
+  for (int i = 0; i < n; i++) {
+    // Obter o valor do pixel resultante da mistura
+    p1[i] = (uint8)((1 - alpha) * p1[i] + 0.5 + alpha * p2[i]);
+  }
+}
+
+static void blendBand(void* arg, int band, int j0, int j1) {
+  struct blendArgs* args = (struct blendArgs*)arg;
+  Image img1 = args->img1;
+  Image img2 = args->img2;
+  int w2 = img2->width;
+  for (int j = j0; j < j1; j++) {
+    blendRow(rowPtr(img1, args->y + j) + args->x,
+             rowPtr(img2, j), w2, args->alpha);
+  }
+}
+
+void ImageBlend(Image img1, int x, int y, Image img2, double alpha) { ///
   assert(img1 != NULL);
   assert(img2 != NULL);
   assert(ImageValidRect(img1, x, y, img2->width, img2->height));
+  PROFILE(numPixels(img2), 2 * numPixels(img2), numPixels(img2));
+
+  int w2 = img2->width;
+  int h2 = img2->height;
+  struct blendArgs args = { img1, x, y, img2, alpha };
+  forBands(h2, numBands((long)w2 * h2, h2), blendBand, &args);
+  touch(img1);
+  PIXMEM += 3 * (unsigned long)w2 * h2;  // duas leituras e uma escrita por pixel
+}
+
+
+
+
+// Comparação de linhas
+//
+// As linhas são comparadas 16 (SSE2) ou 32 (AVX2) bytes de cada vez: a
+// máscara dos bytes iguais dá a posição da primeira diferença, por isso
+// o número de pixeis comparados contado é o mesmo da comparação pixel a
+// pixel.
 
-  // Percorrer os pixels da imagem2
+// Comprimento do prefixo comum de a e b (n bytes), a partir de i, sabendo
+// que os primeiros i bytes são iguais
+static inline size_t eqPrefixScalar(const uint8* a, const uint8* b, size_t i, size_t n) {
+  while (i < n && a[i] == b[i]) i++;
+  return i;
+}
+
+#ifdef __SSE2__
+// Versões SSE2/AVX2: avançam blocos inteiros enquanto são iguais; param
+// no primeiro byte diferente, ou no fim do último bloco inteiro.
+static size_t eqPrefixSSE2(const uint8* a, const uint8* b, size_t i, size_t n) {
+  for (; i + 16 <= n; i += 16) {
+    __m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+    __m128i vb = _mm_loadu_si128((const __m128i*)(b + i));
+    unsigned diff = ~(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) & 0xFFFFu;
+    if (diff != 0) return i + (size_t)__builtin_ctz(diff);
+  }
+  return i;
+}
+#endif
+
+#ifdef HAVE_AVX2
+__attribute__((target("avx2")))
+static size_t eqPrefixAVX2(const uint8* a, const uint8* b, size_t i, size_t n) {
+  for (; i + 32 <= n; i += 32) {
+    __m256i va = _mm256_loadu_si256((const __m256i*)(a + i));
+    __m256i vb = _mm256_loadu_si256((const __m256i*)(b + i));
+    unsigned diff = ~(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb));
+    if (diff != 0) return i + (size_t)__builtin_ctz(diff);
+  }
+  return i;
+}
+#endif
+
+// Comprimento do prefixo comum de a e b (n bytes)
+static size_t eqPrefix(const uint8* a, const uint8* b, size_t n) {
+  size_t i = 0;
+#ifdef HAVE_AVX2
+  if (useAVX2) i = eqPrefixAVX2(a, b, i, n);
+#endif
+#ifdef __SSE2__
+  i = eqPrefixSSE2(a, b, i, n);
+#endif
+  return eqPrefixScalar(a, b, i, n);
+}
+
+// Comparar img2 com a subimagem de img1 na posição (x, y), somando a
+// *count o número de pixeis comparados (até à primeira diferença).
+static int matchAt(Image img1, int x, int y, Image img2, size_t* count) {
+  size_t w2 = (size_t)img2->width;
+  // Comparar as linhas da imagem2, inteiras
   for (int j = 0; j < img2->height; j++) {
-    for (int i = 0; i < img2->width; i++) {
-      // Obter o valor do pixel da posição (x+i, y+j) da img1
-      uint8 pixel1 = ImageGetPixel(img1, x + i, y + j);
-      // Obter o valor do pixel da posição (i, j) da img2
-      uint8 pixel2 = ImageGetPixel(img2, i, j);
-      // Obter o valor do pixel resultante da mistura
-      uint8 pixel3 = (uint8)((1 - alpha) * pixel1 + 0.5 + alpha * pixel2);
-      // Colar o pixel na posição (x+i, y+j) em img1
-      ImageSetPixel(img1, x + i, y + j, pixel3);
-      //printf("pixel1: %d, pixel2: %d, blendedPixel: %d\n", pixel1, pixel2, pixel3);
+    size_t k = eqPrefix(rowPtr(img1, y + j) + x, rowPtr(img2, j), w2);
+    // Caso os pixeis sejam diferentes retorna 0, implicando que a img2 correspondente a uma subimagem da img1 
+    if (k < w2) {
+      *count += (size_t)j * w2 + k + 1;
+      return 0;
     }
   }
+  *count += w2 * img2->height;
+  return 1; // Caso nem todos os pixeis forem correspondentes então retorna 1
+}
+
+// Pré-filtro da procura direta: em vez de chamar matchAt em todas as
+// posições, procurar na linha as posições onde começa a primeira linha de
+// img2, ou seja, com row[x] == t[0] e row[x+1] == t[1] (se w2 >= 2),
+// comparando blocos de 16/32 bytes de uma vez.
+// Soma a *count as comparações das posições rejeitadas, como o matchAt:
+// 1 se row[x] != t[0], 2 se row[x] == t[0] e row[x+1] != t[1].
+struct prefilter {
+  uint8 t0, t1;
+  int two;        // w2 >= 2: comparar também o segundo pixel
+};
+
+// Primeira posição candidata de row em [x, n[ (ou n).
+// Requer: row[n] pode ser lido, se two.
+static inline int nextCandidateScalar(const uint8* row, int x, int n,
+                                      const struct prefilter* f, size_t* count) {
+  for (; x < n; x++) {
+    if (row[x] != f->t0) { *count += 1; continue; }
+    if (f->two && row[x + 1] != f->t1) { *count += 2; continue; }
+    break;
+  }
+  return x;
 }
 
+#ifdef __SSE2__
+static int nextCandidateSSE2(const uint8* row, int x, int n,
+                             const struct prefilter* f, size_t* count) {
+  __m128i t0 = _mm_set1_epi8((char)f->t0);
+  __m128i t1 = _mm_set1_epi8((char)f->t1);
+  for (; x + 16 <= n; x += 16) {
+    __m128i e0 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(row + x)), t0);
+    __m128i e = f->two ? _mm_and_si128(e0, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(row + x + 1)), t1)) : e0;
+    unsigned m0 = f->two ? (unsigned)_mm_movemask_epi8(e0) : 0;
+    unsigned m = (unsigned)_mm_movemask_epi8(e);
+    int k = m != 0 ? __builtin_ctz(m) : 16;
+    // Rejeitadas: as k posições antes da candidata
+    *count += (size_t)k + (size_t)__builtin_popcount(m0 & ((1u << k) - 1));
+    if (m != 0) return x + k;
+  }
+  return x;
+}
+#endif
 
+#ifdef HAVE_AVX2
+__attribute__((target("avx2,popcnt")))
+static int nextCandidateAVX2(const uint8* row, int x, int n,
+                             const struct prefilter* f, size_t* count) {
+  __m256i t0 = _mm256_set1_epi8((char)f->t0);
+  __m256i t1 = _mm256_set1_epi8((char)f->t1);
+  for (; x + 32 <= n; x += 32) {
+    __m256i e0 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(row + x)), t0);
+    __m256i e = f->two ? _mm256_and_si256(e0, _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(row + x + 1)), t1)) : e0;
+    uint64_t m0 = f->two ? (uint32_t)_mm256_movemask_epi8(e0) : 0;
+    uint32_t m = (uint32_t)_mm256_movemask_epi8(e);
+    int k = m != 0 ? __builtin_ctz(m) : 32;
+    // Rejeitadas: as k posições antes da candidata
+    *count += (size_t)k + (size_t)__builtin_popcountll(m0 & ((1ull << k) - 1));
+    if (m != 0) return x + k;
+  }
+  return x;
+}
+#endif
 
+static int nextCandidate(const uint8* row, int x, int n,
+                         const struct prefilter* f, size_t* count) {
+#ifdef HAVE_AVX2
+  if (useAVX2) {
+    x = nextCandidateAVX2(row, x, n, f, count);
+    if (x + 32 <= n) return x;  // parou numa candidata
+  }
+#endif
+#ifdef __SSE2__
+  x = nextCandidateSSE2(row, x, n, f, count);
+  if (x + 16 <= n) return x;
+#endif
+  return nextCandidateScalar(row, x, n, f, count);
+}
 
 /// Compare an image to a subimage of a larger image.
 /// Returns 1 (true) if img2 matches subimage of img1 at pos (x, y).
@@ -677,115 +2062,2856 @@ int ImageMatchSubImage(Image img1, int x, int y, Image img2) { ///
   assert (img1 != NULL);
   assert (img2 != NULL);
   assert (ImageValidPos(img1, x, y));
+  assert (ImageValidRect(img1, x, y, img2->width, img2->height));
   // Insert your code here!
-
-  // Percorrer os pixeis da imagem2
-  for (int j=0; j < img2->height; j++) {
-    for (int i=0; i < img2->width; i++) {
-      uint8 pixel1 = ImageGetPixel(img1, x + i, y + j); // Obter o valor do pixel da posição (x+i, y+j) da img1 //
-      uint8 pixel2 = ImageGetPixel(img2, i, j); // Obter o valor do pixel da posição (i,j) da img
-      count_locate++;
-      // Caso os pixeis sejam diferentes retorna 0, implicando que a img2 correspondente a uma subimagem da img1 
-      if (pixel1 != pixel2) {
-        return 0;
-      }
-    }
-  }
-  return 1; // Caso nem todos os pixeis forem correspondentes então retorna 1
+  size_t count = 0;
+  int match = matchAt(img1, x, y, img2, &count);
+  COUNT(LOCATECMP, count);
+  COUNT(PIXMEM, 2 * count);  // dois pixeis lidos por comparação
+  return match;
 }
 
 /// Locate a subimage inside another image.
 /// Searches for img2 inside img1.
 /// If a match is found, returns 1 and matching position is set in vars (*px, *py).
 /// If no match is found, returns 0 and (*px, *py) are left untouched.
+/// Uses the default algorithm (LOCATE_AUTO).
 int ImageLocateSubImage(Image img1, int* px, int* py, Image img2) { ///
-  assert (img1 != NULL);
-  assert (img2 != NULL);
-  // Insert your code here!
+  return ImageLocateSubImageUsing(img1, px, py, img2, LOCATE_AUTO);
+}
+
+// As posições candidatas (x, y), com x em [0, nx[ e y em [0, ny[, são
+// divididas em faixas de linhas, procuradas em paralelo.  Cada faixa é
+// percorrida pela ordem de varrimento e regista a primeira posição que
+// encontra em best (o menor índice y*nx+x encontrado até agora, partilhado
+// por todas as faixas).  Uma faixa pára logo que chega a uma linha depois
+// de best, porque já não pode encontrar uma posição anterior.  As faixas
+// antes de best são percorridas até ao fim, por isso best acaba por ser a
+// primeira posição pela ordem de varrimento, como na procura sequencial.
+// Cada faixa conta as suas comparações, somadas no fim.
+
+struct locateJob {
+  Image img1, img2;
+  LocateMode mode;
+  int nx, ny;
+  long best;              // índice da primeira posição encontrada (atómico)
+  size_t* comparisons;    // por faixa
+  unsigned long* pixmem;  // por faixa
+};
+
+// Pode a faixa ainda encontrar uma posição na linha y antes de best?
+static inline int locateLive(struct locateJob* job, int y) {
+  return (long)y * job->nx < __atomic_load_n(&job->best, __ATOMIC_RELAXED);
+}
+
+// Registar a posição (x, y) em best, se for anterior
+static void locateFound(struct locateJob* job, int x, int y) {
+  long index = (long)y * job->nx + x;
+  long best = __atomic_load_n(&job->best, __ATOMIC_RELAXED);
+  while (index < best &&
+         !__atomic_compare_exchange_n(&job->best, &best, index, 0,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+}
 
-  // Obter valores das img1 e img2 para serem usados posteriormente
-  int height = img1->height;
-  int width = img1->width;
-  int height2 = img2->height;
-  int width2 = img2->width;
+static void locateHashRows(struct locateJob* job, int band, int y0, int y1);
 
-  int height3 = height - height2;
-  int width3 = width - width2;
+// Na procura automática (LOCATE_AUTO), a procura direta passa a usar
+// hashing no resto da faixa quando o pré-filtro deixa passar demasiadas
+// candidatas: quando os pixeis comparados pelo matchAt excedem AUTO_RATIO
+// por posição já vista, mais o custo de começar o hashing (h2 linhas).
+// Em imagens sem repetições, quase todas as posições são rejeitadas pelo
+// pré-filtro e a procura direta é muito mais rápida do que o hashing.
+#define AUTO_RATIO 16
 
+// Procura direta: compara img2 com cada posição candidata das linhas [y0, y1[.
+// Se toHash, pode passar a hashing (ver AUTO_RATIO).
+static void locateDirectRows(struct locateJob* job, int band, int y0, int y1,
+                             int toHash) {
+  Image img2 = job->img2;
+  size_t count = 0;
+  size_t verified = 0;  // pixeis comparados pelo matchAt
+  size_t seen = 0;      // posições das linhas anteriores da faixa
+  size_t hashCost = (size_t)img2->height * job->img1->width;
+  int hashFrom = y1;    // primeira linha a procurar com hashing
+  // Sem pixeis em img2, todas as posições servem
+  int filter = img2->width > 0 && img2->height > 0;
+  struct prefilter f = { 0, 0, img2->width >= 2 };
+  if (filter) {
+    f.t0 = rowPtr(img2, 0)[0];
+    f.t1 = f.two ? rowPtr(img2, 0)[1] : 0;
+  }
   // Percorrer todos os pixeis da img1
-  for (int j = 0; j < height3; j++) {
-    for (int i = 0; i < width3; i++) {
+  for (int j = y0; j < y1 && locateLive(job, j); j++) {
+    const uint8* row = rowPtr(job->img1, j);
+    int nx = job->nx;
+    for (int i = filter ? nextCandidate(row, 0, nx, &f, &count) : 0; i < nx;
+         i = filter ? nextCandidate(row, i + 1, nx, &f, &count) : i + 1) {
       // Verifica se a img2 corresponde a uma subimagem da img1
-      if (ImageMatchSubImage(img1, i, j, img2)) {
-        *px = i; // Define o valor de *px
-        *py = j; // Define o valor de *py
-        printf("Número de comparações: %ld\n", count_locate);
-        return 1; // Retorna 1 caso seja localizada uma subimagem
+      size_t before = count;
+      if (matchAt(job->img1, i, j, img2, &count)) {
+        locateFound(job, i, j);
+        j = y1;  // a primeira da faixa: terminar
+        break;
+      }
+      verified += count - before;
+      if (toHash && verified > AUTO_RATIO * (seen + (size_t)i + 1) + hashCost) {
+        // A linha j é procurada de novo, desde o início, com hashing
+        hashFrom = j;
+        j = y1;
+        break;
       }
     }
+    seen += (size_t)nx;
   }
-  printf("Número de comparações: %ld\n", count_locate);
-  return 0; // Retorna 0 caso seja falso
+  job->comparisons[band] += count;
+  job->pixmem[band] += 2 * count;
+  if (hashFrom < y1) locateHashRows(job, band, hashFrom, y1);
 }
 
-/// Filtering
-/// Blur an image by a applying a (2dx+1)x(2dy+1) mean filter.
-/// Each pixel is substituted by the mean of the pixels in the rectangle
-/// [x-dx, x+dx]x[y-dy, y+dy].
-/// The image is changed in-place.
-void ImageBlur(Image img, int dx, int dy) {
-  assert(img != NULL);
+// Procura com hashing rolante 2D (Rabin-Karp).
+//
+// O hash de uma janela de w2 pixeis de uma linha é o polinómio
+//   h = p[x]*B^(w2-1) + p[x+1]*B^(w2-2) + ... + p[x+w2-1]   (mod 2^64)
+// e passa da janela x para x+1 em O(1).  O hash de um retângulo w2 x h2
+// combina da mesma forma, com base C, os hashes das janelas das suas h2
+// linhas, e também passa da linha y para y+1 em O(1) por coluna.
+// Só as posições com o mesmo hash que img2 são verificadas pixel a pixel,
+// pela ordem de varrimento, logo a primeira posição encontrada é a mesma
+// da procura direta.  Custo esperado: O(W*H), para qualquer tamanho de img2.
 
-  int height = img->height;
-  int width = img->width;
-  int maxval = img->maxval;
+#define HASH_B 0x100000001b3ULL       // bases ímpares (mod 2^64)
+#define HASH_C 0x9e3779b97f4a7c15ULL
 
-  // Criar imagem para ser desfocada 
-  Image blurImg = ImageCreate(width, height, maxval);
+static uint64_t powU64(uint64_t b, int e) {
+  uint64_t r = 1;
+  while (e-- > 0) r *= b;
+  return r;
+}
 
-  // Percorrer todos os pixels dessa imagem
-  for (int j = 0; j < height; j++) {
-    for (int i = 0; i < width; i++) {
-      int count = 0;    // Inicialização de uma variável de contagem de pixeis
-      int soma = 0;     // Inicialização de variavel da soma de pixeis 
+// Hashes das janelas de w pixeis de row: out[x] para x em [0, n-w]
+static void rowHashes(const uint8* row, int n, int w, uint64_t Bw, uint64_t* out) {
+  uint64_t h = 0;
+  for (int x = 0; x < w; x++) h = h * HASH_B + row[x];
+  out[0] = h;
+  for (int x = 0; x + w < n; x++) {
+    h = h * HASH_B + row[x + w] - Bw * row[x];
+    out[x + 1] = h;
+  }
+}
 
-      for (int x = -dx; x <= dx; x++) {         // Percorrer pixeis entre as posições (x-dx, x+dx)
-        for (int y = -dy; y <= dy; y++) {       // Percorrer pixeis entre as posições (y-dy, y+dy)
-          if (ImageValidPos(img, i + x, j + y)) {   // Verifica se o posição está dentro da imagem
-            soma += ImageGetPixel(img, i + x, j + y);   // Somar o valor dos pixeis válidos
-            count++;                                    // Incrementa o contador
+// Hash de img
+static uint64_t imageHash(Image img, uint64_t* rh) {
+  uint64_t Bw = powU64(HASH_B, img->width);
+  uint64_t h = 0;
+  for (int r = 0; r < img->height; r++) {
+    rowHashes(rowPtr(img, r), img->width, img->width, Bw, rh);
+    h = h * HASH_C + rh[0];
+  }
+  return h;
+}
 
-            count_blur+=2;                //número de operações ao interar soma e count
-          }   
+static void locateHashRows(struct locateJob* job, int band, int y0, int y1) {
+  Image img1 = job->img1;
+  Image img2 = job->img2;
+  int W = img1->width;
+  int w2 = img2->width;
+  int h2 = img2->height;
+  int nx = job->nx;
+  // col: hash do retângulo em cada coluna, para a linha atual
+  // rh: hashes das janelas de uma linha
+  uint64_t* col = (uint64_t*)malloc((size_t)nx * sizeof(uint64_t));
+  uint64_t* rh = (uint64_t*)malloc((size_t)(W - w2 + 1) * sizeof(uint64_t));
+  if (col == NULL || rh == NULL) {
+    // Sem memória: procura direta nesta faixa
+    free(col);
+    free(rh);
+    locateDirectRows(job, band, y0, y1, 0);
+    return;
+  }
+  uint64_t Bw = powU64(HASH_B, w2);
+  uint64_t Ch = powU64(HASH_C, h2);
+  uint64_t target = imageHash(img2, rh);
+  size_t count = 0;
+  unsigned long rows = (unsigned long)h2;  // linhas da img1 lidas
+
+  // Retângulos na linha y0
+  for (int x = 0; x < nx; x++) col[x] = 0;
+  for (int r = y0; r < y0 + h2; r++) {
+    rowHashes(rowPtr(img1, r), W, w2, Bw, rh);
+    for (int x = 0; x < nx; x++) col[x] = col[x] * HASH_C + rh[x];
+  }
+  for (int y = y0; y < y1 && locateLive(job, y); y++) {
+    if (y > y0) {
+      // Sai a linha y-1, entra a linha y-1+h2
+      rowHashes(rowPtr(img1, y - 1), W, w2, Bw, rh);
+      for (int x = 0; x < nx; x++) col[x] = col[x] * HASH_C - Ch * rh[x];
+      rowHashes(rowPtr(img1, y - 1 + h2), W, w2, Bw, rh);
+      for (int x = 0; x < nx; x++) col[x] += rh[x];
+      rows += 2;
+    }
+    int found = 0;
+    for (int x = 0; x < nx; x++) {
+      if (col[x] == target && matchAt(img1, x, y, img2, &count)) {
+        locateFound(job, x, y);
+        found = 1;
+        break;
+      }
+    }
+    if (found) break;  // a primeira da faixa
+  }
+  job->comparisons[band] += count;
+  job->pixmem[band] += 2 * count + rows * W + (unsigned long)w2 * h2;
+  free(col);
+  free(rh);
+}
+
+static void locateBand(void* arg, int band, int y0, int y1) {
+  struct locateJob* job = (struct locateJob*)arg;
+  if (y0 >= y1 || !locateLive(job, y0)) return;
+  if (job->mode == LOCATE_HASH) {
+    locateHashRows(job, band, y0, y1);
+  } else {
+    locateDirectRows(job, band, y0, y1, job->mode == LOCATE_AUTO);
+  }
+}
+
+/// Locate a subimage like ImageLocateSubImage, using the given algorithm.
+/// If the algorithm cannot get the memory it needs, LOCATE_DIRECT is used.
+/// The candidate rows are searched in parallel by the worker threads
+/// (see ImageSetThreads), with the same result.
+int ImageLocateSubImageUsing(Image img1, int* px, int* py, Image img2, LocateMode mode) { ///
+  assert (img1 != NULL);
+  assert (img2 != NULL);
+  PROFILE(numPixels(img1), numPixels(img1) + numPixels(img2), 0);
+  // Insert your code here!
+
+  // Posições candidatas
+  int nx = img1->width - img2->width;
+  int ny = img1->height - img2->height;
+  if (nx <= 0 || ny <= 0) {
+    return 0;
+  }
+
+  // Faixas mais pequenas do que o número de threads: quando uma encontra
+  // img2, as faixas seguintes que ainda não começaram já não correm.
+  // No hashing, cada faixa tem de calcular h2 linhas antes de começar.
+  int nbands = numBands((long)img1->width * img1->height, ny);
+  if (nbands > 1) {
+    int minRows = mode == LOCATE_HASH ? 2 * (img2->height > 0 ? img2->height : 1) : 1;
+    nbands = 4 * nbands < ny / minRows ? 4 * nbands : ny / minRows;
+    if (nbands < 1) nbands = 1;
+  }
+  size_t comparisons[nbands];
+  unsigned long pixmem[nbands];
+  for (int i = 0; i < nbands; i++) {
+    comparisons[i] = 0;
+    pixmem[i] = 0;
+  }
+  struct locateJob job = { img1, img2, mode, nx, ny, LONG_MAX, comparisons, pixmem };
+  forBands(ny, nbands, locateBand, &job);
+
+  // Juntar as estatísticas das faixas
+  for (int i = 0; i < nbands; i++) {
+    LOCATECMP += comparisons[i];
+    PIXMEM += pixmem[i];
+  }
+  if (job.best == LONG_MAX) return 0;
+  *px = (int)(job.best % nx);
+  *py = (int)(job.best / nx);
+  return 1;
+}
+
+/// Haystack indexes
+
+// O índice de uma imagem guarda o hash (o mesmo da procura com hashing
+// rolante) de cada bloco de B x B pixeis da imagem, em todas as posições,
+// agrupando as posições (y*W + x) pelo hash:
+//   keys[0..nkeys[        hashes distintos, por ordem crescente
+//   first[0..nkeys]       as posições com hash keys[k] estão em
+//   pos[0..npos[          pos[first[k]..first[k+1][, por ordem de varrimento
+// Para procurar img2 (pelo menos B x B), escolhe-se um dos seus blocos
+// (bx, by) com poucas posições no índice: img2 só pode estar em
+// (x-bx, y-by) para essas posições (x, y), verificadas pela ordem de
+// varrimento.  A primeira que serve é a primeira ocorrência de img2.
+//
+// No ficheiro, a seguir a struct indexHeader vêm keys, first e pos, na
+// ordem dos bytes da máquina.  ImageIndexLoad mapeia o ficheiro em
+// memória, por isso carregar o índice não o lê todo.
+
+struct imageindex {
+  Image img;              // a imagem indexada (não pertence ao índice)
+  unsigned long version;  // versão dos pixeis da imagem indexada
+  int block;
+  size_t nkeys, npos;
+  uint64_t* keys;
+  uint32_t* first;
+  uint32_t* pos;
+  uint8* map;             // índices carregados: o ficheiro mapeado
+  size_t mapLen;
+};
+
+struct indexHeader {
+  char magic[8];          // INDEX_MAGIC
+  int32_t width, height;  // da imagem
+  int32_t block, unused;
+  uint64_t nkeys, npos;
+  uint64_t fingerprint;   // hash de todos os pixeis da imagem
+};
+
+#define INDEX_MAGIC "I8INDEX1"
+
+// Hash de todos os pixeis de img, para verificar que o índice é dela
+static uint64_t imageFingerprint(Image img) {
+  uint64_t h = (uint64_t)img->width * HASH_C + (uint64_t)img->height;
+  for (int y = 0; y < img->height; y++) {
+    const uint8* row = rowPtr(img, y);
+    for (int x = 0; x < img->width; x++) h = h * HASH_B + row[x];
+  }
+  return h;
+}
+
+// Hash do bloco B x B de img na posição (x, y), como na procura rolante
+static uint64_t blockHash(Image img, int x, int y, int B) {
+  uint64_t h = 0;
+  for (int r = 0; r < B; r++) {
+    const uint8* row = rowPtr(img, y + r) + x;
+    uint64_t rh = 0;
+    for (int i = 0; i < B; i++) rh = rh * HASH_B + row[i];
+    h = h * HASH_C + rh;
+  }
+  return h;
+}
+
+struct indexEntry {
+  uint64_t hash;
+  uint32_t pos;
+};
+
+struct indexArgs {
+  Image img;
+  int block;
+  int nx;                   // posições dos blocos por linha
+  uint64_t* buf;            // por faixa: 2*nx
+  struct indexEntry* entry; // entry[y*nx + x]: bloco na posição (x, y)
+};
+
+// Hashes dos blocos nas linhas [y0, y1[ (como em locateHashRows)
+static void indexBand(void* arg, int band, int y0, int y1) {
+  struct indexArgs* args = (struct indexArgs*)arg;
+  Image img = args->img;
+  int B = args->block;
+  int nx = args->nx;
+  uint64_t* col = args->buf + 2 * (size_t)band * nx;
+  uint64_t* rh = col + nx;
+  uint64_t Bw = powU64(HASH_B, B);
+  uint64_t Ch = powU64(HASH_C, B);
+  if (y0 >= y1) return;
+  for (int x = 0; x < nx; x++) col[x] = 0;
+  for (int r = y0; r < y0 + B; r++) {
+    rowHashes(rowPtr(img, r), img->width, B, Bw, rh);
+    for (int x = 0; x < nx; x++) col[x] = col[x] * HASH_C + rh[x];
+  }
+  for (int y = y0; y < y1; y++) {
+    if (y > y0) {
+      rowHashes(rowPtr(img, y - 1), img->width, B, Bw, rh);
+      for (int x = 0; x < nx; x++) col[x] = col[x] * HASH_C - Ch * rh[x];
+      rowHashes(rowPtr(img, y - 1 + B), img->width, B, Bw, rh);
+      for (int x = 0; x < nx; x++) col[x] += rh[x];
+    }
+    struct indexEntry* e = args->entry + (size_t)y * nx;
+    for (int x = 0; x < nx; x++) {
+      e[x].hash = col[x];
+      e[x].pos = (uint32_t)((size_t)y * img->width + x);
+    }
+  }
+  COUNT(PIXMEM, (unsigned long)(y1 - y0 + B) * img->width);
+}
+
+// Ordenar e[0..n[ por hash, mantendo a ordem das posições com o mesmo
+// hash (radix sort LSD, 4 passagens de 16 bits).  Retorna 0 se não houver memória.
+static int sortEntries(struct indexEntry* e, size_t n) {
+  struct indexEntry* tmp = (struct indexEntry*)malloc((n > 0 ? n : 1) * sizeof(struct indexEntry));
+  size_t* count = (size_t*)malloc(65536 * sizeof(size_t));
+  if (!check( tmp != NULL && count != NULL, "Falha na alocação de memória para o índice" )) {
+    free(tmp);
+    free(count);
+    return 0;
+  }
+  for (int shift = 0; shift < 64; shift += 16) {
+    for (int d = 0; d < 65536; d++) count[d] = 0;
+    for (size_t i = 0; i < n; i++) count[(e[i].hash >> shift) & 0xFFFF]++;
+    size_t sum = 0;
+    for (int d = 0; d < 65536; d++) {
+      size_t c = count[d];
+      count[d] = sum;
+      sum += c;
+    }
+    for (size_t i = 0; i < n; i++) tmp[count[(e[i].hash >> shift) & 0xFFFF]++] = e[i];
+    memcpy(e, tmp, n * sizeof(struct indexEntry));
+  }
+  free(tmp);
+  free(count);
+  return 1;
+}
+
+/// Build the index of an image for repeated exact searches.
+/// The index records the hash of every block of block x block pixels of
+/// img, so that ImageIndexLocate can search for any img2 at least that
+/// large by checking only the positions of one of its blocks.
+/// Building costs O(N) time and about 32 bytes per pixel of temporary
+/// memory, for N pixels in img; the index itself uses 4 to 16 bytes per
+/// pixel.  Larger blocks give more selective indexes.
+/// The index refers to img: img must not change or be destroyed while
+/// the index is used.
+/// Requires: 0 < block <= width and height of img.
+/// On success, a new index is returned.
+/// (The caller is responsible for destroying the returned index!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+ImageIndex ImageIndexCreate(Image img, int block) { ///
+  assert (img != NULL);
+  assert (0 < block && block <= img->width && block <= img->height);
+  PROFILE(numPixels(img), numPixels(img), 0);
+  int nx = img->width - block + 1;
+  int ny = img->height - block + 1;
+  size_t n = (size_t)nx * ny;
+  int nbands = numBands((long)img->width * img->height, ny);
+
+  ImageIndex idx = NULL;
+  struct indexEntry* entry = NULL;
+  uint64_t* buf = NULL;
+  int success =
+  check( (uint64_t)img->width * img->height <= UINT32_MAX, "Image too large to index" ) &&
+  check( (idx = (ImageIndex)calloc(1, sizeof(struct imageindex))) != NULL &&
+         (entry = (struct indexEntry*)malloc(n * sizeof(struct indexEntry))) != NULL &&
+         (buf = (uint64_t*)malloc(2 * (size_t)nbands * nx * sizeof(uint64_t))) != NULL,
+         "Falha na alocação de memória para o índice" );
+  if (success) {
+    struct indexArgs args = { img, block, nx, buf, entry };
+    forBands(ny, nbands, indexBand, &args);
+    success = sortEntries(entry, n);
+  }
+  // Agrupar as posições por hash
+  size_t nkeys = 0;
+  for (size_t i = 0; success && i < n; i++) {
+    if (i == 0 || entry[i].hash != entry[i - 1].hash) nkeys++;
+  }
+  success = success &&
+  check( (idx->keys = (uint64_t*)malloc((nkeys > 0 ? nkeys : 1) * sizeof(uint64_t))) != NULL &&
+         (idx->first = (uint32_t*)malloc((nkeys + 1) * sizeof(uint32_t))) != NULL &&
+         (idx->pos = (uint32_t*)malloc(n * sizeof(uint32_t))) != NULL,
+         "Falha na alocação de memória para o índice" );
+  if (success) {
+    idx->img = img;
+    idx->version = versionOf(img);
+    idx->block = block;
+    idx->nkeys = nkeys;
+    idx->npos = n;
+    size_t k = 0;
+    for (size_t i = 0; i < n; i++) {
+      if (i == 0 || entry[i].hash != entry[i - 1].hash) {
+        idx->keys[k] = entry[i].hash;
+        idx->first[k++] = (uint32_t)i;
+      }
+      idx->pos[i] = entry[i].pos;
+    }
+    idx->first[nkeys] = (uint32_t)n;
+  }
+
+  errsave = errno;
+  free(entry);
+  free(buf);
+  if (!success) ImageIndexDestroy(&idx);
+  errno = errsave;
+  return idx;
+}
+
+/// Destroy the index pointed to by (*idxp).
+/// If (*idxp)==NULL, no operation is performed.
+/// Ensures: (*idxp)==NULL.
+/// Should never fail, and should preserve global errno/errCause.
+void ImageIndexDestroy(ImageIndex* idxp) { ///
+  assert (idxp != NULL);
+  ImageIndex idx = *idxp;
+  if (idx == NULL) return;
+  if (idx->map != NULL) {
+    errsave = errno;
+    munmap(idx->map, idx->mapLen);
+    errno = errsave;
+  } else {
+    free(idx->keys);
+    free(idx->first);
+    free(idx->pos);
+  }
+  free(idx);
+  *idxp = NULL;
+}
+
+/// Block size of the index.
+int ImageIndexBlock(ImageIndex idx) { ///
+  assert (idx != NULL);
+  return idx->block;
+}
+
+/// Save the index to a file.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// a partial and invalid file may be left in the system.
+int ImageIndexSave(ImageIndex idx, const char* filename) { ///
+  assert (idx != NULL);
+  assert (versionOf(idx->img) == idx->version);
+  struct indexHeader hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, INDEX_MAGIC, sizeof(hdr.magic));
+  hdr.width = idx->img->width;
+  hdr.height = idx->img->height;
+  hdr.block = idx->block;
+  hdr.nkeys = idx->nkeys;
+  hdr.npos = idx->npos;
+  hdr.fingerprint = imageFingerprint(idx->img);
+  FILE* f = NULL;
+  int success =
+  check( (f = fopen(filename, "wb")) != NULL, "Open failed" ) &&
+  check( fwrite(&hdr, sizeof(hdr), 1, f) == 1 &&
+         fwrite(idx->keys, sizeof(uint64_t), idx->nkeys, f) == idx->nkeys &&
+         fwrite(idx->first, sizeof(uint32_t), idx->nkeys + 1, f) == idx->nkeys + 1 &&
+         fwrite(idx->pos, sizeof(uint32_t), idx->npos, f) == idx->npos,
+         "Writing index failed" );
+  if (f != NULL) {
+    success = check( fclose(f) == 0, "Writing index failed" ) && success;
+  }
+  return success;
+}
+
+/// Load the index of img from a file saved by ImageIndexSave.
+/// The file is mapped into memory (and read only as needed by searches).
+/// The index must have been built from an image with the same pixels as
+/// img (this is verified), and then refers to img, as in ImageIndexCreate.
+/// On success, a new index is returned.
+/// (The caller is responsible for destroying the returned index!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+ImageIndex ImageIndexLoad(Image img, const char* filename) { ///
+  assert (img != NULL);
+  int fd = -1;
+  struct stat st;
+  ImageIndex idx = NULL;
+  uint8* map = MAP_FAILED;
+  struct indexHeader hdr;
+  int success =
+  check( (fd = open(filename, O_RDONLY)) >= 0, "Open failed" ) &&
+  check( fstat(fd, &st) == 0, "Stat failed" ) &&
+  check( (size_t)st.st_size >= sizeof(hdr), "Invalid index file" ) &&
+  check( (map = (uint8*)mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) != MAP_FAILED,
+         "Mapping failed" );
+  if (success) memcpy(&hdr, map, sizeof(hdr));
+  success = success &&
+  check( memcmp(hdr.magic, INDEX_MAGIC, sizeof(hdr.magic)) == 0, "Invalid index file" ) &&
+  check( hdr.width == img->width && hdr.height == img->height, "Index does not match the image" ) &&
+  check( 0 < hdr.block && hdr.block <= hdr.width && hdr.block <= hdr.height &&
+         hdr.npos == (uint64_t)(hdr.width - hdr.block + 1) * (hdr.height - hdr.block + 1) &&
+         hdr.nkeys <= hdr.npos &&
+         (size_t)st.st_size == sizeof(hdr) + hdr.nkeys * sizeof(uint64_t) +
+                               (hdr.nkeys + 1 + hdr.npos) * sizeof(uint32_t),
+         "Invalid index file" ) &&
+  check( hdr.fingerprint == imageFingerprint(img), "Index does not match the image" ) &&
+  check( (idx = (ImageIndex)calloc(1, sizeof(struct imageindex))) != NULL,
+         "Falha na alocação de memória para o índice" );
+  if (success) {
+    idx->img = img;
+    idx->version = versionOf(img);
+    idx->block = hdr.block;
+    idx->nkeys = hdr.nkeys;
+    idx->npos = hdr.npos;
+    idx->keys = (uint64_t*)(map + sizeof(hdr));
+    idx->first = (uint32_t*)(idx->keys + idx->nkeys);
+    idx->pos = idx->first + idx->nkeys + 1;
+    idx->map = map;
+    idx->mapLen = (size_t)st.st_size;
+    // Os grupos têm de estar dentro de pos
+    for (size_t k = 0; success && k < idx->nkeys; k++) {
+      success = check( idx->first[k] <= idx->first[k + 1], "Invalid index file" );
+    }
+    success = success && check( idx->first[idx->nkeys] == idx->npos, "Invalid index file" );
+  }
+
+  errsave = errno;
+  if (fd >= 0) close(fd);
+  if (!success) {
+    if (idx != NULL) {
+      ImageIndexDestroy(&idx);
+    } else if (map != MAP_FAILED) {
+      munmap(map, (size_t)st.st_size);
+    }
+  }
+  errno = errsave;
+  return idx;
+}
+
+// Número de posições do índice com o hash h; *start é a primeira
+static size_t indexLookup(ImageIndex idx, uint64_t h, size_t* start) {
+  size_t lo = 0, hi = idx->nkeys;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (idx->keys[mid] < h) lo = mid + 1;
+    else hi = mid;
+  }
+  if (lo == idx->nkeys || idx->keys[lo] != h) return 0;
+  *start = idx->first[lo];
+  return idx->first[lo + 1] - idx->first[lo];
+}
+
+/// Locate a subimage inside the indexed image.
+/// Searches for img2 inside the image of idx, like ImageLocateSubImage,
+/// but only at the positions where one of the blocks of img2 occurs in
+/// the image, according to the index.  Finds the first match in raster
+/// order, over all positions where img2 fits.
+/// If img2 is smaller than the block size, all positions are searched.
+/// If a match is found, returns 1 and matching position is set in vars (*px, *py).
+/// If no match is found, returns 0 and (*px, *py) are left untouched.
+/// Requires: the indexed image has not changed.
+int ImageIndexLocate(ImageIndex idx, int* px, int* py, Image img2) { ///
+  assert (idx != NULL);
+  assert (img2 != NULL);
+  PROFILE(numPixels(idx->img), numPixels(idx->img) + numPixels(img2), 0);
+  Image img1 = idx->img;
+  assert (versionOf(img1) == idx->version);
+  int W = img1->width;
+  int w2 = img2->width;
+  int h2 = img2->height;
+  int B = idx->block;
+  if (w2 > W || h2 > img1->height) return 0;
+  size_t count = 0;
+  int found = 0;
+
+  if (w2 < B || h2 < B) {
+    // Modelo pequeno: procura direta
+    for (int y = 0; !found && y + h2 <= img1->height; y++) {
+      for (int x = 0; !found && x + w2 <= W; x++) {
+        if (matchAt(img1, x, y, img2, &count)) {
+          *px = x;
+          *py = y;
+          found = 1;
         }
       }
+    }
+  } else {
+    // Escolher o bloco de img2 com menos posições (na grelha de passo B)
+    size_t best = SIZE_MAX, start = 0;
+    int bx = 0, by = 0;
+    for (int j = 0; best > 0 && j < h2; j += B) {
+      int y = j + B <= h2 ? j : h2 - B;
+      for (int i = 0; best > 0 && i < w2; i += B) {
+        int x = i + B <= w2 ? i : w2 - B;
+        size_t s = 0;
+        size_t c = indexLookup(idx, blockHash(img2, x, y, B), &s);
+        if (c < best) {
+          best = c;
+          start = s;
+          bx = x;
+          by = y;
+        }
+      }
+    }
+    PIXMEM += (unsigned long)w2 * h2;  // no máximo, todos os pixeis de img2
+    // Verificar as posições candidatas, pela ordem de varrimento
+    for (size_t k = 0; !found && k < best; k++) {
+      uint32_t p = idx->pos[start + k];
+      int x = (int)(p % (uint32_t)W) - bx;
+      int y = (int)(p / (uint32_t)W) - by;
+      if (x >= 0 && y >= 0 && x + w2 <= W && y + h2 <= img1->height &&
+          matchAt(img1, x, y, img2, &count)) {
+        *px = x;
+        *py = y;
+        found = 1;
+      }
+    }
+  }
+  COUNT(LOCATECMP, count);
+  COUNT(PIXMEM, 2 * count);  // dois pixeis lidos por comparação
+  return found;
+}
 
-      // Calcula a média dos valores dos pixeis arredondados
-      uint8 pixel;
-      if (count == 0) {
-        pixel = ImageGetPixel(img, i, j);
-        count_blur++;                //número de operações para calcular pixel
+/// Multi-template search
+
+// Algoritmo de Baker-Bird: procura todos os modelos numa só passagem.
+//
+// 1. As linhas (distintas) de todos os modelos são inseridas num autómato
+//    de Aho-Corasick sobre bytes.  Percorrendo cada linha da imagem com o
+//    autómato, sabe-se, em cada posição x, que linha de modelo termina em
+//    x, para cada largura de modelo (no máximo uma por largura).
+// 2. Cada modelo é a sequência dos números das suas linhas.  Para cada
+//    largura, as sequências dos modelos dessa largura são inseridas noutro
+//    autómato de Aho-Corasick, que avança em cada coluna x com o número da
+//    linha que termina em (x, y).  Quando chega ao fim de um modelo, este
+//    ocorre com o canto inferior direito em (x, y).
+// Custo: O(W*H*K + ocorrências) para K larguras distintas, mais a
+// construção dos autómatos, linear no tamanho dos modelos.
+
+// Autómato de Aho-Corasick sobre símbolos inteiros [0, nsym[.
+// Os filhos de cada nó estão numa lista (sibling), exceto os da raiz
+// (nó 0), numa tabela, para as falhas que voltam à raiz custarem O(1).
+struct acNode {
+  int child;    // primeiro filho (-1 se nenhum)
+  int sibling;  // próximo irmão
+  int sym;      // símbolo da aresta do pai
+  int depth;
+  int fail;     // maior sufixo próprio que é um nó
+  int out;      // chave que termina neste nó (-1 se nenhuma)
+  int dict;     // sufixo mais próximo com out != -1 (-1 se nenhum)
+};
+
+struct ac {
+  struct acNode* node;
+  int nnodes, capacity;
+  int* root;    // root[c]: filho da raiz com símbolo c (0 se nenhum)
+  int nsym;
+};
+
+static int acInit(struct ac* a, int nsym) {
+  a->nsym = nsym;
+  a->nnodes = 0;
+  a->capacity = 0;
+  a->node = NULL;
+  a->root = (int*)calloc((size_t)nsym + 1, sizeof(int));
+  return check( a->root != NULL, "Falha na alocação de memória para o autómato" );
+}
+
+static void acFree(struct ac* a) {
+  free(a->node);
+  free(a->root);
+  a->node = NULL;
+  a->root = NULL;
+}
+
+// Novo nó; retorna -1 se não houver memória
+static int acNew(struct ac* a, int sym, int depth) {
+  if (a->nnodes == a->capacity) {
+    int capacity = a->capacity == 0 ? 256 : 2 * a->capacity;
+    struct acNode* node = (struct acNode*)realloc(a->node, (size_t)capacity * sizeof(struct acNode));
+    if (!check( node != NULL, "Falha na alocação de memória para o autómato" )) return -1;
+    a->node = node;
+    a->capacity = capacity;
+  }
+  struct acNode* n = &a->node[a->nnodes];
+  n->child = -1;
+  n->sibling = -1;
+  n->sym = sym;
+  n->depth = depth;
+  n->fail = 0;
+  n->out = -1;
+  n->dict = -1;
+  return a->nnodes++;
+}
+
+// Filho de u com símbolo c (-1 se não existir; 0 para a raiz)
+static inline int acChild(const struct ac* a, int u, int c) {
+  if (u == 0) return a->root[c] != 0 ? a->root[c] : -1;
+  for (int v = a->node[u].child; v != -1; v = a->node[v].sibling) {
+    if (a->node[v].sym == c) return v;
+  }
+  return -1;
+}
+
+// Inserir a chave key[0..n[; retorna o nó final, ou -1 se não houver memória
+static int acInsert(struct ac* a, const int* key, int n) {
+  int u = 0;
+  for (int i = 0; i < n; i++) {
+    int v = acChild(a, u, key[i]);
+    if (v == -1) {
+      v = acNew(a, key[i], i + 1);
+      if (v == -1) return -1;
+      if (u == 0) {
+        a->root[key[i]] = v;
       } else {
-        pixel = (uint8)((soma + count / 2) / count);
-        count_blur+=3;                //número de operações para calcular pixel
+        a->node[v].sibling = a->node[u].child;
+        a->node[u].child = v;
+      }
+    }
+    u = v;
+  }
+  return u;
+}
+
+// Avançar do estado s com o símbolo c
+static inline int acStep(const struct ac* a, int s, int c) {
+  for (;;) {
+    int v = acChild(a, s, c);
+    if (v != -1) return v;
+    if (s == 0) return 0;
+    s = a->node[s].fail;
+  }
+}
+
+// Calcular as ligações de falha e de dicionário (percurso em largura).
+// Retorna 0 se não houver memória.
+static int acBuild(struct ac* a) {
+  int* queue = (int*)malloc((size_t)a->nnodes * sizeof(int));
+  if (!check( queue != NULL, "Falha na alocação de memória para o autómato" )) return 0;
+  int head = 0, tail = 0;
+  for (int c = 0; c < a->nsym; c++) {
+    if (a->root[c] != 0) queue[tail++] = a->root[c];   // fail = 0
+  }
+  while (head < tail) {
+    int u = queue[head++];
+    for (int v = a->node[u].child; v != -1; v = a->node[v].sibling) {
+      int f = acStep(a, a->node[u].fail, a->node[v].sym);
+      a->node[v].fail = f;
+      a->node[v].dict = a->node[f].out != -1 ? f : a->node[f].dict;
+      queue[tail++] = v;
+    }
+  }
+  free(queue);
+  return 1;
+}
+
+// A procura: autómato das linhas e, por largura, autómato das colunas
+struct bakerBird {
+  struct ac rows;
+  int nwidths;
+  int* width;       // larguras distintas
+  int* classOf;     // classOf[w]: índice da largura w (-1 se nenhum modelo)
+  struct ac* cols;  // por largura
+  int* rowSym;      // rowSym[nó das linhas]: número da linha que termina aí
+  int* next;        // next[t]: próximo modelo com as mesmas linhas que t
+};
+
+// Acrescentar uma ocorrência ao vetor *occ
+static int addOccurrence(ImageOccurrence** occ, int* n, int* capacity, int id, int x, int y) {
+  if (*n == *capacity) {
+    int c = *capacity == 0 ? 16 : 2 * *capacity;
+    ImageOccurrence* o = (ImageOccurrence*)realloc(*occ, (size_t)c * sizeof(ImageOccurrence));
+    if (!check( o != NULL, "Falha na alocação de memória para as ocorrências" )) return 0;
+    *occ = o;
+    *capacity = c;
+  }
+  (*occ)[*n].id = id;
+  (*occ)[*n].x = x;
+  (*occ)[*n].y = y;
+  (*n)++;
+  return 1;
+}
+
+// Ordem de varrimento do canto superior esquerdo, depois o modelo
+static int occurrenceCmp(const void* a, const void* b) {
+  const ImageOccurrence* p = (const ImageOccurrence*)a;
+  const ImageOccurrence* q = (const ImageOccurrence*)b;
+  if (p->y != q->y) return p->y < q->y ? -1 : 1;
+  if (p->x != q->x) return p->x < q->x ? -1 : 1;
+  return (p->id > q->id) - (p->id < q->id);
+}
+
+static void bakerBirdFree(struct bakerBird* bb) {
+  acFree(&bb->rows);
+  for (int k = 0; bb->cols != NULL && k < bb->nwidths; k++) acFree(&bb->cols[k]);
+  free(bb->cols);
+  free(bb->width);
+  free(bb->classOf);
+  free(bb->rowSym);
+  free(bb->next);
+}
+
+// Construir os autómatos dos modelos tpl[0..n[.  Retorna 0 se não houver memória.
+static int bakerBirdBuild(struct bakerBird* bb, int n, Image tpl[]) {
+  memset(bb, 0, sizeof(*bb));
+  int maxw = 0, maxh = 0;
+  for (int t = 0; t < n; t++) {
+    if (tpl[t]->width > maxw) maxw = tpl[t]->width;
+    if (tpl[t]->height > maxh) maxh = tpl[t]->height;
+  }
+  int* key = (int*)malloc((size_t)(maxw > maxh ? maxw : maxh) * sizeof(int));
+  int** rowNode = (int**)calloc((size_t)n, sizeof(int*));  // nó de cada linha de cada modelo
+  int success =
+  check( key != NULL && rowNode != NULL, "Falha na alocação de memória para o autómato" ) &&
+  acInit(&bb->rows, 256) &&
+  acNew(&bb->rows, -1, 0) == 0 &&
+  check( (bb->classOf = (int*)malloc((size_t)(maxw + 1) * sizeof(int))) != NULL &&
+         (bb->width = (int*)malloc((size_t)n * sizeof(int))) != NULL &&
+         (bb->next = (int*)malloc((size_t)n * sizeof(int))) != NULL,
+         "Falha na alocação de memória para o autómato" );
 
+  // 1. Linhas dos modelos
+  for (int w = 0; success && w <= maxw; w++) bb->classOf[w] = -1;
+  for (int t = 0; success && t < n; t++) {
+    Image img = tpl[t];
+    success = check( (rowNode[t] = (int*)malloc((size_t)img->height * sizeof(int))) != NULL,
+                     "Falha na alocação de memória para o autómato" );
+    for (int r = 0; success && r < img->height; r++) {
+      const uint8* row = rowPtr(img, r);
+      for (int i = 0; i < img->width; i++) key[i] = row[i];
+      success = (rowNode[t][r] = acInsert(&bb->rows, key, img->width)) != -1;
+    }
+    if (success && bb->classOf[img->width] == -1) {
+      bb->classOf[img->width] = bb->nwidths;
+      bb->width[bb->nwidths++] = img->width;
+    }
+  }
+  // Numerar as linhas distintas
+  int nrows = 0;
+  success = success &&
+  check( (bb->rowSym = (int*)malloc((size_t)bb->rows.nnodes * sizeof(int))) != NULL,
+         "Falha na alocação de memória para o autómato" );
+  for (int u = 0; success && u < bb->rows.nnodes; u++) bb->rowSym[u] = -1;
+  for (int t = 0; success && t < n; t++) {
+    for (int r = 0; r < tpl[t]->height; r++) {
+      int u = rowNode[t][r];
+      if (bb->rowSym[u] == -1) {
+        bb->rowSym[u] = nrows++;
+        bb->rows.node[u].out = bb->rowSym[u];
       }
-      ImageSetPixel(blurImg, i, j, pixel);      // Define o valor na imagem desfocada
     }
   }
+  success = success && acBuild(&bb->rows);
 
-  // Percorre os valores da imagem desfocada de modo a substituí-los na imagem original
-  for (int y = 0; y < height; y++) {
-    for (int x = 0; x < width; x++) {
-      uint8 blurredPixel = ImageGetPixel(blurImg, x, y);
-      count_blur++;                //número de operações de blurredPixel
-      ImageSetPixel(img, x, y, blurredPixel); // Substitui os pixeis pelos valores filtrados
+  // 2. Colunas: um autómato por largura
+  success = success &&
+  check( (bb->cols = (struct ac*)calloc((size_t)(bb->nwidths > 0 ? bb->nwidths : 1), sizeof(struct ac))) != NULL,
+         "Falha na alocação de memória para o autómato" );
+  for (int k = 0; success && k < bb->nwidths; k++) {
+    success = acInit(&bb->cols[k], nrows) && acNew(&bb->cols[k], -1, 0) == 0;
+  }
+  for (int t = 0; success && t < n; t++) {
+    struct ac* a = &bb->cols[bb->classOf[tpl[t]->width]];
+    for (int r = 0; r < tpl[t]->height; r++) key[r] = bb->rowSym[rowNode[t][r]];
+    int u = acInsert(a, key, tpl[t]->height);
+    success = u != -1;
+    if (success) {
+      // Modelos iguais partilham o nó: lista ligada por next
+      bb->next[t] = a->node[u].out;
+      a->node[u].out = t;
     }
   }
+  for (int k = 0; success && k < bb->nwidths; k++) success = acBuild(&bb->cols[k]);
 
-  printf("Número de operações relevantes: %ld\n", count_blur);
-  // Libertar a memória
-  ImageDestroy(&blurImg);
+  for (int t = 0; rowNode != NULL && t < n; t++) free(rowNode[t]);
+  free(rowNode);
+  free(key);
+  if (!success) {
+    errsave = errno;
+    bakerBirdFree(bb);
+    errno = errsave;
+  }
+  return success;
+}
+
+/// Locate all occurrences of several templates inside an image.
+/// Searches for each of the ntemplates images tpl[0..ntemplates[ inside
+/// img, in a single pass over img (Baker-Bird algorithm), and finds all
+/// positions (x, y) where ImageMatchSubImage(img, x, y, tpl[id]) is true.
+/// Requires: the templates are not empty (width and height > 0).
+/// On success, returns a new array with the occurrences, sorted by y, x
+/// and template id, and sets *noccurrences to their number.
+/// (The caller is responsible for freeing the array!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+ImageOccurrence* ImageLocateAll(Image img, int ntemplates, Image tpl[], int* noccurrences) { ///
+  assert (img != NULL);
+  assert (ntemplates >= 0);
+  assert (noccurrences != NULL);
+  PROFILE(numPixels(img), numPixels(img), 0);
+  for (int t = 0; t < ntemplates; t++) {
+    assert (tpl[t] != NULL);
+    assert (tpl[t]->width > 0 && tpl[t]->height > 0);
+  }
+  int W = img->width;
+  int H = img->height;
+  struct bakerBird bb;
+  if (!bakerBirdBuild(&bb, ntemplates, tpl)) return NULL;
+
+  // Por largura k: label[k*W + x] é o número da linha de largura k que
+  // termina em (x, y) (-1 se nenhuma), e state[k*W + x] o estado do
+  // autómato das colunas na coluna x
+  int K = bb.nwidths;
+  int* label = (int*)malloc((size_t)K * W * sizeof(int) + 1);
+  int* state = (int*)calloc((size_t)K * W + 1, sizeof(int));
+  ImageOccurrence* occ = NULL;
+  int nocc = 0, capacity = 0;
+  int success =
+  check( label != NULL && state != NULL, "Falha na alocação de memória para a procura" ) &&
+  check( (occ = (ImageOccurrence*)malloc(sizeof(ImageOccurrence))) != NULL,
+         "Falha na alocação de memória para as ocorrências" );
+  if (success) capacity = 1;
+
+  for (int y = 0; success && y < H; y++) {
+    // Linhas dos modelos que terminam em cada x
+    const uint8* row = rowPtr(img, y);
+    for (int i = 0; i < K * W; i++) label[i] = -1;
+    int s = 0;
+    for (int x = 0; x < W; x++) {
+      s = acStep(&bb.rows, s, row[x]);
+      for (int u = bb.rows.node[s].out != -1 ? s : bb.rows.node[s].dict; u != -1; u = bb.rows.node[u].dict) {
+        label[bb.classOf[bb.rows.node[u].depth] * W + x] = bb.rows.node[u].out;
+      }
+    }
+    // Avançar os autómatos das colunas
+    for (int k = 0; success && k < K; k++) {
+      struct ac* a = &bb.cols[k];
+      for (int x = bb.width[k] - 1; success && x < W; x++) {
+        int c = label[k * W + x];
+        int cs = c == -1 ? 0 : acStep(a, state[k * W + x], c);
+        state[k * W + x] = cs;
+        for (int u = a->node[cs].out != -1 ? cs : a->node[cs].dict; success && u != -1; u = a->node[u].dict) {
+          for (int t = a->node[u].out; success && t != -1; t = bb.next[t]) {
+            success = addOccurrence(&occ, &nocc, &capacity, t, x - bb.width[k] + 1, y - tpl[t]->height + 1);
+          }
+        }
+      }
+    }
+  }
+  PIXMEM += (unsigned long)W * H;  // count pixel memory accesses
+
+  free(label);
+  free(state);
+  bakerBirdFree(&bb);
+  if (!success) {
+    errsave = errno;
+    free(occ);
+    errno = errsave;
+    return NULL;
+  }
+  qsort(occ, (size_t)nocc, sizeof(ImageOccurrence), occurrenceCmp);
+  *noccurrences = nocc;
+  return occ;
+}
+
+/// Approximate matching
+
+// Distâncias entre linhas
+//
+// A SAD de n bytes usa psadbw (_mm_sad_epu8/_mm256_sad_epu8), que soma
+// as diferenças absolutas de 8 bytes de uma vez.  Na SSD os bytes passam
+// a 16 bits e pmaddwd soma os quadrados das diferenças aos pares, em
+// somas de 32 bits, passadas a 64 bits a cada SSD_CHUNK bytes para não
+// transbordarem.
+
+#define SSD_CHUNK 8192  // 8192/8 * 2 * 255^2 < 2^32 por soma de 32 bits
+
+// Distância de a e b a partir do byte i (as funções SIMD tratam os blocos
+// inteiros e retornam onde pararam, em *pi)
+static inline uint64_t sadRowScalar(const uint8* a, const uint8* b, size_t i, size_t n) {
+  uint64_t s = 0;
+  for (; i < n; i++) s += (uint64_t)(a[i] > b[i] ? a[i] - b[i] : b[i] - a[i]);
+  return s;
+}
+
+static inline uint64_t ssdRowScalar(const uint8* a, const uint8* b, size_t i, size_t n) {
+  uint64_t s = 0;
+  for (; i < n; i++) {
+    int d = (int)a[i] - (int)b[i];
+    s += (uint64_t)(d * d);
+  }
+  return s;
 }
 
+#ifdef __SSE2__
+static uint64_t sadRowSSE2(const uint8* a, const uint8* b, size_t* pi, size_t n) {
+  size_t i = *pi;
+  __m128i acc = _mm_setzero_si128();
+  for (; i + 16 <= n; i += 16) {
+    __m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+    __m128i vb = _mm_loadu_si128((const __m128i*)(b + i));
+    acc = _mm_add_epi64(acc, _mm_sad_epu8(va, vb));
+  }
+  *pi = i;
+  return (uint64_t)_mm_cvtsi128_si64(acc) + (uint64_t)_mm_cvtsi128_si64(_mm_unpackhi_epi64(acc, acc));
+}
+
+// Somar as 4 somas de 32 bits de v
+static inline uint64_t sum32x4(__m128i v) {
+  __m128i zero = _mm_setzero_si128();
+  __m128i s = _mm_add_epi64(_mm_unpacklo_epi32(v, zero), _mm_unpackhi_epi32(v, zero));
+  return (uint64_t)_mm_cvtsi128_si64(s) + (uint64_t)_mm_cvtsi128_si64(_mm_unpackhi_epi64(s, s));
+}
+
+static uint64_t ssdRowSSE2(const uint8* a, const uint8* b, size_t* pi, size_t n) {
+  size_t i = *pi;
+  __m128i zero = _mm_setzero_si128();
+  uint64_t s = 0;
+  while (i + 16 <= n) {
+    size_t end = n - i > SSD_CHUNK ? i + SSD_CHUNK : n;
+    __m128i acc = _mm_setzero_si128();
+    for (; i + 16 <= end; i += 16) {
+      __m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+      __m128i vb = _mm_loadu_si128((const __m128i*)(b + i));
+      __m128i dlo = _mm_sub_epi16(_mm_unpacklo_epi8(va, zero), _mm_unpacklo_epi8(vb, zero));
+      __m128i dhi = _mm_sub_epi16(_mm_unpackhi_epi8(va, zero), _mm_unpackhi_epi8(vb, zero));
+      acc = _mm_add_epi32(acc, _mm_madd_epi16(dlo, dlo));
+      acc = _mm_add_epi32(acc, _mm_madd_epi16(dhi, dhi));
+    }
+    s += sum32x4(acc);
+  }
+  *pi = i;
+  return s;
+}
+#endif
 
+#ifdef HAVE_AVX2
+__attribute__((target("avx2")))
+static uint64_t sadRowAVX2(const uint8* a, const uint8* b, size_t* pi, size_t n) {
+  size_t i = *pi;
+  __m256i acc = _mm256_setzero_si256();
+  for (; i + 32 <= n; i += 32) {
+    __m256i va = _mm256_loadu_si256((const __m256i*)(a + i));
+    __m256i vb = _mm256_loadu_si256((const __m256i*)(b + i));
+    acc = _mm256_add_epi64(acc, _mm256_sad_epu8(va, vb));
+  }
+  *pi = i;
+  __m128i s = _mm_add_epi64(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+  return (uint64_t)_mm_cvtsi128_si64(s) + (uint64_t)_mm_cvtsi128_si64(_mm_unpackhi_epi64(s, s));
+}
+
+__attribute__((target("avx2")))
+static uint64_t ssdRowAVX2(const uint8* a, const uint8* b, size_t* pi, size_t n) {
+  size_t i = *pi;
+  uint64_t s = 0;
+  while (i + 16 <= n) {
+    size_t end = n - i > SSD_CHUNK ? i + SSD_CHUNK : n;
+    __m256i acc = _mm256_setzero_si256();
+    for (; i + 16 <= end; i += 16) {
+      __m256i va = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(a + i)));
+      __m256i vb = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(b + i)));
+      __m256i d = _mm256_sub_epi16(va, vb);
+      acc = _mm256_add_epi32(acc, _mm256_madd_epi16(d, d));
+    }
+    s += sum32x4(_mm256_castsi256_si128(acc)) + sum32x4(_mm256_extracti128_si256(acc, 1));
+  }
+  *pi = i;
+  return s;
+}
+#endif
+
+// Distância (metric) entre os n bytes de a e b
+static uint64_t rowDistance(const uint8* a, const uint8* b, size_t n, MatchMetric metric) {
+  size_t i = 0;
+  uint64_t s = 0;
+  if (metric == MATCH_SAD) {
+#ifdef HAVE_AVX2
+    if (useAVX2) s += sadRowAVX2(a, b, &i, n);
+#endif
+#ifdef __SSE2__
+    s += sadRowSSE2(a, b, &i, n);
+#endif
+    return s + sadRowScalar(a, b, i, n);
+  }
+#ifdef HAVE_AVX2
+  if (useAVX2) s += ssdRowAVX2(a, b, &i, n);
+#endif
+#ifdef __SSE2__
+  s += ssdRowSSE2(a, b, &i, n);
+#endif
+  return s + ssdRowScalar(a, b, i, n);
+}
+
+// Procura da melhor posição
+//
+// Cada posição soma as distâncias das linhas de img2 e é abandonada logo
+// que a soma parcial ultrapassa o limite: a melhor distância da faixa
+// (menos 1, para ficar a primeira de várias iguais), o threshold e a
+// melhor distância de todas as faixas (partilhada; aqui uma distância
+// igual não é abandonada, porque pode estar numa posição anterior).
+// No fim, das melhores posições das faixas fica a de menor distância e,
+// em caso de empate, a primeira.
+
+// Distância (metric) entre img2 e a subimagem de img1 na posição (x, y),
+// abandonada logo que a soma das linhas já comparadas passa limit (o
+// resultado é então > limit).  Soma a *rows as linhas comparadas.
+static uint64_t distanceAt(Image img1, int x, int y, Image img2, MatchMetric metric,
+                           uint64_t limit, unsigned long* rows) {
+  size_t w2 = (size_t)img2->width;
+  uint64_t s = 0;
+  int j = 0;
+  while (j < img2->height && s <= limit) {
+    s += rowDistance(rowPtr(img1, y + j) + x, rowPtr(img2, j), w2, metric);
+    j++;
+  }
+  *rows += (unsigned long)j;
+  return s;
+}
+
+struct matchJob {
+  Image img1, img2;
+  MatchMetric metric;
+  int nx;                 // posições candidatas por linha
+  uint64_t threshold;
+  uint64_t best;          // melhor distância de todas as faixas (atómico)
+  uint64_t* score;        // por faixa: melhor distância (UINT64_MAX se nenhuma)
+  long* index;            // por faixa: índice y*nx+x da melhor posição
+  unsigned long* pixmem;  // por faixa
+};
+
+static void matchBestBand(void* arg, int band, int y0, int y1) {
+  struct matchJob* job = (struct matchJob*)arg;
+  Image img1 = job->img1;
+  Image img2 = job->img2;
+  uint64_t bandBest = UINT64_MAX;
+  long bandIndex = -1;
+  unsigned long rows = 0;  // linhas de img2 comparadas
+  for (int y = y0; y < y1; y++) {
+    for (int x = 0; x < job->nx; x++) {
+      uint64_t limit = job->threshold;
+      if (bandIndex != -1 && bandBest - 1 < limit) limit = bandBest - 1;  // bandBest > 0
+      uint64_t best = __atomic_load_n(&job->best, __ATOMIC_RELAXED);
+      if (best < limit) limit = best;
+      uint64_t s = distanceAt(img1, x, y, img2, job->metric, limit, &rows);
+      if (s > limit) continue;
+      bandBest = s;
+      bandIndex = (long)y * job->nx + x;
+      // Partilhar a melhor distância
+      while (s < best &&
+             !__atomic_compare_exchange_n(&job->best, &best, s, 0,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+      }
+      if (s == 0) {  // não há melhor: terminar a faixa
+        x = job->nx;
+        y = y1;
+      }
+    }
+  }
+  job->score[band] = bandBest;
+  job->index[band] = bandIndex;
+  job->pixmem[band] += 2 * rows * (unsigned long)img2->width;
+}
+
+/// Find the subimage of img1 most similar to img2.
+/// Computes the distance (given metric) between img2 and the subimage of
+/// img1 at each position (x, y) where img2 fits, and finds the position
+/// with the smallest distance (the first one in raster order, on ties).
+/// Only distances <= threshold are accepted (UINT64_MAX accepts all).
+/// If a position is found, returns 1 and sets (*px, *py) and *pscore
+/// to the position and its distance.
+/// Otherwise, returns 0 and (*px, *py) and *pscore are left untouched.
+/// The candidate rows are searched in parallel by the worker threads
+/// (see ImageSetThreads), with the same result.
+int ImageMatchBest(Image img1, int* px, int* py, Image img2,
+                   MatchMetric metric, uint64_t threshold, uint64_t* pscore) { ///
+  assert (img1 != NULL);
+  assert (img2 != NULL);
+  assert (metric == MATCH_SAD || metric == MATCH_SSD);
+  assert (pscore != NULL);
+  PROFILE(numPixels(img1), numPixels(img1) + numPixels(img2), 0);
+
+  // Posições candidatas
+  int nx = img1->width - img2->width + 1;
+  int ny = img1->height - img2->height + 1;
+  if (nx <= 0 || ny <= 0) return 0;
+
+  long work = (long)nx * ny * (img2->width > 0 ? img2->width : 1) * (img2->height > 0 ? img2->height : 1);
+  int nbands = numBands(work, ny);
+  uint64_t score[nbands];
+  long index[nbands];
+  unsigned long pixmem[nbands];
+  for (int i = 0; i < nbands; i++) pixmem[i] = 0;
+  struct matchJob job = { img1, img2, metric, nx, threshold, UINT64_MAX, score, index, pixmem };
+  forBands(ny, nbands, matchBestBand, &job);
+
+  // Juntar os resultados das faixas (por ordem: o primeiro ganha empates)
+  long best = -1;
+  uint64_t bestScore = UINT64_MAX;
+  for (int i = 0; i < nbands; i++) {
+    PIXMEM += pixmem[i];
+    if (index[i] != -1 && (best == -1 || score[i] < bestScore)) {
+      best = index[i];
+      bestScore = score[i];
+    }
+  }
+  if (best == -1) return 0;
+  *px = (int)(best % nx);
+  *py = (int)(best / nx);
+  *pscore = bestScore;
+  return 1;
+}
+
+/// Image pyramids
+
+// Reduzir as linhas [y0, y1[ de down: cada pixel é a média (arredondada)
+// de um quadrado 2x2 de img
+struct halveArgs {
+  Image img, down;
+};
+
+static void halveBand(void* arg, int band, int y0, int y1) {
+  struct halveArgs* args = (struct halveArgs*)arg;
+  Image down = args->down;
+  for (int y = y0; y < y1; y++) {
+    const uint8* a = rowPtr(args->img, 2 * y);
+    const uint8* b = rowPtr(args->img, 2 * y + 1);
+    uint8* p = rowPtr(down, y);
+    for (int x = 0; x < down->width; x++) {
+      p[x] = (uint8)((a[2*x] + a[2*x + 1] + b[2*x] + b[2*x + 1] + 2) >> 2);
+    }
+  }
+  COUNT(PIXMEM, 5 * (unsigned long)(y1 - y0) * down->width);  // 4 leituras e uma escrita
+}
+
+/// Get a level of the pyramid of an image.
+/// Level 0 is img itself, and level k+1 is level k halved: its width and
+/// height are halved (rounded down) and each pixel is the mean (rounded)
+/// of a 2x2 box of level k.
+/// Levels are built when first needed, and cached with img until its
+/// pixels change or it is destroyed.
+/// The returned image belongs to img: it must not be modified or destroyed,
+/// and is valid only until img is changed or destroyed.
+/// Requires: level >= 0.
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImagePyramidLevel(Image img, int level) { ///
+  assert (img != NULL);
+  assert (level >= 0);
+  for (; level > 0; level--) {
+    // O nível seguinte, se ainda não existir ou se img mudou
+    if (img->down != NULL && img->downVersion != versionOf(img)) {
+      ImageDestroy(&img->down);
+    }
+    if (img->down == NULL) {
+      Image down = imageNew(img->width / 2, img->height / 2, (uint8)img->maxval);
+      if (down == NULL) return NULL;
+      struct halveArgs args = { img, down };
+      forBands(down->height, numBands((long)img->width * img->height, down->height), halveBand, &args);
+      img->down = down;
+      img->downVersion = versionOf(img);
+    }
+    img = img->down;
+  }
+  return img;
+}
+
+// Procura do grosso para o fino
+//
+// No nível mais grosso L (o maior com img2 de pelo menos PYRAMID_MIN x
+// PYRAMID_MIN pixeis), img2 é comparada (SAD) em todas as posições e ficam
+// as PYRAMID_CANDIDATES melhores.  Em cada nível seguinte, só se procura
+// numa janela de +-PYRAMID_RADIUS pixeis à volta de cada candidata (com as
+// coordenadas duplicadas), e ficam as melhores, metade das do nível
+// anterior (pelo menos PYRAMID_KEEP), porque a imagem tem mais detalhe.
+// No nível 0, as candidatas estão ordenadas por distância e posição.
+// Custo: (W*H*w2*h2)/16^L no nível L, e O(w2*h2) por candidata nos outros
+// (menos, quando são abandonadas cedo).
+
+#define PYRAMID_MIN 16
+#define PYRAMID_CANDIDATES 32
+#define PYRAMID_KEEP 4
+#define PYRAMID_RADIUS 2
+
+struct candidate {
+  int x, y;
+  uint64_t score;
+};
+
+// Lista ordenada (por distância e depois pela ordem de varrimento) das
+// melhores keep posições
+struct candidates {
+  struct candidate c[PYRAMID_CANDIDATES];
+  int n, keep;
+};
+
+// Pior distância que ainda entra na lista
+static inline uint64_t candidateLimit(const struct candidates* l) {
+  return l->n < l->keep ? UINT64_MAX : l->c[l->n - 1].score;
+}
+
+// Vem (x, y) com distância score antes da candidata p?
+static inline int candidateBefore(int x, int y, uint64_t score, const struct candidate* p) {
+  if (score != p->score) return score < p->score;
+  return y < p->y || (y == p->y && x < p->x);
+}
+
+// Inserir (x, y) com distância score na lista, se for das melhores
+static void candidateAdd(struct candidates* l, int x, int y, uint64_t score) {
+  struct candidate* c = l->c;
+  for (int i = 0; i < l->n; i++) {
+    if (c[i].x == x && c[i].y == y) return;  // janelas sobrepostas
+  }
+  if (l->n == l->keep && !candidateBefore(x, y, score, &c[l->n - 1])) return;
+  int i = l->n < l->keep ? l->n++ : l->n - 1;
+  for (; i > 0 && candidateBefore(x, y, score, &c[i - 1]); i--) {
+    c[i] = c[i - 1];
+  }
+  c[i].x = x;
+  c[i].y = y;
+  c[i].score = score;
+}
+
+// Procurar img2 em img1 nas posições [x0, x1] x [y0, y1], juntando as
+// melhores à lista
+static void candidateSearch(Image img1, Image img2, int x0, int x1, int y0, int y1,
+                            struct candidates* l, unsigned long* rows) {
+  for (int y = y0; y <= y1; y++) {
+    for (int x = x0; x <= x1; x++) {
+      uint64_t limit = candidateLimit(l);
+      uint64_t s = distanceAt(img1, x, y, img2, MATCH_SAD, limit, rows);
+      if (s <= limit) candidateAdd(l, x, y, s);
+    }
+  }
+}
+
+/// Locate a subimage inside another image, using image pyramids.
+/// Searches for img2 inside img1, from coarse to fine: the positions
+/// where img2 is most similar (by SAD) to img1 are found at a coarse level
+/// of their pyramids (see ImagePyramidLevel), and refined in small windows
+/// at each finer level, down to img1 itself.
+/// This is much faster than ImageLocateSubImage for large images, but it
+/// is a heuristic.  If exact is zero, the most similar position found is
+/// returned, which may not be the most similar of all, but is an exact
+/// match in most cases where there is one.
+/// If exact is nonzero, only exact matches are returned: the positions
+/// found at level 0 are verified with ImageMatchSubImage and, if none
+/// matches, ImageLocateSubImage is used, so a match is found whenever
+/// ImageLocateSubImage finds one (not necessarily the same one).
+/// If a position is found, returns 1 and it is set in vars (*px, *py).
+/// Otherwise, returns 0 and (*px, *py) are left untouched.
+/// The pyramids are kept with img1 and img2 (see ImagePyramidLevel).
+/// If they cannot be built, the search is done at level 0 only.
+int ImageLocatePyramid(Image img1, int* px, int* py, Image img2, int exact) { ///
+  assert (img1 != NULL);
+  assert (img2 != NULL);
+  PROFILE(numPixels(img1), numPixels(img1) + numPixels(img2), 0);
+  int w2 = img2->width;
+  int h2 = img2->height;
+  if (w2 > img1->width || h2 > img1->height) {
+    return exact ? ImageLocateSubImage(img1, px, py, img2) : 0;
+  }
+
+  // Nível mais grosso
+  int L = 0;
+  while ((w2 >> (L + 1)) >= PYRAMID_MIN && (h2 >> (L + 1)) >= PYRAMID_MIN) L++;
+  while (L > 0 && (ImagePyramidLevel(img1, L) == NULL || ImagePyramidLevel(img2, L) == NULL)) L--;
+
+  struct candidates l = { .n = 0, .keep = PYRAMID_CANDIDATES };
+  struct candidates prev;
+  unsigned long pixels = 0;  // pixeis comparados
+  Image a = ImagePyramidLevel(img1, L);
+  Image b = ImagePyramidLevel(img2, L);
+  unsigned long rows = 0;
+  candidateSearch(a, b, 0, a->width - b->width, 0, a->height - b->height, &l, &rows);
+  pixels += rows * (unsigned long)b->width;
+  for (int k = L - 1; k >= 0; k--) {
+    // Refinar as candidatas do nível k+1 no nível k
+    a = ImagePyramidLevel(img1, k);
+    b = ImagePyramidLevel(img2, k);
+    int nx = a->width - b->width;
+    int ny = a->height - b->height;
+    prev = l;
+    l.n = 0;
+    l.keep = prev.keep / 2 > PYRAMID_KEEP ? prev.keep / 2 : PYRAMID_KEEP;
+    rows = 0;
+    for (int i = 0; i < prev.n; i++) {
+      int x0 = 2 * prev.c[i].x - PYRAMID_RADIUS;
+      int y0 = 2 * prev.c[i].y - PYRAMID_RADIUS;
+      int x1 = 2 * prev.c[i].x + 1 + PYRAMID_RADIUS;
+      int y1 = 2 * prev.c[i].y + 1 + PYRAMID_RADIUS;
+      candidateSearch(a, b, x0 < 0 ? 0 : x0, x1 > nx ? nx : x1,
+                      y0 < 0 ? 0 : y0, y1 > ny ? ny : y1, &l, &rows);
+    }
+    pixels += rows * (unsigned long)b->width;
+  }
+  PIXMEM += 2 * pixels;
+
+  if (!exact) {
+    *px = l.c[0].x;
+    *py = l.c[0].y;
+    return 1;
+  }
+  // Verificar as candidatas; se nenhuma servir, procurar em todas as posições
+  for (int i = 0; i < l.n; i++) {
+    if (ImageMatchSubImage(img1, l.c[i].x, l.c[i].y, img2)) {
+      *px = l.c[i].x;
+      *py = l.c[i].y;
+      return 1;
+    }
+  }
+  return ImageLocateSubImage(img1, px, py, img2);
+}
+
+/// Filtering
+
+// Filtro de média direto: visita os (2dx+1)(2dy+1) vizinhos de cada pixel.
+// Usado como alternativa quando não há memória para a tabela de somas.
+static void blurNaive(Image img, int dx, int dy) {
+  int height = img->height;
+  int width = img->width;
+  int maxval = img->maxval;
+
+  // Criar imagem para ser desfocada 
+  Image blurImg = imageNew(width, height, maxval);
+
+  // Percorrer todos os pixels dessa imagem
+  for (int j = 0; j < height; j++) {
+    for (int i = 0; i < width; i++) {
+      int count = 0;    // Inicialização de uma variável de contagem de pixeis
+      int soma = 0;     // Inicialização de variavel da soma de pixeis 
+
+      for (int x = -dx; x <= dx; x++) {         // Percorrer pixeis entre as posições (x-dx, x+dx)
+        for (int y = -dy; y <= dy; y++) {       // Percorrer pixeis entre as posições (y-dy, y+dy)
+          if (ImageValidPos(img, i + x, j + y)) {   // Verifica se o posição está dentro da imagem
+            soma += ImageGetPixel(img, i + x, j + y);   // Somar o valor dos pixeis válidos
+            count++;                                    // Incrementa o contador
+
+            BLUROPS+=2;                //número de operações ao interar soma e count
+          }   
+        }
+      }
+
+      // Calcula a média dos valores dos pixeis arredondados
+      uint8 pixel;
+      if (count == 0) {
+        pixel = ImageGetPixel(img, i, j);
+        BLUROPS++;                //número de operações para calcular pixel
+      } else {
+        pixel = (uint8)((soma + count / 2) / count);
+        BLUROPS+=3;                //número de operações para calcular pixel
+
+      }
+      ImageSetPixel(blurImg, i, j, pixel);      // Define o valor na imagem desfocada
+    }
+  }
+
+  // Percorre os valores da imagem desfocada de modo a substituí-los na imagem original
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      uint8 blurredPixel = ImageGetPixel(blurImg, x, y);
+      BLUROPS++;                //número de operações de blurredPixel
+      ImageSetPixel(img, x, y, blurredPixel); // Substitui os pixeis pelos valores filtrados
+    }
+  }
+
+  // Libertar a memória
+  ImageDestroy(&blurImg);
+}
+
+// Filtro de média com a tabela de somas (ver ImageSATBlur).
+// Retorna 0 se não houver memória para a tabela.
+static int blurSAT(Image img, int dx, int dy) {
+  ImageSAT sat = ImageSATCreate(img);
+  if (sat == NULL) return 0;
+  ImageSATBlur(sat, img, dx, dy);
+  ImageSATDestroy(&sat);
+  return 1;
+}
+
+// Soma horizontal da linha row na janela [x-dx, x+dx] recortada, para cada x.
+// Janela deslizante: entra o pixel x+dx, sai o pixel x-dx-1.
+static void rowSums(const uint8* row, int width, int dx, uint32_t* hsum) {
+  uint32_t s = 0;
+  for (int x = 0; x < dx && x < width; x++) {
+    s += row[x];
+  }
+  for (int x = 0; x < width; x++) {
+    if (x + dx < width) s += row[x + dx];
+    if (x - dx - 1 >= 0) s -= row[x - dx - 1];
+    hsum[x] = s;
+  }
+}
+
+// Filtro de média separável, por linhas (ImageRowBlur).
+// Primeiro passo: somas horizontais de cada linha que entra (rowSums).
+// Segundo passo: soma vertical deslizante dessas somas, por coluna (colsum).
+// As somas horizontais das linhas dentro da janela vertical ficam num buffer
+// circular de R = min(2dy+1, height) linhas, para poderem ser subtraídas
+// quando saem da janela, sem ser preciso voltar a ler a linha original.
+// As somas não são arredondadas entre passos, logo o resultado é exato.
+
+struct rowBlur {
+  int width, height;
+  int dx, dy;
+  int R;            // linhas no buffer circular
+  uint32_t* ring;   // somas horizontais das linhas [lo, pushed[
+  uint64_t* colsum; // soma das linhas [lo, pushed[ em cada coluna
+  int lo;           // primeira linha incluída em colsum
+  int pushed;       // próxima linha de entrada
+  int popped;       // próxima linha de saída
+};
+
+/// Create a row blur for images of the given size.
+/// On success, a new row blur is returned.
+/// (The caller is responsible for destroying it!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+ImageRowBlur ImageRowBlurCreate(int width, int height, int dx, int dy) { ///
+  assert (width >= 0 && height >= 0);
+  assert (dx >= 0 && dy >= 0);
+  // Raios maiores que a imagem equivalem a janelas recortadas
+  if (dx > width) dx = width;
+  if (dy > height) dy = height;
+
+  ImageRowBlur rb = (ImageRowBlur)malloc(sizeof(struct rowBlur));
+  if (rb == NULL) {
+    errCause = "Falha na alocação de memória para o buffer do filtro";
+    return NULL;
+  }
+  rb->width = width;
+  rb->height = height;
+  rb->dx = dx;
+  rb->dy = dy;
+  rb->R = 2 * dy + 1 < height ? 2 * dy + 1 : height;
+  rb->ring = (uint32_t*)malloc((size_t)rb->R * width * sizeof(uint32_t) + 1);
+  rb->colsum = (uint64_t*)calloc((size_t)width + 1, sizeof(uint64_t));
+  if (rb->ring == NULL || rb->colsum == NULL) {
+    errCause = "Falha na alocação de memória para o buffer do filtro";
+    ImageRowBlurDestroy(&rb);
+    return NULL;
+  }
+  rb->lo = rb->pushed = rb->popped = 0;
+  return rb;
+}
+
+/// Destroy the row blur pointed to by (*rbp).
+/// If (*rbp)==NULL, no operation is performed.
+/// Ensures: (*rbp)==NULL.
+void ImageRowBlurDestroy(ImageRowBlur* rbp) { ///
+  assert (rbp != NULL);
+  if (*rbp == NULL) return;
+  free((*rbp)->ring);
+  free((*rbp)->colsum);
+  free(*rbp);
+  *rbp = NULL;
+}
+
+// Recomeçar na linha de saída y0 (a primeira linha de entrada é y0-dy)
+static void rowBlurSeek(ImageRowBlur rb, int y0) {
+  rb->popped = y0;
+  rb->lo = rb->pushed = y0 - rb->dy < 0 ? 0 : y0 - rb->dy;
+  memset(rb->colsum, 0, (size_t)rb->width * sizeof(uint64_t));
+}
+
+// Retirar de colsum as linhas que já não estão na janela da próxima saída
+static void rowBlurDrop(ImageRowBlur rb) {
+  int width = rb->width;
+  while (rb->lo < rb->popped - rb->dy) {
+    const uint32_t* h = rb->ring + (size_t)(rb->lo % rb->R) * width;
+    for (int x = 0; x < width; x++) rb->colsum[x] -= h[x];
+    rb->lo++;
+  }
+}
+
+/// Check if the next output row can be produced.
+/// Returns nonzero if all input rows it depends on were pushed
+/// and not all output rows were produced yet.
+int ImageRowBlurReady(ImageRowBlur rb) { ///
+  assert (rb != NULL);
+  int need = rb->popped + rb->dy + 1 < rb->height ? rb->popped + rb->dy + 1 : rb->height;
+  return rb->popped < rb->height && rb->pushed >= need;
+}
+
+/// Push the next input row (width levels, top to bottom).
+/// Requires: !ImageRowBlurReady(rb) and less than height rows pushed.
+void ImageRowBlurPush(ImageRowBlur rb, const uint8* row) { ///
+  assert (rb != NULL && row != NULL);
+  assert (!ImageRowBlurReady(rb) && rb->pushed < rb->height);
+  int width = rb->width;
+  rowBlurDrop(rb);
+  uint32_t* h = rb->ring + (size_t)(rb->pushed % rb->R) * width;
+  rowSums(row, width, rb->dx, h);
+  for (int x = 0; x < width; x++) rb->colsum[x] += h[x];
+  rb->pushed++;
+}
+
+/// Produce the next output row (width levels, top to bottom) into row.
+/// Requires: ImageRowBlurReady(rb).
+void ImageRowBlurPop(ImageRowBlur rb, uint8* row) { ///
+  assert (rb != NULL && row != NULL);
+  assert (ImageRowBlurReady(rb));
+  int width = rb->width;
+  int height = rb->height;
+  int dx = rb->dx;
+  int dy = rb->dy;
+  int y = rb->popped;
+  rowBlurDrop(rb);
+
+  int y0 = y - dy < 0 ? 0 : y - dy;
+  int y1 = y + dy + 1 > height ? height : y + dy + 1;
+  const uint64_t* colsum = rb->colsum;
+  for (int x = 0; x < width; x++) {
+    int x0 = x - dx < 0 ? 0 : x - dx;
+    int x1 = x + dx + 1 > width ? width : x + dx + 1;
+    uint64_t count = (uint64_t)(x1 - x0) * (uint64_t)(y1 - y0);
+    row[x] = (uint8)((colsum[x] + count / 2) / count);
+  }
+  rb->popped++;
+}
+
+// Filtro separável no próprio lugar: a linha y+dy é lida (Push) antes de a
+// linha y ser escrita (Pop), por isso só é preciso o buffer de ImageRowBlur.
+//
+// Em paralelo, cada faixa de linhas [y0, y1[ tem o seu ImageRowBlur, e as dy
+// linhas acima e abaixo da faixa (que as faixas vizinhas vão reescrever) são
+// copiadas para halo antes de qualquer faixa começar a escrever.
+
+struct sepBlur {
+  Image img;
+  int dy;
+  int nbands;
+  uint8** halo;        // por faixa: dy linhas acima e dy linhas abaixo
+  ImageRowBlur* rb;    // por faixa
+};
+
+// Linha r, com os valores originais, vista pela faixa band = [y0, y1[
+static const uint8* sepRow(struct sepBlur* sb, int band, int y0, int y1, int r) {
+  int width = sb->img->width;
+  if (r < y0) return sb->halo[band] + (size_t)(r - (y0 - sb->dy)) * width;
+  if (r >= y1) return sb->halo[band] + (size_t)(sb->dy + r - y1) * width;
+  return rowPtr(sb->img, r);
+}
+
+// Copiar as linhas vizinhas da faixa antes de serem reescritas
+static void sepBlurHalo(void* arg, int band, int lo, int hi) {
+  struct sepBlur* sb = (struct sepBlur*)arg;
+  int width = sb->img->width;
+  int height = sb->img->height;
+  for (int i = lo; i < hi; i++) {
+    int y0 = bandStart(height, sb->nbands, i);
+    int y1 = bandStart(height, sb->nbands, i + 1);
+    for (int r = y0 - sb->dy; r < y1 + sb->dy; r++) {
+      if (r < 0 || r >= height || (y0 <= r && r < y1)) continue;
+      memcpy((uint8*)sepRow(sb, i, y0, y1, r), rowPtr(sb->img, r), (size_t)width);
+    }
+  }
+}
+
+static void sepBlurBand(void* arg, int band, int y0, int y1) {
+  struct sepBlur* sb = (struct sepBlur*)arg;
+  ImageRowBlur rb = sb->rb[band];
+  rowBlurSeek(rb, y0);
+  for (int y = y0; y < y1; y++) {
+    while (!ImageRowBlurReady(rb)) {
+      ImageRowBlurPush(rb, sepRow(sb, band, y0, y1, rb->pushed));
+    }
+    ImageRowBlurPop(rb, rowPtr(sb->img, y));
+  }
+}
+
+// Libertar os buffers das faixas
+static void sepBlurFree(struct sepBlur* sb) {
+  for (int i = 0; i < sb->nbands; i++) {
+    if (sb->halo != NULL) free(sb->halo[i]);
+    if (sb->rb != NULL) ImageRowBlurDestroy(&sb->rb[i]);
+  }
+  free(sb->halo);
+  free(sb->rb);
+}
+
+// Retorna 0 se não houver memória para os buffers.
+static int blurSeparable(Image img, int dx, int dy) {
+  int width = img->width;
+  int height = img->height;
+  if (width == 0 || height == 0) return 1;  // nada a fazer
+  if (dy > height) dy = height;
+  int R = 2 * dy + 1 < height ? 2 * dy + 1 : height;
+
+  // Cada faixa deve ter bastantes mais linhas do que a janela vertical
+  int nbands = numBands((long)width * height, height);
+  if (nbands > height / (2 * R)) nbands = height / (2 * R);
+  if (nbands < 1) nbands = 1;
+
+  struct sepBlur sb = { img, dy, nbands, NULL, NULL };
+  int success =
+  check( (sb.halo = (uint8**)calloc((size_t)nbands, sizeof(uint8*))) != NULL &&
+         (sb.rb = (ImageRowBlur*)calloc((size_t)nbands, sizeof(ImageRowBlur))) != NULL,
+         "Falha na alocação de memória para o buffer do filtro" );
+  for (int i = 0; success && i < nbands; i++) {
+    success =
+    (sb.rb[i] = ImageRowBlurCreate(width, height, dx, dy)) != NULL &&
+    check( dy == 0 || nbands == 1 || (sb.halo[i] = (uint8*)malloc((size_t)2 * dy * width)) != NULL,
+           "Falha na alocação de memória para o buffer do filtro" );
+  }
+
+  if (success) {
+    if (nbands > 1 && dy > 0) {
+      forBands(nbands, nbands, sepBlurHalo, &sb);
+    }
+    forBands(height, nbands, sepBlurBand, &sb);
+    BLUROPS += 3 * (size_t)width * height;  // entra, sai e média por pixel
+    PIXMEM += 2 * (unsigned long)width * height;  // count pixel memory accesses
+  }
+  sepBlurFree(&sb);
+  return success;
+}
+
+/// Blur an image by a applying a (2dx+1)x(2dy+1) mean filter.
+/// Each pixel is substituted by the mean of the pixels in the rectangle
+/// [x-dx, x+dx]x[y-dy, y+dy].
+/// The image is changed in-place.
+/// Uses the default algorithm (BLUR_SAT).
+void ImageBlur(Image img, int dx, int dy) { ///
+  ImageBlurUsing(img, dx, dy, BLUR_SAT);
+}
+
+/// Blur an image like ImageBlur, using the given algorithm.
+/// If the algorithm cannot get the memory it needs, the image is still
+/// blurred, using BLUR_DIRECT.
+void ImageBlurUsing(Image img, int dx, int dy, BlurMode mode) { ///
+  assert(img != NULL);
+  PROFILE(numPixels(img), numPixels(img), numPixels(img));
+
+  // Raios negativos (janela vazia) só são tratados pelo filtro direto
+  int done = 0;
+  if (dx >= 0 && dy >= 0) {
+    switch (mode) {
+      case BLUR_SAT:       done = blurSAT(img, dx, dy); break;
+      case BLUR_SEPARABLE: done = blurSeparable(img, dx, dy); break;
+      case BLUR_DIRECT:    break;
+    }
+  }
+  if (!done) {
+    blurNaive(img, dx, dy);
+  }
+  touch(img);
+}
+
+
+/// Summed-area tables
+
+// Internal structure for storing summed-area tables.
+// sum has (width+1)*(height+1) entries: entry (x,y) holds the sum of the
+// pixels in [0,x[ x [0,y[, so row 0 and column 0 are all zeros.
+struct sat {
+  int width;
+  int height;
+  uint64_t* sum;
+};
+
+// Linear index of entry (x,y) of the table (0 <= x <= width, 0 <= y <= height)
+static inline size_t S(ImageSAT sat, int x, int y) {
+  return (size_t)y * (size_t)(sat->width + 1) + (size_t)x;
+}
+
+struct satArgs {
+  ImageSAT sat;
+  Image img;
+  int dx, dy;     // ImageSATBlur
+};
+
+// Somas acumuladas das linhas [y0, y1[ da imagem (linhas y0+1..y1 da tabela)
+static void satRowsBand(void* arg, int band, int y0, int y1) {
+  struct satArgs* args = (struct satArgs*)arg;
+  ImageSAT sat = args->sat;
+  int width = sat->width;
+  for (int y = y0; y < y1; y++) {
+    const uint8* row = rowPtr(args->img, y);
+    uint64_t* curr = sat->sum + S(sat, 0, y + 1);
+    uint64_t rowsum = 0;
+    curr[0] = 0;
+    for (int x = 0; x < width; x++) {
+      rowsum += row[x];
+      curr[x + 1] = rowsum;
+    }
+  }
+}
+
+// Acumular verticalmente as colunas [x0, x1[ da tabela
+static void satColsBand(void* arg, int band, int x0, int x1) {
+  ImageSAT sat = ((struct satArgs*)arg)->sat;
+  for (int y = 1; y <= sat->height; y++) {
+    const uint64_t* prev = sat->sum + S(sat, 0, y - 1);
+    uint64_t* curr = sat->sum + S(sat, 0, y);
+    for (int x = x0; x < x1; x++) {
+      curr[x] += prev[x];
+    }
+  }
+}
+
+/// Build the summed-area table of img.
+/// On success, a new table is returned.
+/// (The caller is responsible for destroying the returned table!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+ImageSAT ImageSATCreate(Image img) { ///
+  assert (img != NULL);
+  PROFILE(numPixels(img), numPixels(img), 0);
+  int width = img->width;
+  int height = img->height;
+
+  ImageSAT sat = (ImageSAT)malloc(sizeof(struct sat));
+  if (sat == NULL) {
+    errCause = "Falha na alocação de memória para a tabela de somas";
+    return NULL;
+  }
+  sat->width = width;
+  sat->height = height;
+  sat->sum = (uint64_t*)malloc((size_t)(width + 1) * (size_t)(height + 1) * sizeof(uint64_t));
+  if (sat->sum == NULL) {
+    errCause = "Falha na alocação de memória para a tabela de somas";
+    free(sat);
+    return NULL;
+  }
+
+  // Primeira linha a zeros, depois as somas acumuladas de cada linha,
+  // e por fim as somas acumuladas de cada coluna dessas somas
+  for (int x = 0; x <= width; x++) {
+    sat->sum[S(sat, x, 0)] = 0;
+  }
+  struct satArgs args = { sat, img, 0, 0 };
+  int nbands = numBands((long)width * height, height);
+  forBands(height, nbands, satRowsBand, &args);
+  forBands(width + 1, nbands < width + 1 ? nbands : width + 1, satColsBand, &args);
+  PIXMEM += (unsigned long)width * height;  // count pixel memory accesses
+  return sat;
+}
+
+/// Destroy the table pointed to by (*satp).
+/// If (*satp)==NULL, no operation is performed.
+/// Ensures: (*satp)==NULL.
+void ImageSATDestroy(ImageSAT* satp) { ///
+  assert (satp != NULL);
+  if (*satp == NULL) return;
+  free((*satp)->sum);
+  free(*satp);
+  *satp = NULL;
+}
+
+/// Sum of the pixel levels in the rectangle (x,y,w,h) of the source image.
+/// Requires: the rectangle must be inside the source image.
+uint64_t ImageSATBoxSum(ImageSAT sat, int x, int y, int w, int h) { ///
+  assert (sat != NULL);
+  assert (0 <= x && 0 <= w && x + w <= sat->width);
+  assert (0 <= y && 0 <= h && y + h <= sat->height);
+  return sat->sum[S(sat, x + w, y + h)] - sat->sum[S(sat, x, y + h)]
+       - sat->sum[S(sat, x + w, y)] + sat->sum[S(sat, x, y)];
+}
+
+/// Mean of the pixel levels in the rectangle (x,y,w,h) of the source image,
+/// rounded to the nearest integer (halves round up).
+/// Requires: the rectangle must be inside the source image, w > 0, h > 0.
+uint8 ImageSATBoxMean(ImageSAT sat, int x, int y, int w, int h) { ///
+  assert (w > 0 && h > 0);
+  uint64_t count = (uint64_t)w * (uint64_t)h;
+  return (uint8)((ImageSATBoxSum(sat, x, y, w, h) + count / 2) / count);
+}
+
+// Média das janelas centradas nos pixeis das linhas [ya, yb[
+static void satBlurBand(void* arg, int band, int ya, int yb) {
+  struct satArgs* args = (struct satArgs*)arg;
+  ImageSAT sat = args->sat;
+  Image img = args->img;
+  int width = img->width;
+  int height = img->height;
+  int dx = args->dx;
+  int dy = args->dy;
+  for (int y = ya; y < yb; y++) {
+    // Janela vertical [y0, y1[ recortada pelos limites da imagem
+    int y0 = y - dy < 0 ? 0 : y - dy;
+    int y1 = y + dy + 1 > height ? height : y + dy + 1;
+    const uint64_t* top = sat->sum + S(sat, 0, y0);
+    const uint64_t* bot = sat->sum + S(sat, 0, y1);
+    uint8* row = rowPtr(img, y);
+    for (int x = 0; x < width; x++) {
+      int x0 = x - dx < 0 ? 0 : x - dx;
+      int x1 = x + dx + 1 > width ? width : x + dx + 1;
+      uint64_t soma = bot[x1] - bot[x0] - top[x1] + top[x0];
+      uint64_t count = (uint64_t)(x1 - x0) * (uint64_t)(y1 - y0);
+      row[x] = (uint8)((soma + count / 2) / count);
+    }
+  }
+}
+
+/// Blur using a summed-area table.
+/// Sets each pixel (x,y) of img to the mean of the rectangle
+/// [x-dx, x+dx]x[y-dy, y+dy] of the source image of sat, clipped to the
+/// image borders, exactly as ImageBlur does.
+/// img may be the source image itself.
+/// Requires: img has the same size as the source of sat, dx >= 0, dy >= 0.
+void ImageSATBlur(ImageSAT sat, Image img, int dx, int dy) { ///
+  assert (sat != NULL);
+  assert (img != NULL);
+  assert (sat->width == img->width && sat->height == img->height);
+  assert (dx >= 0 && dy >= 0);
+  PROFILE(numPixels(img), 0, numPixels(img));
+  int width = img->width;
+  int height = img->height;
+
+  struct satArgs args = { sat, img, dx, dy };
+  forBands(height, numBands((long)width * height, height), satBlurBand, &args);
+  touch(img);
+  BLUROPS += 4 * (size_t)width * height;  // 4 acessos à tabela por pixel
+  PIXMEM += (unsigned long)width * height;  // count pixel memory accesses
+}
+
+
+/// Normalized cross-correlation
+
+// Internal structure for storing correlation maps.
+// ncc[y*width + x] is the NCC of the template at offset (x,y).
+struct nccmap {
+  int width;
+  int height;
+  double* ncc;
+};
+
+// FFT
+//
+// FFT complexa iterativa (radix 2), sobre n = 2^k valores complexos com
+// partes real e imaginária intercaladas: z[2i] + i*z[2i+1].
+// tw contém exp(-2*pi*i*j/tn), j em [0, tn/2[, para um tn múltiplo de n.
+static void fft(double* z, int n, const double* tw, int tn, int inverse) {
+  // Permutação por inversão dos bits
+  for (int i = 1, j = 0; i < n; i++) {
+    int bit = n >> 1;
+    for (; j & bit; bit >>= 1) j ^= bit;
+    j |= bit;
+    if (i < j) {
+      double re = z[2*i], im = z[2*i + 1];
+      z[2*i] = z[2*j];
+      z[2*i + 1] = z[2*j + 1];
+      z[2*j] = re;
+      z[2*j + 1] = im;
+    }
+  }
+  // Borboletas
+  for (int len = 2; len <= n; len <<= 1) {
+    int step = tn / len;
+    int half = len >> 1;
+    for (int i = 0; i < n; i += len) {
+      for (int j = 0; j < half; j++) {
+        double wr = tw[2*j*step];
+        double wi = inverse ? -tw[2*j*step + 1] : tw[2*j*step + 1];
+        double* a = &z[2*(i + j)];
+        double* b = &z[2*(i + j + half)];
+        double br = b[0]*wr - b[1]*wi;
+        double bi = b[0]*wi + b[1]*wr;
+        b[0] = a[0] - br;
+        b[1] = a[1] - bi;
+        a[0] += br;
+        a[1] += bi;
+      }
+    }
+  }
+}
+
+// FFT 2D de P x Q valores: primeiro as linhas, depois as colunas.
+// As colunas são copiadas em blocos de FFT_COLS (uma linha de cache de
+// complexos), para scratch, onde cada faixa tem FFT_COLS*Q complexos.
+#define FFT_COLS 4
+
+struct fftArgs {
+  double* z;
+  int P, Q;
+  const double* tw;
+  int tn;
+  int inverse;
+  double* scratch;
+};
+
+static void fftRowsBand(void* arg, int band, int y0, int y1) {
+  struct fftArgs* args = (struct fftArgs*)arg;
+  for (int y = y0; y < y1; y++) {
+    fft(args->z + 2 * (size_t)y * args->P, args->P, args->tw, args->tn, args->inverse);
+  }
+}
+
+// Colunas [FFT_COLS*b0, FFT_COLS*b1[
+static void fftColsBand(void* arg, int band, int b0, int b1) {
+  struct fftArgs* args = (struct fftArgs*)arg;
+  int P = args->P;
+  int Q = args->Q;
+  double* col = args->scratch + 2 * (size_t)band * FFT_COLS * Q;
+  for (int b = b0; b < b1; b++) {
+    int x0 = b * FFT_COLS;
+    int nc = P - x0 < FFT_COLS ? P - x0 : FFT_COLS;
+    for (int y = 0; y < Q; y++) {
+      const double* row = args->z + 2 * ((size_t)y * P + x0);
+      for (int c = 0; c < nc; c++) {
+        col[2 * ((size_t)c * Q + y)] = row[2*c];
+        col[2 * ((size_t)c * Q + y) + 1] = row[2*c + 1];
+      }
+    }
+    for (int c = 0; c < nc; c++) {
+      fft(col + 2 * (size_t)c * Q, Q, args->tw, args->tn, args->inverse);
+    }
+    for (int y = 0; y < Q; y++) {
+      double* row = args->z + 2 * ((size_t)y * P + x0);
+      for (int c = 0; c < nc; c++) {
+        row[2*c] = col[2 * ((size_t)c * Q + y)];
+        row[2*c + 1] = col[2 * ((size_t)c * Q + y) + 1];
+      }
+    }
+  }
+}
+
+static void fft2D(struct fftArgs* args, int inverse, int nbands) {
+  int nblocks = (args->P + FFT_COLS - 1) / FFT_COLS;
+  args->inverse = inverse;
+  forBands(args->Q, nbands < args->Q ? nbands : args->Q, fftRowsBand, args);
+  forBands(nblocks, nbands < nblocks ? nbands : nblocks, fftColsBand, args);
+}
+
+// Menor potência de 2 >= n
+static int pow2Ceil(int n) {
+  int p = 1;
+  while (p < n) p <<= 1;
+  return p;
+}
+
+// Correlação das FFTs
+//
+// Uma só FFT complexa transforma as duas imagens reais: a imagem
+// (parte real) e o modelo com média zero (parte imaginária), em
+// z = f + i*g.  Com Z a transformada de z e -k o índice simétrico de k,
+//   F(k) = (Z(k) + conj(Z(-k))) / 2,   G(k) = (Z(k) - conj(Z(-k))) / 2i,
+// e a correlação c(x,y) = soma de f(x+i,y+j)*g(i,j) é a transformada
+// inversa de F*conj(G), que é real.  As dimensões P x Q são potências de
+// 2 >= W x H: a correlação é circular, mas para os deslocamentos em que o
+// modelo cabe na imagem não dá a volta.
+static void crossSpectrum(double* z, int P, int Q) {
+  for (int v = 0; v < Q; v++) {
+    int v2 = (Q - v) & (Q - 1);
+    for (int u = 0; u < P; u++) {
+      int u2 = (P - u) & (P - 1);
+      size_t k = (size_t)v * P + u;
+      size_t k2 = (size_t)v2 * P + u2;
+      if (k2 < k) continue;   // o par já foi tratado
+      double zr = z[2*k], zi = z[2*k + 1];
+      double yr = z[2*k2], yi = z[2*k2 + 1];
+      // F e G em k (em -k são os conjugados)
+      double fr = (zr + yr) / 2, fi = (zi - yi) / 2;
+      double gr = (zi + yi) / 2, gi = (yr - zr) / 2;
+      // F*conj(G) em k, e em -k o seu conjugado
+      double cr = fr*gr + fi*gi;
+      double ci = fi*gr - fr*gi;
+      z[2*k] = cr;
+      z[2*k + 1] = ci;
+      z[2*k2] = cr;
+      z[2*k2 + 1] = -ci;
+    }
+  }
+}
+
+// Tabela (W+1) x (H+1) das somas dos quadrados dos pixeis de img, como a
+// tabela de somas do ImageSAT
+static uint64_t* energyTable(Image img) {
+  int W = img->width;
+  int H = img->height;
+  uint64_t* e = (uint64_t*)malloc((size_t)(W + 1) * (H + 1) * sizeof(uint64_t));
+  if (e == NULL) return NULL;
+  for (int x = 0; x <= W; x++) e[x] = 0;
+  for (int y = 0; y < H; y++) {
+    const uint8* row = rowPtr(img, y);
+    uint64_t* prev = e + (size_t)y * (W + 1);
+    uint64_t* cur = prev + (W + 1);
+    uint64_t acc = 0;
+    cur[0] = 0;
+    for (int x = 0; x < W; x++) {
+      acc += (uint64_t)row[x] * row[x];
+      cur[x + 1] = prev[x + 1] + acc;
+    }
+  }
+  return e;
+}
+
+/// Compute the normalized cross-correlation of img2 with img1.
+/// For each offset (x,y) where img2 fits inside img1, computes the NCC
+///   sum((I(x+i,y+j) - mI)*(T(i,j) - mT)) / sqrt(sum((I-mI)^2) * sum((T-mT)^2))
+/// of the pixels T of img2 and the pixels I of the subimage of img1 at
+/// (x,y), with means mT and mI, which is in [-1, 1] (1 means a match up to
+/// brightness and contrast).  It is 0 if either has uniform gray level.
+/// The correlations are computed with FFTs and the means and energies of
+/// the subimages with summed-area tables, in O(N log N) time for N pixels
+/// in img1, for any size of img2, and O(N) memory.
+/// Requires: img2 fits inside img1.
+/// On success, a new map of size (W-w+1)x(H-h+1) is returned.
+/// (The caller is responsible for destroying the returned map!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+ImageNCCMap ImageNCCCreate(Image img1, Image img2) { ///
+  assert (img1 != NULL);
+  assert (img2 != NULL);
+  assert (img2->width <= img1->width && img2->height <= img1->height);
+  PROFILE(numPixels(img1), numPixels(img1) + numPixels(img2), 0);
+  int W = img1->width;
+  int H = img1->height;
+  int w = img2->width;
+  int h = img2->height;
+  int P = pow2Ceil(W);
+  int Q = pow2Ceil(H);
+  int tn = P > Q ? P : Q;
+  int nbands = numBands((long)P * Q, Q);
+
+  ImageNCCMap m = NULL;
+  double* z = NULL;
+  double* tw = NULL;
+  double* scratch = NULL;
+  ImageSAT sat = NULL;
+  uint64_t* energy = NULL;
+  int success =
+  check( (m = (ImageNCCMap)malloc(sizeof(struct nccmap))) != NULL &&
+         (m->ncc = (double*)malloc((size_t)(W - w + 1) * (H - h + 1) * sizeof(double))) != NULL,
+         "Falha na alocação de memória para o mapa de correlação" ) &&
+  check( (z = (double*)malloc(2 * (size_t)P * Q * sizeof(double))) != NULL &&
+         (tw = (double*)malloc((size_t)tn * sizeof(double))) != NULL &&
+         (scratch = (double*)malloc(2 * (size_t)nbands * FFT_COLS * Q * sizeof(double))) != NULL,
+         "Falha na alocação de memória para as FFTs" ) &&
+  (sat = ImageSATCreate(img1)) != NULL &&
+  check( (energy = energyTable(img1)) != NULL, "Falha na alocação de memória para a tabela de energias" );
+
+  if (success) {
+    m->width = W - w + 1;
+    m->height = H - h + 1;
+    // Modelo com média zero, e a sua energia
+    long n = (long)w * h;
+    uint64_t sumT = 0;
+    for (int j = 0; j < h; j++) {
+      for (int i = 0; i < w; i++) sumT += rowPtr(img2, j)[i];
+    }
+    double meanT = n > 0 ? (double)sumT / n : 0.0;
+    double energyT = 0.0;
+    for (size_t k = 0; k < 2 * (size_t)P * Q; k++) z[k] = 0.0;
+    for (int y = 0; y < H; y++) {
+      const uint8* row = rowPtr(img1, y);
+      for (int x = 0; x < W; x++) z[2 * ((size_t)y * P + x)] = row[x];
+    }
+    for (int j = 0; j < h; j++) {
+      const uint8* row = rowPtr(img2, j);
+      for (int i = 0; i < w; i++) {
+        double t = row[i] - meanT;
+        z[2 * ((size_t)j * P + i) + 1] = t;
+        energyT += t * t;
+      }
+    }
+    for (int j = 0; j < tn / 2; j++) {
+      tw[2*j] = cos(-2.0 * M_PI * j / tn);
+      tw[2*j + 1] = sin(-2.0 * M_PI * j / tn);
+    }
+
+    // Correlação
+    struct fftArgs args = { z, P, Q, tw, tn, 0, scratch };
+    fft2D(&args, 0, nbands);
+    crossSpectrum(z, P, Q);
+    fft2D(&args, 1, nbands);
+
+    // Normalizar: a soma de (I-mI)*(T-mT) é a correlação com T-mT
+    double scale = 1.0 / ((double)P * Q);
+    double normT = sqrt(energyT);
+    for (int y = 0; y < m->height; y++) {
+      for (int x = 0; x < m->width; x++) {
+        uint64_t S = ImageSATBoxSum(sat, x, y, w, h);
+        size_t W1 = (size_t)W + 1;
+        uint64_t E = energy[(y + h) * W1 + x + w] - energy[(size_t)y * W1 + x + w]
+                   - energy[(y + h) * W1 + x] + energy[(size_t)y * W1 + x];
+        // n*sum((I-mI)^2) = n*E - S^2, exato
+        unsigned __int128 varN = (unsigned __int128)n * E - (unsigned __int128)S * S;
+        double r = 0.0;
+        if (varN != 0 && normT > 0.0) {
+          r = z[2 * ((size_t)y * P + x)] * scale / (sqrt((double)varN / n) * normT);
+          r = r > 1.0 ? 1.0 : (r < -1.0 ? -1.0 : r);
+        }
+        m->ncc[(size_t)y * m->width + x] = r;
+      }
+    }
+    PIXMEM += (unsigned long)W * H + (unsigned long)w * h;  // count pixel memory accesses
+  }
+
+  errsave = errno;
+  free(z);
+  free(tw);
+  free(scratch);
+  free(energy);
+  ImageSATDestroy(&sat);
+  if (!success && m != NULL) {
+    free(m->ncc);
+    free(m);
+    m = NULL;
+  }
+  errno = errsave;
+  return m;
+}
+
+/// Destroy the map pointed to by (*mp).
+/// If (*mp)==NULL, no operation is performed.
+/// Ensures: (*mp)==NULL.
+void ImageNCCDestroy(ImageNCCMap* mp) { ///
+  assert (mp != NULL);
+  if (*mp == NULL) return;
+  free((*mp)->ncc);
+  free(*mp);
+  *mp = NULL;
+}
+
+/// Number of offsets in x (W-w+1).
+int ImageNCCWidth(ImageNCCMap m) { ///
+  assert (m != NULL);
+  return m->width;
+}
+
+/// Number of offsets in y (H-h+1).
+int ImageNCCHeight(ImageNCCMap m) { ///
+  assert (m != NULL);
+  return m->height;
+}
+
+/// NCC of the template at offset (x,y).
+double ImageNCCValue(ImageNCCMap m, int x, int y) { ///
+  assert (m != NULL);
+  assert (0 <= x && x < m->width && 0 <= y && y < m->height);
+  return m->ncc[(size_t)y * m->width + x];
+}
+
+// É (x,y) um máximo local?  Num patamar, só conta o primeiro pela ordem
+// de varrimento: tem de ser > que os vizinhos anteriores e >= que os outros.
+static int nccIsPeak(ImageNCCMap m, int x, int y) {
+  double v = m->ncc[(size_t)y * m->width + x];
+  for (int j = -1; j <= 1; j++) {
+    for (int i = -1; i <= 1; i++) {
+      int u = x + i, t = y + j;
+      if ((i == 0 && j == 0) || u < 0 || u >= m->width || t < 0 || t >= m->height) continue;
+      double n = m->ncc[(size_t)t * m->width + u];
+      if (j < 0 || (j == 0 && i < 0) ? n >= v : n > v) return 0;
+    }
+  }
+  return 1;
+}
+
+/// Find the k highest peaks (local maxima) of the map.
+/// Sets peaks[0..] to the peaks in decreasing order of NCC (in raster
+/// order, on ties), and returns how many were found (at most k).
+/// Of a plateau of equal values, only its first point is a peak.
+int ImageNCCPeaks(ImageNCCMap m, int k, ImagePeak peaks[]) { ///
+  assert (m != NULL);
+  assert (k >= 0);
+  int n = 0;
+  if (k == 0) return 0;
+  for (int y = 0; y < m->height; y++) {
+    for (int x = 0; x < m->width; x++) {
+      double v = m->ncc[(size_t)y * m->width + x];
+      if ((n == k && v <= peaks[n - 1].score) || !nccIsPeak(m, x, y)) continue;
+      // Inserir, mantendo a ordem
+      int i = n < k ? n++ : n - 1;
+      for (; i > 0 && peaks[i - 1].score < v; i--) peaks[i] = peaks[i - 1];
+      peaks[i].x = x;
+      peaks[i].y = y;
+      peaks[i].score = v;
+    }
+  }
+  return n;
+}
+
+/// Convert the map to an image, for inspection.
+/// NCC -1 is black and 1 is white (maxval 255).
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageNCCImage(ImageNCCMap m) { ///
+  assert (m != NULL);
+  Image img = imageNew(m->width, m->height, PixMax);
+  if (img == NULL) return NULL;
+  for (int y = 0; y < m->height; y++) {
+    uint8* row = rowPtr(img, y);
+    for (int x = 0; x < m->width; x++) {
+      row[x] = (uint8)((m->ncc[(size_t)y * m->width + x] + 1.0) * 127.5 + 0.5);
+    }
+  }
+  PIXMEM += (unsigned long)m->width * m->height;  // count pixel memory accesses
+  return img;
+}
+
+
+/// Tiled pipelines
+
+// Um pipeline é guardado como a fonte da imagem e a lista de etapas.
+// A execução percorre a imagem em blocos (tiles) de linhas completas:
+// a fonte produz as linhas do bloco e cada etapa processa todas as linhas
+// que a etapa anterior já terminou.  As etapas pontuais, colar, misturar e
+// guardar não têm atraso; o filtro de média (ImageRowBlur) fica dy linhas
+// atrás da etapa anterior.  No último bloco todas as etapas terminam.
+// Como cada linha passa pelas etapas pela mesma ordem das operações
+// completas, o resultado é exatamente o mesmo.
+
+// Bytes por bloco: o bloco deve caber na cache L2 junto com os buffers
+#define PIPELINE_TILE_BYTES (128 * 1024)
+
+// Fontes
+enum { SRC_NONE, SRC_LOAD, SRC_BLACK, SRC_CROP, SRC_IMAGE };
+
+// Etapas
+enum { STAGE_LUT, STAGE_BLUR, STAGE_PASTE, STAGE_BLEND, STAGE_MIRROR, STAGE_SAVE };
+
+struct stage {
+  int kind;
+  uint8 lut[256];     // STAGE_LUT
+  ImageRowBlur rb;    // STAGE_BLUR
+  int x, y;           // STAGE_PASTE, STAGE_BLEND: posição de img2
+  Image img2;
+  double alpha;       // STAGE_BLEND
+  FILE* f;            // STAGE_SAVE: o ficheiro temporário tmp, que
+  char* tmp;          // substitui o ficheiro name no fim da execução
+  char* name;
+  int done;           // linhas [0, done[ já processadas pela etapa
+};
+
+struct pipeline {
+  int source;
+  FILE* in;           // SRC_LOAD: ficheiro posicionado no primeiro pixel
+  Image src;          // SRC_CROP, SRC_IMAGE
+  int sx, sy;         // SRC_CROP: canto do retângulo
+  int width, height, maxval;
+  struct stage* stages;
+  int nstages;
+  int capacity;
+};
+
+/// Create an empty pipeline.
+/// On success, a new pipeline is returned.
+/// (The caller is responsible for destroying it!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+ImagePipeline ImagePipelineCreate(void) { ///
+  ImagePipeline p = (ImagePipeline)calloc(1, sizeof(struct pipeline));
+  if (p == NULL) {
+    errCause = "Falha na alocação de memória para o pipeline";
+    return NULL;
+  }
+  p->source = SRC_NONE;
+  return p;
+}
+
+/// Destroy the pipeline pointed to by (*pp), closing its files.
+/// If (*pp)==NULL, no operation is performed.
+/// Ensures: (*pp)==NULL.
+void ImagePipelineDestroy(ImagePipeline* pp) { ///
+  assert (pp != NULL);
+  ImagePipeline p = *pp;
+  if (p == NULL) return;
+  errsave = errno;
+  if (p->in != NULL) fclose(p->in);
+  for (int i = 0; i < p->nstages; i++) {
+    ImageRowBlurDestroy(&p->stages[i].rb);
+    if (p->stages[i].f != NULL) fclose(p->stages[i].f);
+    replaceEnd(&p->stages[i].name, &p->stages[i].tmp, 0);
+  }
+  free(p->stages);
+  free(p);
+  *pp = NULL;
+  errno = errsave;
+}
+
+/// Source: load the raw PGM file filename.
+/// The header is read now, the pixels are read tile by tile by ImagePipelineRun.
+/// Requires: p has no source yet.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set accordingly.
+int ImagePipelineLoad(ImagePipeline p, const char* filename) { ///
+  assert (p != NULL && p->source == SRC_NONE);
+  int success =
+  check( (p->in = fopen(filename, "rb")) != NULL, "Open failed" ) &&
+  readHeader(p->in, &p->width, &p->height, &p->maxval);
+  if (!success) {
+    errsave = errno;
+    if (p->in != NULL) fclose(p->in);
+    p->in = NULL;
+    errno = errsave;
+    return 0;
+  }
+  p->source = SRC_LOAD;
+  return 1;
+}
+
+/// Source: a new black image, as ImageCreate(width, height, maxval).
+/// Requires: p has no source yet, and the ImageCreate preconditions.
+void ImagePipelineBlack(ImagePipeline p, int width, int height, uint8 maxval) { ///
+  assert (p != NULL && p->source == SRC_NONE);
+  assert (width >= 0 && height >= 0);
+  assert (0 < maxval && maxval <= PixMax);
+  p->source = SRC_BLACK;
+  p->width = width;
+  p->height = height;
+  p->maxval = maxval;
+}
+
+/// Source: the rectangle (x,y,w,h) of img, as ImageCrop(img, x, y, w, h).
+/// img must not be changed or destroyed before the pipeline runs.
+/// Requires: p has no source yet, and the ImageCrop preconditions.
+void ImagePipelineCrop(ImagePipeline p, Image img, int x, int y, int w, int h) { ///
+  assert (p != NULL && p->source == SRC_NONE);
+  assert (img != NULL);
+  assert (ImageValidRect(img, x, y, w, h));
+  p->source = SRC_CROP;
+  p->src = img;
+  p->sx = x;
+  p->sy = y;
+  p->width = w;
+  p->height = h;
+  p->maxval = img->maxval;
+}
+
+/// Source: the existing image img, which the stages modify in-place.
+/// Requires: p has no source yet.
+void ImagePipelineImage(ImagePipeline p, Image img) { ///
+  assert (p != NULL && p->source == SRC_NONE);
+  assert (img != NULL);
+  p->source = SRC_IMAGE;
+  p->src = img;
+  p->width = img->width;
+  p->height = img->height;
+  p->maxval = img->maxval;
+}
+
+/// Get the width of the image produced by the pipeline.
+int ImagePipelineWidth(ImagePipeline p) { ///
+  assert (p != NULL && p->source != SRC_NONE);
+  return p->width;
+}
+
+/// Get the height of the image produced by the pipeline.
+int ImagePipelineHeight(ImagePipeline p) { ///
+  assert (p != NULL && p->source != SRC_NONE);
+  return p->height;
+}
+
+// Acrescentar uma etapa vazia; retorna NULL se não houver memória
+static struct stage* addStage(ImagePipeline p, int kind) {
+  assert (p->source != SRC_NONE);
+  if (p->nstages == p->capacity) {
+    int capacity = p->capacity == 0 ? 8 : 2 * p->capacity;
+    struct stage* stages = (struct stage*)realloc(p->stages, (size_t)capacity * sizeof(struct stage));
+    if (stages == NULL) {
+      errCause = "Falha na alocação de memória para o pipeline";
+      return NULL;
+    }
+    p->stages = stages;
+    p->capacity = capacity;
+  }
+  struct stage* st = &p->stages[p->nstages++];
+  memset(st, 0, sizeof(struct stage));
+  st->kind = kind;
+  return st;
+}
+
+/// Stage: replace each pixel level v by lut[v], as ImageApplyLUT.
+/// Consecutive LUT stages are composed into a single stage.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set accordingly.
+int ImagePipelineLUT(ImagePipeline p, const uint8 lut[256]) { ///
+  assert (p != NULL);
+  assert (lut != NULL);
+  if (p->nstages > 0 && p->stages[p->nstages - 1].kind == STAGE_LUT) {
+    uint8* prev = p->stages[p->nstages - 1].lut;
+    for (int v = 0; v < 256; v++) prev[v] = lut[prev[v]];
+    return 1;
+  }
+  struct stage* st = addStage(p, STAGE_LUT);
+  if (st == NULL) return 0;
+  memcpy(st->lut, lut, 256);
+  return 1;
+}
+
+/// Stage: ImageNegative(CURR).
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set accordingly.
+int ImagePipelineNegative(ImagePipeline p) { ///
+  assert (p != NULL && p->source != SRC_NONE);
+  uint8 lut[256];
+  ImageLUTIdentity(lut);
+  negRowScalar(lut, 256, (uint8)p->maxval);
+  return ImagePipelineLUT(p, lut);
+}
+
+/// Stage: ImageThreshold(CURR, thr).
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set accordingly.
+int ImagePipelineThreshold(ImagePipeline p, uint8 thr) { ///
+  assert (p != NULL && p->source != SRC_NONE);
+  uint8 lut[256];
+  ImageLUTIdentity(lut);
+  thrRowScalar(lut, 256, thr, (uint8)p->maxval);
+  return ImagePipelineLUT(p, lut);
+}
+
+/// Stage: ImageBrighten(CURR, factor).
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set accordingly.
+int ImagePipelineBrighten(ImagePipeline p, double factor) { ///
+  assert (p != NULL && p->source != SRC_NONE);
+  uint8 lut[256];
+  ImageLUTIdentity(lut);
+  briRowScalar(lut, 256, factor, p->maxval);
+  return ImagePipelineLUT(p, lut);
+}
+
+/// Stage: mirror CURR left-right, in-place.
+/// (The same pixels as ImageMirror, but without creating a new image.)
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set accordingly.
+int ImagePipelineMirror(ImagePipeline p) { ///
+  assert (p != NULL);
+  return addStage(p, STAGE_MIRROR) != NULL;
+}
+
+/// Stage: ImageBlur(CURR, dx, dy).
+/// Requires: dx >= 0, dy >= 0.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set accordingly.
+int ImagePipelineBlur(ImagePipeline p, int dx, int dy) { ///
+  assert (p != NULL);
+  assert (dx >= 0 && dy >= 0);
+  ImageRowBlur rb = ImageRowBlurCreate(p->width, p->height, dx, dy);
+  if (rb == NULL) return 0;
+  struct stage* st = addStage(p, STAGE_BLUR);
+  if (st == NULL) {
+    ImageRowBlurDestroy(&rb);
+    return 0;
+  }
+  st->rb = rb;
+  return 1;
+}
+
+/// Stage: ImagePaste(CURR, x, y, img2).
+/// img2 must not be changed or destroyed before the pipeline runs.
+/// Requires: img2 must fit inside the pipeline image at position (x, y).
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set accordingly.
+int ImagePipelinePaste(ImagePipeline p, int x, int y, Image img2) { ///
+  assert (p != NULL && img2 != NULL);
+  assert (0 <= x && img2->width <= p->width - x);
+  assert (0 <= y && img2->height <= p->height - y);
+  struct stage* st = addStage(p, STAGE_PASTE);
+  if (st == NULL) return 0;
+  st->x = x;
+  st->y = y;
+  st->img2 = img2;
+  return 1;
+}
+
+/// Stage: ImageBlend(CURR, x, y, img2, alpha).
+/// img2 must not be changed or destroyed before the pipeline runs.
+/// Requires: img2 must fit inside the pipeline image at position (x, y).
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set accordingly.
+int ImagePipelineBlend(ImagePipeline p, int x, int y, Image img2, double alpha) { ///
+  assert (p != NULL && img2 != NULL);
+  assert (0 <= x && img2->width <= p->width - x);
+  assert (0 <= y && img2->height <= p->height - y);
+  struct stage* st = addStage(p, STAGE_BLEND);
+  if (st == NULL) return 0;
+  st->x = x;
+  st->y = y;
+  st->img2 = img2;
+  st->alpha = alpha;
+  return 1;
+}
+
+/// Stage: ImageSave(CURR, filename).
+/// The pixels are written tile by tile by ImagePipelineRun to a new file
+/// in the same directory, which replaces filename when the run succeeds.
+/// So filename may be the file the pipeline loads, or any image is mapped
+/// from, and it is left untouched if the run fails.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set accordingly.
+int ImagePipelineSave(ImagePipeline p, const char* filename) { ///
+  assert (p != NULL);
+  struct stage* st = NULL;
+  char* name = NULL;
+  char* tmp = NULL;
+  FILE* f = replaceBegin(filename, &name, &tmp);
+  if (f == NULL || (st = addStage(p, STAGE_SAVE)) == NULL) {
+    errsave = errno;
+    if (f != NULL) fclose(f);
+    replaceEnd(&name, &tmp, 0);
+    errno = errsave;
+    return 0;
+  }
+  st->f = f;
+  st->tmp = tmp;
+  st->name = name;
+  return 1;
+}
+
+// As linhas da imagem em processamento.  A linha y está em
+// buf + (y % cap) * stride: no ImagePipelineRun, cap é a altura da imagem
+// e buf são os seus pixeis; no ImagePipelineStream, buf é um anel de cap
+// linhas, reutilizadas quando a última etapa as termina.
+struct rows {
+  uint8* buf;
+  int width;
+  int stride;
+  int cap;
+};
+
+static inline uint8* rowAt(const struct rows* r, int y) {
+  return r->buf + (size_t)(y % r->cap) * r->stride;
+}
+
+// Processar na etapa st as linhas [st->done, avail[ que a etapa anterior
+// já terminou.  Retorna 0 em caso de erro de escrita.
+static int stageRun(struct stage* st, const struct rows* r, int avail) {
+  int width = r->width;
+  unsigned long n = (unsigned long)width * (avail - st->done);
+  switch (st->kind) {
+    case STAGE_LUT: {
+      for (int y = st->done; y < avail; y++) lutRow(rowAt(r, y), width, st->lut);
+      PIXMEM += 2 * n;  // uma leitura e uma escrita por pixel
+      st->done = avail;
+      break;
+    }
+    case STAGE_MIRROR: {
+      for (int y = st->done; y < avail; y++) {
+        uint8* p = rowAt(r, y);
+        for (int i = 0, j = width - 1; i < j; i++, j--) {
+          uint8 t = p[i];
+          p[i] = p[j];
+          p[j] = t;
+        }
+      }
+      PIXMEM += 2 * n;  // uma leitura e uma escrita por pixel
+      st->done = avail;
+      break;
+    }
+    case STAGE_PASTE:
+    case STAGE_BLEND: {
+      // Linhas da img2 que caem em [done, avail[
+      Image img2 = st->img2;
+      int j0 = st->done > st->y ? st->done - st->y : 0;
+      int j1 = avail - st->y < img2->height ? avail - st->y : img2->height;
+      for (int j = j0; j < j1; j++) {
+        uint8* p1 = rowAt(r, st->y + j) + st->x;
+        const uint8* p2 = rowPtr(img2, j);
+        if (st->kind == STAGE_PASTE) {
+          memcpy(p1, p2, (size_t)img2->width);
+        } else {
+          blendRow(p1, p2, img2->width, st->alpha);
+        }
+      }
+      if (j0 < j1) {
+        // colar: uma leitura e uma escrita; misturar: duas leituras e uma escrita
+        PIXMEM += (st->kind == STAGE_PASTE ? 2 : 3) * (unsigned long)img2->width * (j1 - j0);
+      }
+      st->done = avail;
+      break;
+    }
+    case STAGE_SAVE: {
+      for (int y = st->done; y < avail; y++) {
+        if (!check( fwrite(rowAt(r, y), sizeof(uint8), (size_t)width, st->f) == (size_t)width,
+                    "Writing pixels failed" )) return 0;
+      }
+      PIXMEM += n;  // count pixel memory accesses
+      st->done = avail;
+      break;
+    }
+    case STAGE_BLUR: {
+      // Entram linhas até a próxima saída estar pronta; sai uma linha; etc.
+      ImageRowBlur rb = st->rb;
+      for (;;) {
+        if (ImageRowBlurReady(rb)) {
+          ImageRowBlurPop(rb, rowAt(r, rb->popped));
+          PIXMEM += (unsigned long)width;
+        } else if (rb->pushed < avail) {
+          ImageRowBlurPush(rb, rowAt(r, rb->pushed));
+          PIXMEM += (unsigned long)width;
+        } else {
+          break;
+        }
+      }
+      BLUROPS += 3 * (size_t)width * (rb->popped - st->done);
+      st->done = rb->popped;
+      break;
+    }
+  }
+  return 1;
+}
+
+// Linhas por bloco
+static int tileRows(ImagePipeline p) {
+  int tile = p->width > 0 ? PIPELINE_TILE_BYTES / p->width : p->height;
+  return tile < 1 ? 1 : tile;
+}
+
+// Executar o pipeline sobre as linhas r: fonte e etapas, bloco a bloco.
+// Retorna 0 em caso de erro.
+static int pipelineRun(ImagePipeline p, const struct rows* r) {
+  int width = p->width;
+  int height = p->height;
+  int success = 1;
+  for (int i = 0; success && i < p->nstages; i++) {
+    if (p->stages[i].kind == STAGE_SAVE) {
+      success = check( fprintf(p->stages[i].f, "P5\n%d %d\n%u\n", width, height, p->maxval) > 0,
+                       "Writing header failed" );
+    }
+  }
+
+  int tile = tileRows(p);
+  for (int y0 = 0; success && y0 < height; y0 += tile) {
+    int y1 = y0 + tile < height ? y0 + tile : height;
+    // As linhas [y0, y1[ não podem ocupar linhas do anel ainda em uso
+    assert (y1 - (p->nstages > 0 ? p->stages[p->nstages - 1].done : y0) <= r->cap);
+    // Fonte: linhas [y0, y1[
+    unsigned long n = (unsigned long)width * (y1 - y0);
+    for (int y = y0; success && y < y1; y++) {
+      uint8* row = rowAt(r, y);
+      if (p->source == SRC_LOAD) {
+        success = check( fread(row, sizeof(uint8), (size_t)width, p->in) == (size_t)width,
+                         "Reading pixels" );
+      } else if (p->source == SRC_CROP) {
+        memcpy(row, rowPtr(p->src, p->sy + y) + p->sx, (size_t)width);
+      } else if (p->source == SRC_BLACK && y >= r->cap) {
+        memset(row, 0, (size_t)width);  // linha reutilizada do anel
+      }
+    }
+    if (p->source == SRC_LOAD) PIXMEM += n;  // count pixel memory accesses
+    if (p->source == SRC_CROP) PIXMEM += 2 * n;  // uma leitura e uma escrita por pixel
+    // Etapas, pela ordem
+    int avail = y1;
+    for (int i = 0; success && i < p->nstages; i++) {
+      success = stageRun(&p->stages[i], r, avail);
+      avail = p->stages[i].done;
+    }
+  }
+
+  // Fechar os ficheiros guardados, verificando a escrita, e só então
+  // substituir os ficheiros finais (ou apagar os temporários, se falhou)
+  for (int i = 0; i < p->nstages; i++) {
+    if (p->stages[i].f != NULL) {
+      // (Sem apagar o errCause de um erro anterior)
+      int closed = fclose(p->stages[i].f) == 0;
+      success = success && check( closed, "Writing pixels failed" );
+      p->stages[i].f = NULL;
+    }
+  }
+  for (int i = 0; i < p->nstages; i++) {
+    if (p->stages[i].kind == STAGE_SAVE) {
+      success = replaceEnd(&p->stages[i].name, &p->stages[i].tmp, success);
+    }
+  }
+  return success;
+}
+
+/// Run the pipeline: produce the image from the source, tile by tile,
+/// passing each tile through all stages.
+/// The pipeline cannot be run again (it should be destroyed next).
+/// On success, returns the resulting image: a new image, or the source
+/// image for ImagePipelineImage.
+/// (The caller is responsible for destroying a new image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+/// Stages may have been partially applied to an ImagePipelineImage source.
+/// The files of the save stages are only replaced if the run succeeds.
+Image ImagePipelineRun(ImagePipeline p) { ///
+  assert (p != NULL && p->source != SRC_NONE);
+  PROFILE((unsigned long)p->width * p->height, (unsigned long)p->width * p->height, (unsigned long)p->width * p->height);
+  Image img = p->source == SRC_IMAGE ? p->src : ImageCreate(p->width, p->height, (uint8)p->maxval);
+  if (img == NULL) return NULL;
+
+  struct rows r = { img->pixel, p->width, img->stride, p->height > 0 ? p->height : 1 };
+  int success = pipelineRun(p, &r);
+  touch(img);
+  if (!success && p->source != SRC_IMAGE) {
+    errsave = errno;
+    ImageDestroy(&img);
+    errno = errsave;
+  }
+  return success ? img : NULL;
+}
+
+/// Run the pipeline in bounded memory, for images that may not fit in it.
+/// Same as ImagePipelineRun, but the resulting image is not kept: only
+/// a strip of rows is resident at a time (a tile plus dy rows for each
+/// blur stage), so the pipeline should end with ImagePipelineSave.
+/// The pipeline cannot be run again (it should be destroyed next).
+/// Requires: the source is not ImagePipelineImage.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set accordingly.
+/// The files of the save stages are only replaced if the run succeeds.
+int ImagePipelineStream(ImagePipeline p) { ///
+  assert (p != NULL && p->source != SRC_NONE && p->source != SRC_IMAGE);
+  // Cada filtro de média atrasa-se dy linhas em relação à etapa anterior
+  int cap = tileRows(p);
+  for (int i = 0; i < p->nstages; i++) {
+    int dy = p->stages[i].kind == STAGE_BLUR ? p->stages[i].rb->dy : 0;
+    cap += dy < p->height ? dy : p->height;
+  }
+  if (cap > p->height) cap = p->height > 0 ? p->height : 1;
+
+  struct rows r = { NULL, p->width, p->width, cap };
+  if (!check( (r.buf = (uint8*)calloc((size_t)cap * p->width + 1, 1)) != NULL,
+              "Falha na alocação de memória para as linhas" )) return 0;
+  int success = pipelineRun(p, &r);
+  free(r.buf);
+  return success;
+}
@@ -36,9 +36,20 @@ typedef struct image *Image;
 char* ImageErrMsg() ;
 
 /// Init Image library.  (Call once!)
-/// Currently, simply calibrate instrumentation and set names of counters.
+/// Calibrate instrumentation, set names of counters and start the
+/// worker threads (one per online processor).
 void ImageInit(void) ;
 
+/// Set the number of threads used by image operations.
+/// nthreads <= 1 makes all operations run serially in the calling thread.
+/// Results do not depend on the number of threads.
+/// On success, returns nonzero.
+/// On failure, returns 0, errCause is set and operations run serially.
+int ImageSetThreads(int nthreads) ;
+
+/// Number of threads used by image operations.
+int ImageThreads(void) ;
+
 /// Image management functions
 
 /// Create a new black image.
@@ -56,8 +67,14 @@ Image ImageCreate(int width, int height, uint8 maxval) ;
 /// If (*imgp)==NULL, no operation is performed.
 /// Ensures: (*imgp)==NULL.
 /// Should never fail, and should preserve global errno/errCause.
+/// The pixel buffer is kept for reuse by new images (see ImagePoolTrim).
 void ImageDestroy(Image* imgp) ;
 
+/// Release the pixel buffers kept for reuse by destroyed images.
+/// Images destroyed afterwards refill the pool.
+/// Should never fail, and preserves global errno/errCause.
+void ImagePoolTrim(void) ;
+
 /// PGM file operations
 
 /// Load a raw PGM file.
@@ -67,16 +84,34 @@ void ImageDestroy(Image* imgp) ;
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageLoad(const char* filename) ;
 
+/// Load a raw PGM file by mapping it into memory.
+/// Same as ImageLoad, but the pixels are not read: the image uses a
+/// private (copy-on-write) mapping of the file, so pages are only read
+/// when first accessed, and changes to the image never reach the file.
+/// Falls back to ImageLoad for files that are not regular files.
+/// The file must not be truncated while the image exists.  ImageSave and
+/// ImagePipelineSave do not truncate it: they write a new file that
+/// replaces it, and the image keeps the pixels of the old file.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageLoadMapped(const char* filename) ;
+
 /// Save image to PGM file.
+/// The image is written to a new file in the same directory, which then
+/// replaces filename, so filename may be a file that images are mapped from.
 /// On success, returns nonzero.
 /// On failure, returns 0, errno/errCause are set appropriately, and
-/// a partial and invalid file may be left in the system.
+/// filename is left untouched.
 int ImageSave(Image img, const char* filename) ;
 
 /// Information queries
 
 /// These functions do not modify the image and never fail.
 
+/// Check if img is a view of another image (see ImageView).
+int ImageIsView(Image img) ;
+
 /// Get image width
 int ImageWidth(Image img) ;
 
@@ -91,8 +126,15 @@ int ImageMaxval(Image img) ;
 /// On return,
 /// *min is set to the minimum gray level in the image,
 /// *max is set to the maximum.
+/// The statistics are cached with the image until its pixels change, so
+/// repeated calls cost O(1).
+/// Requires: the image is not empty.
 void ImageStats(Image img, uint8* min, uint8* max) ;
 
+/// Mean gray level of the image (0 for an empty image).
+/// Cached with the image, like ImageStats.
+double ImageMean(Image img) ;
+
 /// Check if pixel position (x,y) is inside img.
 int ImageValidPos(Image img, int x, int y) ;
 
@@ -135,6 +177,53 @@ void ImageThreshold(Image img, uint8 thr) ;
 /// darken the image if factor<1.0.
 void ImageBrighten(Image img, double factor) ;
 
+/// Lookup tables
+
+/// A lookup table (LUT) is an array of 256 levels that maps each pixel
+/// level p to level lut[p].
+/// Negative, threshold and brighten depend only on the pixel level, so any
+/// sequence of them is a LUT, and applying that LUT takes a single pass
+/// over the image, with exactly the same result as the sequence.
+/// The builders below append one operation to a LUT: after the call,
+/// applying lut to img gives the same image as applying the previous lut
+/// and then the operation to img.
+
+/// Set lut to the identity (no operation).
+void ImageLUTIdentity(uint8 lut[256]) ;
+
+/// Append ImageNegative(img) to lut.
+void ImageLUTNegative(Image img, uint8 lut[256]) ;
+
+/// Append ImageThreshold(img, thr) to lut.
+void ImageLUTThreshold(Image img, uint8 lut[256], uint8 thr) ;
+
+/// Append ImageBrighten(img, factor) to lut.
+void ImageLUTBrighten(Image img, uint8 lut[256], double factor) ;
+
+/// Replace each pixel level p in img by lut[p].
+void ImageApplyLUT(Image img, const uint8 lut[256]) ;
+
+/// Histograms
+
+/// Compute the histogram of an image.
+/// Sets hist[v] to the number of pixels with gray level v, for v in [0, 255].
+/// The histogram is computed in parallel by the worker threads
+/// (see ImageSetThreads), and cached with the image until its pixels
+/// change, so repeated calls cost O(1).
+void ImageHistogram(Image img, uint64_t hist[256]) ;
+
+/// Set lut to the histogram equalization of img.
+/// Level v maps to (cdf(v) - cdf(min)) * maxval / (N - cdf(min)), rounded,
+/// where cdf(v) is the number of pixels with level <= v, min is the
+/// minimum level and N the number of pixels; so the levels spread over
+/// [0, maxval] as evenly as possible.
+/// If all pixels have the same level, lut is the identity.
+void ImageLUTEqualize(Image img, uint8 lut[256]) ;
+
+/// Equalize the histogram of the image.
+/// Applies ImageLUTEqualize(img) to img, in a single pass.
+void ImageEqualize(Image img) ;
+
 /// Geometric transformations
 
 /// These functions apply geometric transformations to an image,
@@ -155,6 +244,30 @@ void ImageBrighten(Image img, double factor) ;
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageRotate(Image img) ;
 
+/// Rotate an image 90 degrees clockwise.
+/// Ensures: The original img is not modified.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageRotateCW(Image img) ;
+
+/// Rotate an image 180 degrees.
+/// Ensures: The original img is not modified.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageRotate180(Image img) ;
+
+/// Transpose an image: pixel (x,y) goes to (y,x).
+/// Ensures: The original img is not modified.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageTranspose(Image img) ;
+
 /// Mirror an image = flip left-right.
 /// Returns a mirrored version of the image.
 /// Ensures: The original img is not modified.
@@ -178,6 +291,20 @@ Image ImageMirror(Image img) ;
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageCrop(Image img, int x, int y, int w, int h) ;
 
+/// Create a view of a rectangle of img.
+/// The view is an image of width w and height h whose pixels are the
+/// pixels of the rectangle (x,y,w,h) of img: no pixels are copied, and
+/// changes to the view change img (and vice-versa).
+/// All image operations accept views.
+/// Requires:
+///   The rectangle must be inside img.
+///   The views of img must be destroyed before img.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageView(Image img, int x, int y, int w, int h) ;
+
 /// Operations on two images
 
 /// Paste an image into a larger image.
@@ -203,14 +330,434 @@ int ImageMatchSubImage(Image img1, int x, int y, Image img2) ;
 /// Searches for img2 inside img1.
 /// If a match is found, returns 1 and matching position is set in vars (*px, *py).
 /// If no match is found, returns 0 and (*px, *py) are left untouched.
+/// Uses the default algorithm (LOCATE_AUTO).
 int ImageLocateSubImage(Image img1, int* px, int* py, Image img2) ;
 
+/// Locate algorithms.
+/// All of them find the same match as ImageLocateSubImage (the first one
+/// in raster order); they differ in running time.
+typedef enum {
+  LOCATE_AUTO,    // LOCATE_DIRECT, switching to LOCATE_HASH when too many
+                  // positions pass the direct search's prefilter
+  LOCATE_HASH,    // 2D rolling hash: O(W*H) expected, O(W) extra memory
+  LOCATE_DIRECT,  // compares img2 at every position: O(W*H*w*h) worst case
+} LocateMode;
+
+/// Locate a subimage like ImageLocateSubImage, using the given algorithm.
+/// If the algorithm cannot get the memory it needs, LOCATE_DIRECT is used.
+/// The candidate rows are searched in parallel by the worker threads
+/// (see ImageSetThreads), with the same result.
+int ImageLocateSubImageUsing(Image img1, int* px, int* py, Image img2, LocateMode mode) ;
+
+/// Haystack indexes
+
+/// An index of an image speeds up repeated exact searches of subimages
+/// in it (with ImageIndexLocate), and can be saved to a file and loaded
+/// again for the same image.
+
+// Type ImageIndex is a pointer to image index objects
+typedef struct imageindex *ImageIndex;
+
+/// Build the index of an image for repeated exact searches.
+/// The index records the hash of every block of block x block pixels of
+/// img, so that ImageIndexLocate can search for any img2 at least that
+/// large by checking only the positions of one of its blocks.
+/// Building costs O(N) time and about 32 bytes per pixel of temporary
+/// memory, for N pixels in img; the index itself uses 4 to 16 bytes per
+/// pixel.  Larger blocks give more selective indexes.
+/// The index refers to img: img must not change or be destroyed while
+/// the index is used.
+/// Requires: 0 < block <= width and height of img.
+/// On success, a new index is returned.
+/// (The caller is responsible for destroying the returned index!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+ImageIndex ImageIndexCreate(Image img, int block) ;
+
+/// Destroy the index pointed to by (*idxp).
+/// If (*idxp)==NULL, no operation is performed.
+/// Ensures: (*idxp)==NULL.
+/// Should never fail, and should preserve global errno/errCause.
+void ImageIndexDestroy(ImageIndex* idxp) ;
+
+/// Block size of the index.
+int ImageIndexBlock(ImageIndex idx) ;
+
+/// Save the index to a file.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// a partial and invalid file may be left in the system.
+int ImageIndexSave(ImageIndex idx, const char* filename) ;
+
+/// Load the index of img from a file saved by ImageIndexSave.
+/// The file is mapped into memory (and read only as needed by searches).
+/// The index must have been built from an image with the same pixels as
+/// img (this is verified), and then refers to img, as in ImageIndexCreate.
+/// On success, a new index is returned.
+/// (The caller is responsible for destroying the returned index!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+ImageIndex ImageIndexLoad(Image img, const char* filename) ;
+
+/// Locate a subimage inside the indexed image.
+/// Searches for img2 inside the image of idx, like ImageLocateSubImage,
+/// but only at the positions where one of the blocks of img2 occurs in
+/// the image, according to the index.  Finds the first match in raster
+/// order, over all positions where img2 fits.
+/// If img2 is smaller than the block size, all positions are searched.
+/// If a match is found, returns 1 and matching position is set in vars (*px, *py).
+/// If no match is found, returns 0 and (*px, *py) are left untouched.
+/// Requires: the indexed image has not changed.
+int ImageIndexLocate(ImageIndex idx, int* px, int* py, Image img2) ;
+
+/// Multi-template search
+
+/// An occurrence of template number id with its top left corner at (x, y)
+typedef struct {
+  int id;
+  int x, y;
+} ImageOccurrence;
+
+/// Locate all occurrences of several templates inside an image.
+/// Searches for each of the ntemplates images tpl[0..ntemplates[ inside
+/// img, in a single pass over img (Baker-Bird algorithm), and finds all
+/// positions (x, y) where ImageMatchSubImage(img, x, y, tpl[id]) is true.
+/// Requires: the templates are not empty (width and height > 0).
+/// On success, returns a new array with the occurrences, sorted by y, x
+/// and template id, and sets *noccurrences to their number.
+/// (The caller is responsible for freeing the array!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+ImageOccurrence* ImageLocateAll(Image img, int ntemplates, Image tpl[], int* noccurrences) ;
+
+/// Approximate matching
+
+/// Distances between an image and a subimage of the same size
+typedef enum {
+  MATCH_SAD,  // sum of absolute differences of the pixels
+  MATCH_SSD,  // sum of squared differences of the pixels
+} MatchMetric;
+
+/// Find the subimage of img1 most similar to img2.
+/// Computes the distance (given metric) between img2 and the subimage of
+/// img1 at each position (x, y) where img2 fits, and finds the position
+/// with the smallest distance (the first one in raster order, on ties).
+/// Only distances <= threshold are accepted (UINT64_MAX accepts all).
+/// If a position is found, returns 1 and sets (*px, *py) and *pscore
+/// to the position and its distance.
+/// Otherwise, returns 0 and (*px, *py) and *pscore are left untouched.
+/// The candidate rows are searched in parallel by the worker threads
+/// (see ImageSetThreads), with the same result.
+int ImageMatchBest(Image img1, int* px, int* py, Image img2,
+                   MatchMetric metric, uint64_t threshold, uint64_t* pscore) ;
+
+/// Image pyramids
+
+/// Get a level of the pyramid of an image.
+/// Level 0 is img itself, and level k+1 is level k halved: its width and
+/// height are halved (rounded down) and each pixel is the mean (rounded)
+/// of a 2x2 box of level k.
+/// Levels are built when first needed, and cached with img until its
+/// pixels change or it is destroyed.
+/// The returned image belongs to img: it must not be modified or destroyed,
+/// and is valid only until img is changed or destroyed.
+/// Requires: level >= 0.
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImagePyramidLevel(Image img, int level) ;
+
+/// Locate a subimage inside another image, using image pyramids.
+/// Searches for img2 inside img1, from coarse to fine: the positions
+/// where img2 is most similar (by SAD) to img1 are found at a coarse level
+/// of their pyramids (see ImagePyramidLevel), and refined in small windows
+/// at each finer level, down to img1 itself.
+/// This is much faster than ImageLocateSubImage for large images, but it
+/// is a heuristic.  If exact is zero, the most similar position found is
+/// returned, which may not be the most similar of all, but is an exact
+/// match in most cases where there is one.
+/// If exact is nonzero, only exact matches are returned: the positions
+/// found at level 0 are verified with ImageMatchSubImage and, if none
+/// matches, ImageLocateSubImage is used, so a match is found whenever
+/// ImageLocateSubImage finds one (not necessarily the same one).
+/// If a position is found, returns 1 and it is set in vars (*px, *py).
+/// Otherwise, returns 0 and (*px, *py) are left untouched.
+/// The pyramids are kept with img1 and img2 (see ImagePyramidLevel).
+/// If they cannot be built, the search is done at level 0 only.
+int ImageLocatePyramid(Image img1, int* px, int* py, Image img2, int exact) ;
+
 /// Filtering
 
 /// Blur an image by a applying a (2dx+1)x(2dy+1) mean filter.
 /// Each pixel is substituted by the mean of the pixels in the rectangle
 /// [x-dx, x+dx]x[y-dy, y+dy].
 /// The image is changed in-place.
+/// Uses the default algorithm (BLUR_SAT).
 void ImageBlur(Image img, int dx, int dy) ;
 
+/// Blur algorithms.
+/// All of them produce exactly the same result as ImageBlur; they differ
+/// in running time and in the extra memory they need.
+typedef enum {
+  BLUR_SAT,       // summed-area table: O(1) per pixel, 8 bytes per pixel extra
+  BLUR_SEPARABLE, // running sums: O(1) per pixel, O(width*(2dy+1)) extra
+  BLUR_DIRECT,    // visits the whole window: O(dx*dy) per pixel, full copy
+} BlurMode;
+
+/// Blur an image like ImageBlur, using the given algorithm.
+/// If the algorithm cannot get the memory it needs, the image is still
+/// blurred, using BLUR_DIRECT.
+void ImageBlurUsing(Image img, int dx, int dy, BlurMode mode) ;
+
+/// Row-streaming blur
+
+/// A row blur applies the ImageBlur filter to an image that is given one
+/// row at a time, top to bottom, and produces the blurred rows in the same
+/// order, a few rows behind.  It keeps only O(width*(2dy+1)) state, so it
+/// can blur images that are never completely in memory.
+/// The output rows are exactly the rows ImageBlur would produce.
+///
+/// Use as follows:
+///   for (int y = 0; y < height; y++) {
+///     while (!ImageRowBlurReady(rb)) ImageRowBlurPush(rb, <next input row>);
+///     ImageRowBlurPop(rb, <output row y>);
+///   }
+/// An output row may be the same memory as an input row that was pushed.
+
+// Type ImageRowBlur is a pointer to row blur objects
+typedef struct rowBlur *ImageRowBlur;
+
+/// Create a row blur for images of the given size.
+/// Requires: width, height, dx, dy must be non-negative.
+/// On success, a new row blur is returned.
+/// (The caller is responsible for destroying it!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+ImageRowBlur ImageRowBlurCreate(int width, int height, int dx, int dy) ;
+
+/// Destroy the row blur pointed to by (*rbp).
+/// If (*rbp)==NULL, no operation is performed.
+/// Ensures: (*rbp)==NULL.
+void ImageRowBlurDestroy(ImageRowBlur* rbp) ;
+
+/// Check if the next output row can be produced.
+/// Returns nonzero if all input rows it depends on were pushed
+/// and not all output rows were produced yet.
+int ImageRowBlurReady(ImageRowBlur rb) ;
+
+/// Push the next input row (width levels, top to bottom).
+/// Requires: !ImageRowBlurReady(rb) and less than height rows pushed.
+void ImageRowBlurPush(ImageRowBlur rb, const uint8* row) ;
+
+/// Produce the next output row (width levels, top to bottom) into row.
+/// Requires: ImageRowBlurReady(rb).
+void ImageRowBlurPop(ImageRowBlur rb, uint8* row) ;
+
+/// Summed-area tables
+
+/// A summed-area table (a.k.a. integral image) stores, for each position
+/// (x,y), the sum of all pixel levels in the rectangle [0,x[ x [0,y[.
+/// After it is built, the sum (or mean) of any rectangle in the source
+/// image costs O(1), independently of the rectangle size.
+/// The table is a snapshot: later changes to the source image are not
+/// reflected in it.
+
+// Type ImageSAT is a pointer to summed-area table objects
+typedef struct sat *ImageSAT;
+
+/// Build the summed-area table of img.
+/// On success, a new table is returned.
+/// (The caller is responsible for destroying the returned table!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+ImageSAT ImageSATCreate(Image img) ;
+
+/// Destroy the table pointed to by (*satp).
+/// If (*satp)==NULL, no operation is performed.
+/// Ensures: (*satp)==NULL.
+void ImageSATDestroy(ImageSAT* satp) ;
+
+/// Sum of the pixel levels in the rectangle (x,y,w,h) of the source image.
+/// Requires: the rectangle must be inside the source image.
+uint64_t ImageSATBoxSum(ImageSAT sat, int x, int y, int w, int h) ;
+
+/// Mean of the pixel levels in the rectangle (x,y,w,h) of the source image,
+/// rounded to the nearest integer (halves round up).
+/// Requires: the rectangle must be inside the source image, w > 0, h > 0.
+uint8 ImageSATBoxMean(ImageSAT sat, int x, int y, int w, int h) ;
+
+/// Blur using a summed-area table.
+/// Sets each pixel (x,y) of img to the mean of the rectangle
+/// [x-dx, x+dx]x[y-dy, y+dy] of the source image of sat, clipped to the
+/// image borders, exactly as ImageBlur does.
+/// img may be the source image itself.
+/// Requires: img has the same size as the source of sat, dx >= 0, dy >= 0.
+void ImageSATBlur(ImageSAT sat, Image img, int dx, int dy) ;
+
+/// Normalized cross-correlation
+
+/// A correlation map stores, for each offset (x,y) of a template inside an
+/// image, their normalized cross-correlation (NCC).
+
+// Type ImageNCCMap is a pointer to correlation map objects
+typedef struct nccmap *ImageNCCMap;
+
+/// A peak of a correlation map: offset (x, y), with NCC score
+typedef struct {
+  int x, y;
+  double score;
+} ImagePeak;
+
+/// Compute the normalized cross-correlation of img2 with img1.
+/// For each offset (x,y) where img2 fits inside img1, computes the NCC
+///   sum((I(x+i,y+j) - mI)*(T(i,j) - mT)) / sqrt(sum((I-mI)^2) * sum((T-mT)^2))
+/// of the pixels T of img2 and the pixels I of the subimage of img1 at
+/// (x,y), with means mT and mI, which is in [-1, 1] (1 means a match up to
+/// brightness and contrast).  It is 0 if either has uniform gray level.
+/// The correlations are computed with FFTs and the means and energies of
+/// the subimages with summed-area tables, in O(N log N) time for N pixels
+/// in img1, for any size of img2, and O(N) memory.
+/// Requires: img2 fits inside img1.
+/// On success, a new map of size (W-w+1)x(H-h+1) is returned.
+/// (The caller is responsible for destroying the returned map!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+ImageNCCMap ImageNCCCreate(Image img1, Image img2) ;
+
+/// Destroy the map pointed to by (*mp).
+/// If (*mp)==NULL, no operation is performed.
+/// Ensures: (*mp)==NULL.
+void ImageNCCDestroy(ImageNCCMap* mp) ;
+
+/// Number of offsets in x (W-w+1).
+int ImageNCCWidth(ImageNCCMap m) ;
+
+/// Number of offsets in y (H-h+1).
+int ImageNCCHeight(ImageNCCMap m) ;
+
+/// NCC of the template at offset (x,y).
+double ImageNCCValue(ImageNCCMap m, int x, int y) ;
+
+/// Find the k highest peaks (local maxima) of the map.
+/// Sets peaks[0..] to the peaks in decreasing order of NCC (in raster
+/// order, on ties), and returns how many were found (at most k).
+/// Of a plateau of equal values, only its first point is a peak.
+int ImageNCCPeaks(ImageNCCMap m, int k, ImagePeak peaks[]) ;
+
+/// Convert the map to an image, for inspection.
+/// NCC -1 is black and 1 is white (maxval 255).
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageNCCImage(ImageNCCMap m) ;
+
+/// Tiled pipelines
+
+/// A pipeline produces one image from a source (a PGM file, a black image,
+/// a crop of another image, or an existing image to modify in-place)
+/// followed by a sequence of stages (lookup tables, blur, paste, blend,
+/// save).  It runs in tiles of rows: each tile goes through every stage
+/// right after it is produced, while it is still in cache, instead of
+/// streaming the whole image through memory once per operation.
+/// The resulting image and saved files are exactly the same as applying
+/// the corresponding operations to the whole image, in the same order.
+/// Images used by the pipeline (crop source, pasted/blended images) must
+/// not be changed or destroyed before it runs.
+///
+/// Use as follows:
+///   ImagePipeline p = ImagePipelineCreate();
+///   ImagePipelineLoad(p, "in.pgm");    // one source
+///   ImagePipelineLUT(p, lut);          // any number of stages
+///   ImagePipelineBlur(p, 3, 3);
+///   ImagePipelineSave(p, "out.pgm");
+///   Image img = ImagePipelineRun(p);
+///   ImagePipelineDestroy(&p);
+/// Functions that open files or allocate memory return 0 (or NULL) on
+/// failure, with errno/errCause set accordingly.
+
+// Type ImagePipeline is a pointer to pipeline objects
+typedef struct pipeline *ImagePipeline;
+
+/// Create an empty pipeline.
+/// (The caller is responsible for destroying it!)
+ImagePipeline ImagePipelineCreate(void) ;
+
+/// Destroy the pipeline pointed to by (*pp), closing its files.
+/// If (*pp)==NULL, no operation is performed.
+/// Ensures: (*pp)==NULL.
+void ImagePipelineDestroy(ImagePipeline* pp) ;
+
+/// Source: load the raw PGM file filename.
+/// The header is read now, the pixels are read tile by tile by ImagePipelineRun.
+/// Requires: p has no source yet.
+int ImagePipelineLoad(ImagePipeline p, const char* filename) ;
+
+/// Source: a new black image, as ImageCreate(width, height, maxval).
+/// Requires: p has no source yet, and the ImageCreate preconditions.
+void ImagePipelineBlack(ImagePipeline p, int width, int height, uint8 maxval) ;
+
+/// Source: the rectangle (x,y,w,h) of img, as ImageCrop(img, x, y, w, h).
+/// Requires: p has no source yet, and the ImageCrop preconditions.
+void ImagePipelineCrop(ImagePipeline p, Image img, int x, int y, int w, int h) ;
+
+/// Source: the existing image img, which the stages modify in-place.
+/// Requires: p has no source yet.
+void ImagePipelineImage(ImagePipeline p, Image img) ;
+
+/// Get the width of the image produced by the pipeline.
+int ImagePipelineWidth(ImagePipeline p) ;
+
+/// Get the height of the image produced by the pipeline.
+int ImagePipelineHeight(ImagePipeline p) ;
+
+/// Stage: replace each pixel level v by lut[v], as ImageApplyLUT.
+/// Consecutive LUT stages are composed into a single stage.
+int ImagePipelineLUT(ImagePipeline p, const uint8 lut[256]) ;
+
+/// Stage: ImageNegative(CURR).
+int ImagePipelineNegative(ImagePipeline p) ;
+
+/// Stage: ImageThreshold(CURR, thr).
+int ImagePipelineThreshold(ImagePipeline p, uint8 thr) ;
+
+/// Stage: ImageBrighten(CURR, factor).
+int ImagePipelineBrighten(ImagePipeline p, double factor) ;
+
+/// Stage: mirror CURR left-right, in-place.
+/// (The same pixels as ImageMirror, but without creating a new image.)
+int ImagePipelineMirror(ImagePipeline p) ;
+
+/// Stage: ImageBlur(CURR, dx, dy).
+/// Requires: dx >= 0, dy >= 0.
+int ImagePipelineBlur(ImagePipeline p, int dx, int dy) ;
+
+/// Stage: ImagePaste(CURR, x, y, img2).
+/// Requires: img2 must fit inside the pipeline image at position (x, y).
+int ImagePipelinePaste(ImagePipeline p, int x, int y, Image img2) ;
+
+/// Stage: ImageBlend(CURR, x, y, img2, alpha).
+/// Requires: img2 must fit inside the pipeline image at position (x, y).
+int ImagePipelineBlend(ImagePipeline p, int x, int y, Image img2, double alpha) ;
+
+/// Stage: ImageSave(CURR, filename).
+/// The pixels are written tile by tile by ImagePipelineRun to a new file
+/// in the same directory, which replaces filename when the run succeeds.
+/// So filename may be the file the pipeline loads, or any image is mapped
+/// from, and it is left untouched if the run fails.
+int ImagePipelineSave(ImagePipeline p, const char* filename) ;
+
+/// Run the pipeline: produce the image from the source, tile by tile,
+/// passing each tile through all stages.
+/// The pipeline cannot be run again (it should be destroyed next).
+/// On success, returns the resulting image: a new image, or the source
+/// image for ImagePipelineImage.
+/// (The caller is responsible for destroying a new image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+/// Stages may have been partially applied to an ImagePipelineImage source.
+/// The files of the save stages are only replaced if the run succeeds.
+Image ImagePipelineRun(ImagePipeline p) ;
+
+/// Run the pipeline in bounded memory, for images that may not fit in it.
+/// Same as ImagePipelineRun, but the resulting image is not kept: only
+/// a strip of rows is resident at a time (a tile plus dy rows for each
+/// blur stage), so the pipeline should end with ImagePipelineSave.
+/// The pipeline cannot be run again (it should be destroyed next).
+/// Requires: the source is not ImagePipelineImage.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set accordingly.
+/// The files of the save stages are only replaced if the run succeeds.
+int ImagePipelineStream(ImagePipeline p) ;
+
 #endif
@@ -0,0 +1,527 @@
+// imageBench - A reproducible benchmark of the image8bit operations.
+//
+// This program is an example use of the image8bit module,
+// a programming project for the course AED, DETI / UA.PT
+//
+// You may freely use and modify this code, NO WARRANTY, blah blah,
+// as long as you give proper credit to the original and subsequent authors.
+//
+// 2023
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "error.h"
+#include <assert.h>
+#include <unistd.h>
+
+#include "image8bit.h"
+#include "instrumentation.h"
+
+static const char* USAGE =
+    "USAGE: imageBench [OPTION...] [OPERATION...]\n"
+    "  Time image8bit operations on synthetic images (no files needed)\n"
+    "  and compare the results with a baseline.\n"
+    "  Each operation runs on square images of 64x64, 256x256, 1024x1024,\n"
+    "  4096x4096 and 8192x8192 pixels (up to a limit for the slow ones),\n"
+    "  with each number of threads; by default, all operations run.\n"
+    "\n"
+    "OPTIONS:\n"
+    "  -s MAX          Largest image size (default 8192)\n"
+    "  -j N,...        Numbers of threads (default 1, 2, 4, ... and the\n"
+    "                  number of processors)\n"
+    "  -r N            Timed repetitions (default 7)\n"
+    "  -w N            Warmup repetitions, not timed (default 1)\n"
+    "  -o FILE         Save the results to FILE (JSON)\n"
+    "  -b FILE         Compare with the results in FILE (JSON, as saved\n"
+    "                  by -o), if it exists: medians more than TOL slower\n"
+    "                  are regressions, and make the exit status 1\n"
+    "  -t TOL          Tolerance for regressions (default 0.15, 15%)\n"
+    "  -l              List the operations and exit\n"
+    "\n"
+    "  Times are medians and 95th percentiles of the repetitions; each\n"
+    "  repetition repeats the operation until it takes at least 1 ms.\n"
+    "  Throughput is in MB/s of image pixels (1 byte each), and speedup\n"
+    "  is relative to the first number of threads.\n"
+    ;
+
+// A repetition repeats the operation for at least this time (seconds)
+#define MIN_SAMPLE 1e-3
+
+#define MAX_SAMPLES 1000
+#define MAX_CALLS (1 << 20)
+#define MAX_THREADS 16
+#define MAX_RESULTS 4096
+
+// Benchmark data: the images and structures an operation works on.
+// img is the size x size synthetic image, tpl a 32x32 copy of a part of
+// it near the bottom right corner, and small a quarter-size image.
+struct data {
+  int size;
+  Image img;
+  Image tpl;
+  Image small;
+  Image tpls[4];     // locateall
+  ImageIndex index;  // ilocate
+  char file[1024];   // load, save
+};
+
+// The pixels of img changed: its cached statistics, histogram and
+// pyramid must be computed again (setting a pixel marks the change)
+static void invalidate(Image img) {
+  ImageSetPixel(img, 0, 0, ImageGetPixel(img, 0, 0));
+}
+
+static void must(int ok, const char* what) {
+  if (!ok) error(2, errno, "%s: %s", what, ImageErrMsg());
+}
+
+static void benchNegative(struct data* d) { ImageNegative(d->img); }
+static void benchThreshold(struct data* d) { ImageThreshold(d->img, 128); }
+static void benchBrighten(struct data* d) { ImageBrighten(d->img, 0.99); }
+
+static void benchLUT(struct data* d) {
+  uint8 lut[256];
+  ImageLUTNegative(d->img, lut);
+  ImageApplyLUT(d->img, lut);
+}
+
+static void benchStats(struct data* d) {
+  uint8 min, max;
+  invalidate(d->img);
+  ImageStats(d->img, &min, &max);
+}
+
+static void benchHistogram(struct data* d) {
+  uint64_t hist[256];
+  invalidate(d->img);
+  ImageHistogram(d->img, hist);
+}
+
+static void benchEqualize(struct data* d) { ImageEqualize(d->img); }
+
+// Operations that create a new image, which is destroyed right away
+#define NEW_IMAGE(name, expr) \
+  static void name(struct data* d) { \
+    Image res = (expr); \
+    must(res != NULL, #name); \
+    ImageDestroy(&res); \
+  }
+
+NEW_IMAGE(benchRotate, ImageRotate(d->img))
+NEW_IMAGE(benchRotateCW, ImageRotateCW(d->img))
+NEW_IMAGE(benchRotate180, ImageRotate180(d->img))
+NEW_IMAGE(benchTranspose, ImageTranspose(d->img))
+NEW_IMAGE(benchMirror, ImageMirror(d->img))
+NEW_IMAGE(benchCrop, ImageCrop(d->img, d->size / 4, d->size / 4, d->size / 2, d->size / 2))
+NEW_IMAGE(benchCreate, ImageCreate(d->size, d->size, PixMax))
+
+static void benchPaste(struct data* d) {
+  ImagePaste(d->img, d->size / 2, d->size / 2, d->small);
+}
+
+static void benchBlend(struct data* d) {
+  ImageBlend(d->img, d->size / 2, d->size / 2, d->small, 0.25);
+}
+
+static void benchBlurSAT(struct data* d) { ImageBlurUsing(d->img, 3, 3, BLUR_SAT); }
+static void benchBlurSep(struct data* d) { ImageBlurUsing(d->img, 3, 3, BLUR_SEPARABLE); }
+static void benchBlurDirect(struct data* d) { ImageBlurUsing(d->img, 3, 3, BLUR_DIRECT); }
+
+static void benchSAT(struct data* d) {
+  ImageSAT sat = ImageSATCreate(d->img);
+  must(sat != NULL, "ImageSATCreate");
+  ImageSATDestroy(&sat);
+}
+
+static void benchLocate(struct data* d) {
+  int x, y;
+  must(ImageLocateSubImage(d->img, &x, &y, d->tpl), "locate");
+}
+
+static void benchLocateHash(struct data* d) {
+  int x, y;
+  must(ImageLocateSubImageUsing(d->img, &x, &y, d->tpl, LOCATE_HASH), "locate");
+}
+
+static void benchLocateDirect(struct data* d) {
+  int x, y;
+  must(ImageLocateSubImageUsing(d->img, &x, &y, d->tpl, LOCATE_DIRECT), "locate");
+}
+
+static void benchPyramid(struct data* d) {
+  int x, y;
+  invalidate(d->img);  // build the pyramid every time
+  must(ImageLocatePyramid(d->img, &x, &y, d->tpl, 1), "pyrlocate");
+}
+
+static void benchMatch(struct data* d) {
+  int x, y;
+  uint64_t score;
+  must(ImageMatchBest(d->img, &x, &y, d->tpl, MATCH_SAD, UINT64_MAX, &score), "match");
+}
+
+static void benchLocateAll(struct data* d) {
+  int n;
+  ImageOccurrence* occ = ImageLocateAll(d->img, 4, d->tpls, &n);
+  must(occ != NULL, "ImageLocateAll");
+  free(occ);
+}
+
+static void benchNCC(struct data* d) {
+  ImageNCCMap map = ImageNCCCreate(d->img, d->tpl);
+  must(map != NULL, "ImageNCCCreate");
+  ImageNCCDestroy(&map);
+}
+
+static void benchIndex(struct data* d) {
+  ImageIndex index = ImageIndexCreate(d->img, 16);
+  must(index != NULL, "ImageIndexCreate");
+  ImageIndexDestroy(&index);
+}
+
+static void benchIndexLocate(struct data* d) {
+  int x, y;
+  must(ImageIndexLocate(d->index, &x, &y, d->tpl), "ilocate");
+}
+
+static void benchPipeline(struct data* d) {
+  ImagePipeline p = ImagePipelineCreate();
+  must(p != NULL, "ImagePipelineCreate");
+  ImagePipelineImage(p, d->img);
+  must(ImagePipelineNegative(p) && ImagePipelineBlur(p, 3, 3) &&
+       ImagePipelineThreshold(p, 128) && ImagePipelineRun(p) != NULL, "pipeline");
+  ImagePipelineDestroy(&p);
+}
+
+static void benchSave(struct data* d) {
+  must(ImageSave(d->img, d->file), "ImageSave");
+}
+
+static void benchLoad(struct data* d) {
+  Image img = ImageLoad(d->file);
+  must(img != NULL, "ImageLoad");
+  ImageDestroy(&img);
+}
+
+// Extra setup of some operations
+static void setupLocateAll(struct data* d) {
+  for (int i = 0; i < 4; i++) {
+    int x = (d->size - 16) * (i + 1) / 5;
+    d->tpls[i] = ImageCrop(d->img, x, d->size - 16 - x / 2, 16, 16);
+    must(d->tpls[i] != NULL, "ImageCrop");
+  }
+}
+
+static void setupIndex(struct data* d) {
+  d->index = ImageIndexCreate(d->img, 16);
+  must(d->index != NULL, "ImageIndexCreate");
+}
+
+static void setupFile(struct data* d) {
+  const char* dir = getenv("TMPDIR");
+  snprintf(d->file, sizeof(d->file), "%.1000s/imageBench%d.pgm",
+           dir != NULL ? dir : "/tmp", (int)getpid());
+  must(ImageSave(d->img, d->file), "ImageSave");
+}
+
+struct op {
+  const char* name;
+  void (*run)(struct data* d);
+  void (*setup)(struct data* d);  // or NULL
+  int maxSize;                    // largest image size
+};
+
+static const struct op ops[] = {
+  { "create",      benchCreate,       NULL,           8192 },
+  { "negative",    benchNegative,     NULL,           8192 },
+  { "threshold",   benchThreshold,    NULL,           8192 },
+  { "brighten",    benchBrighten,     NULL,           8192 },
+  { "lut",         benchLUT,          NULL,           8192 },
+  { "stats",       benchStats,        NULL,           8192 },
+  { "histogram",   benchHistogram,    NULL,           8192 },
+  { "equalize",    benchEqualize,     NULL,           8192 },
+  { "rotate",      benchRotate,       NULL,           8192 },
+  { "rotatecw",    benchRotateCW,     NULL,           8192 },
+  { "rotate180",   benchRotate180,    NULL,           8192 },
+  { "transpose",   benchTranspose,    NULL,           8192 },
+  { "mirror",      benchMirror,       NULL,           8192 },
+  { "crop",        benchCrop,         NULL,           8192 },
+  { "paste",       benchPaste,        NULL,           8192 },
+  { "blend",       benchBlend,        NULL,           8192 },
+  { "blur-sat",    benchBlurSAT,      NULL,           8192 },
+  { "blur-sep",    benchBlurSep,      NULL,           8192 },
+  { "blur-direct", benchBlurDirect,   NULL,           1024 },
+  { "sat",         benchSAT,          NULL,           8192 },
+  { "locate",      benchLocate,       NULL,           8192 },
+  { "locate-hash", benchLocateHash,   NULL,           8192 },
+  { "locate-direct", benchLocateDirect, NULL,         1024 },
+  { "pyrlocate",   benchPyramid,      NULL,           8192 },
+  { "match-sad",   benchMatch,        NULL,           1024 },
+  { "locateall",   benchLocateAll,    setupLocateAll, 4096 },
+  { "ncc",         benchNCC,          NULL,           2048 },
+  { "index",       benchIndex,        NULL,           2048 },
+  { "ilocate",     benchIndexLocate,  setupIndex,     2048 },
+  { "pipeline",    benchPipeline,     NULL,           8192 },
+  { "save",        benchSave,         setupFile,      4096 },
+  { "load",        benchLoad,         setupFile,      4096 },
+};
+#define NUMOPS ((int)(sizeof(ops) / sizeof(ops[0])))
+
+static const int sizes[] = { 64, 256, 1024, 4096, 8192 };
+#define NUMSIZES ((int)(sizeof(sizes) / sizeof(sizes[0])))
+
+// Synthetic image: a gradient with pseudo-random noise, the same in every
+// run, so that every part of it is different (searches find one match)
+static Image synthetic(int size) {
+  Image img = ImageCreate(size, size, PixMax);
+  must(img != NULL, "ImageCreate");
+  unsigned int s = 12345;
+  for (int y = 0; y < size; y++) {
+    for (int x = 0; x < size; x++) {
+      s = s * 1103515245u + 12345u;
+      ImageSetPixel(img, x, y, (uint8)((x + 2 * y) / 4 + (s >> 26)));
+    }
+  }
+  return img;
+}
+
+static void dataCreate(struct data* d, const struct op* op, int size) {
+  memset(d, 0, sizeof(*d));
+  d->size = size;
+  d->img = synthetic(size);
+  d->tpl = ImageCrop(d->img, size - 40, size - 36, 32, 32);
+  d->small = ImageCrop(d->img, 0, 0, size / 4, size / 4);
+  must(d->tpl != NULL && d->small != NULL, "ImageCrop");
+  if (op->setup != NULL) op->setup(d);
+}
+
+static void dataDestroy(struct data* d) {
+  ImageIndexDestroy(&d->index);  // before its image
+  ImageDestroy(&d->img);
+  ImageDestroy(&d->tpl);
+  ImageDestroy(&d->small);
+  for (int i = 0; i < 4; i++) ImageDestroy(&d->tpls[i]);
+  if (d->file[0] != '\0') remove(d->file);
+}
+
+// Result of one (operation, size, threads)
+struct result {
+  char op[32];
+  int size;
+  int threads;
+  double median, p95;  // seconds
+  double mbps;
+};
+
+static int cmpDouble(const void* a, const void* b) {
+  double x = *(const double*)a;
+  double y = *(const double*)b;
+  return (x > y) - (x < y);
+}
+
+// Time op on d: warmup repetitions, then reps timed repetitions
+static void measure(const struct op* op, struct data* d, int warmup, int reps, struct result* r) {
+  // Calls per repetition, so that each takes at least MIN_SAMPLE
+  // (finding it is the first warmup repetition)
+  int calls = 1;
+  double t;
+  do {
+    double t0 = wall_time();
+    for (int c = 0; c < calls; c++) op->run(d);
+    t = wall_time() - t0;
+    if (t < MIN_SAMPLE) {
+      double more = t > 0.0 ? calls * MIN_SAMPLE / t + 1 : 2.0 * calls;
+      calls = more < MAX_CALLS ? (int)more : MAX_CALLS;
+    }
+  } while (t < MIN_SAMPLE && calls < MAX_CALLS);
+  for (int i = 1; i < warmup; i++) {
+    for (int c = 0; c < calls; c++) op->run(d);
+  }
+  double sample[MAX_SAMPLES];
+  for (int i = 0; i < reps; i++) {
+    double t0 = wall_time();
+    for (int c = 0; c < calls; c++) op->run(d);
+    sample[i] = (wall_time() - t0) / calls;
+  }
+  qsort(sample, (size_t)reps, sizeof(double), cmpDouble);
+  r->median = reps % 2 == 1 ? sample[reps / 2] : (sample[reps / 2 - 1] + sample[reps / 2]) / 2;
+  r->p95 = sample[(95 * reps + 99) / 100 - 1];
+  r->mbps = (double)d->size * d->size / r->median * 1e-6;
+}
+
+// Save results in JSON, one result per line (as read by loadBaseline)
+static int saveResults(const char* file, const struct result* res, int n) {
+  FILE* f = fopen(file, "w");
+  if (f == NULL) return 0;
+  fprintf(f, "{\"benchmarks\": [\n");
+  for (int i = 0; i < n; i++) {
+    fprintf(f, "  {\"op\": \"%s\", \"size\": %d, \"threads\": %d, "
+            "\"median_s\": %.9f, \"p95_s\": %.9f, \"mb_per_s\": %.3f}%s\n",
+            res[i].op, res[i].size, res[i].threads, res[i].median, res[i].p95,
+            res[i].mbps, i + 1 < n ? "," : "");
+  }
+  fprintf(f, "]}\n");
+  return fclose(f) == 0;
+}
+
+// Load results saved by saveResults.  Returns the number loaded, or -1
+// if the file cannot be read.
+static int loadBaseline(const char* file, struct result* res, int max) {
+  FILE* f = fopen(file, "r");
+  if (f == NULL) return -1;
+  char line[512];
+  int n = 0;
+  while (n < max && fgets(line, sizeof(line), f) != NULL) {
+    struct result* r = &res[n];
+    if (sscanf(line, " {\"op\": \"%31[^\"]\", \"size\": %d, \"threads\": %d, "
+               "\"median_s\": %lf, \"p95_s\": %lf, \"mb_per_s\": %lf",
+               r->op, &r->size, &r->threads, &r->median, &r->p95, &r->mbps) == 6) {
+      n++;
+    }
+  }
+  fclose(f);
+  return n;
+}
+
+static const struct result* findResult(const struct result* res, int n, const struct result* r) {
+  for (int i = 0; i < n; i++) {
+    if (strcmp(res[i].op, r->op) == 0 && res[i].size == r->size && res[i].threads == r->threads) {
+      return &res[i];
+    }
+  }
+  return NULL;
+}
+
+static const struct op* findOp(const char* name) {
+  for (int i = 0; i < NUMOPS; i++) {
+    if (strcmp(ops[i].name, name) == 0) return &ops[i];
+  }
+  return NULL;
+}
+
+int main(int ac, char* av[]) {
+  program_name = av[0];
+  ImageInit();
+
+  int maxSize = 8192;
+  int threads[MAX_THREADS];
+  int nthreads = 0;
+  int warmup = 1;
+  int reps = 7;
+  double tol = 0.15;
+  const char* outFile = NULL;
+  const char* baseFile = NULL;
+
+  int k = 1;
+  for (; k < ac && av[k][0] == '-'; k++) {
+    const char* opt = av[k];
+    if (strcmp(opt, "-l") == 0) {
+      for (int i = 0; i < NUMOPS; i++) printf("%s\n", ops[i].name);
+      return 0;
+    }
+    if (opt[1] == '\0' || opt[2] != '\0' || strchr("sjrwobt", opt[1]) == NULL) {
+      error(1, 0, "Invalid option %s\n%s", opt, USAGE);
+    }
+    if (++k >= ac) error(1, 0, "Missing operand of %s\n%s", opt, USAGE);
+    const char* arg = av[k];
+    int ok = 1;
+    switch (opt[1]) {
+    case 's': ok = sscanf(arg, "%d", &maxSize) == 1 && maxSize >= 1; break;
+    case 'r': ok = sscanf(arg, "%d", &reps) == 1 && 1 <= reps && reps <= MAX_SAMPLES; break;
+    case 'w': ok = sscanf(arg, "%d", &warmup) == 1 && warmup >= 0; break;
+    case 't': ok = sscanf(arg, "%lf", &tol) == 1 && tol >= 0.0; break;
+    case 'o': outFile = arg; break;
+    case 'b': baseFile = arg; break;
+    case 'j':
+      nthreads = 0;
+      for (const char* p = arg; ok; p++) {
+        int t, len;
+        ok = nthreads < MAX_THREADS && sscanf(p, "%d%n", &t, &len) == 1 && t >= 1;
+        if (!ok) break;   // len is only set when sscanf succeeds
+        threads[nthreads++] = t;
+        p += len;
+        if (*p == '\0') break;
+        ok = *p == ',';
+      }
+      break;
+    }
+    if (!ok) error(1, 0, "Invalid operand of %s: %s", opt, arg);
+  }
+  if (nthreads == 0) {
+    // 1, 2, 4, ... and the number of processors
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpu < 1) ncpu = 1;
+    for (int t = 1; t < ncpu && nthreads < MAX_THREADS - 1; t *= 2) threads[nthreads++] = t;
+    threads[nthreads++] = (int)ncpu;
+  }
+
+  // Operations to run
+  const struct op* run[NUMOPS];
+  int nops = 0;
+  for (; k < ac; k++) {
+    const struct op* op = findOp(av[k]);
+    if (op == NULL) error(1, 0, "Unknown operation %s (see imageBench -l)", av[k]);
+    run[nops++] = op;
+  }
+  if (nops == 0) {
+    for (int i = 0; i < NUMOPS; i++) run[nops++] = &ops[i];
+  }
+
+  static struct result base[MAX_RESULTS];
+  int nbase = baseFile != NULL ? loadBaseline(baseFile, base, MAX_RESULTS) : -1;
+  if (baseFile != NULL && nbase < 0) {
+    fprintf(stderr, "No baseline %s: nothing to compare\n", baseFile);
+  }
+
+  static struct result res[MAX_RESULTS];
+  int nres = 0;
+  int regressions = 0;
+  printf("#%-14s\t%5s\t%7s\t%12s\t%12s\t%10s\t%7s\t%12s\t%s\n", "operation", "size",
+         "threads", "median_ms", "p95_ms", "MB/s", "speedup", "baseline_ms", "status");
+  for (int i = 0; i < nops; i++) {
+    const struct op* op = run[i];
+    for (int s = 0; s < NUMSIZES && sizes[s] <= maxSize && sizes[s] <= op->maxSize; s++) {
+      struct data d;
+      dataCreate(&d, op, sizes[s]);
+      double first = 0.0;
+      for (int t = 0; t < nthreads && nres < MAX_RESULTS; t++) {
+        must(ImageSetThreads(threads[t]), "ImageSetThreads");
+        struct result* r = &res[nres++];
+        snprintf(r->op, sizeof(r->op), "%s", op->name);
+        r->size = sizes[s];
+        r->threads = threads[t];
+        measure(op, &d, warmup, reps, r);
+        if (t == 0) first = r->median;
+
+        const struct result* b = nbase > 0 ? findResult(base, nbase, r) : NULL;
+        const char* status = "";
+        if (b != NULL && r->median > b->median * (1.0 + tol)) {
+          status = "REGRESSION";
+          regressions++;
+        } else if (b != NULL && r->median * (1.0 + tol) < b->median) {
+          status = "faster";
+        }
+        char baseMs[32] = "-";
+        if (b != NULL) snprintf(baseMs, sizeof(baseMs), "%.4f", b->median * 1e3);
+        printf("%-15s\t%5d\t%7d\t%12.4f\t%12.4f\t%10.1f\t%7.2f\t%12s\t%s\n",
+               r->op, r->size, r->threads, r->median * 1e3, r->p95 * 1e3,
+               r->mbps, first / r->median, baseMs, status);
+        fflush(stdout);
+      }
+      dataDestroy(&d);
+    }
+  }
+
+  if (outFile != NULL) {
+    if (!saveResults(outFile, res, nres)) error(3, errno, "Saving %s", outFile);
+    fprintf(stderr, "Results saved to %s\n", outFile);
+  }
+  if (regressions > 0) {
+    fprintf(stderr, "%d regression(s) over %.0f%% slower than %s\n",
+            regressions, tol * 100, baseFile);
+    return 1;
+  }
+  return 0;
+}
@@ -9,6 +9,7 @@
 // João Manuel Rodrigues <jmr@ua.pt>
 // 2023
 
+#include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -20,7 +21,8 @@
 #include "instrumentation.h"
 
 static const char* USAGE =
-    "USAGE: imageTool [FILE...] [OPERATION [OPERAND...]]\n"
+    "USAGE: imageTool [-p] [FILE...] [OPERATION [OPERAND...]]\n"
+    "       imageTool -s FILE [OPERATION [OPERAND...]]\n"
     "  Apply pipeline of image processing operations to PGM files.\n"
     "  Arguments are processed from left to right and may be\n"
     "  FILES, OPERATIONS, or OPERANDS to operations.\n"
@@ -30,6 +32,15 @@ static const char* USAGE =
     "  predecessor is PRED.\n"
     "  Most operations apply to CURR and some also use PRED.\n"
     "\n"
+    "  With -p, each image is produced by a tiled pipeline: its source\n"
+    "  (FILE, create or crop) and the following neg, thr, bri, blur, paste,\n"
+    "  blend and save operations run together, a tile of rows at a time.\n"
+    "  Other operations run on the whole image, as usual.\n"
+    "\n"
+    "  With -s, FILE is streamed through the operations in strips of rows,\n"
+    "  using bounded memory, for images larger than RAM.  Only neg, thr,\n"
+    "  bri, mirror (in-place), blur and save operations are accepted.\n"
+    "\n"
     "FILES:\n"
     "  Currently, only image files in 8-bit raw PGM format are accepted.\n"
     "  Input file names must be distinct from operation names.\n"
@@ -38,24 +49,52 @@ static const char* USAGE =
     "  FILE            Load PGM image file, creating new image\n"
     "  save FILE       Save CURR to PGM file\n"
     "  info            Show information on CURR (size and range)\n"
+    "  hist            Show the histogram of CURR (levels with pixels)\n"
+    "  -j N            Use N threads in the following operations\n"
+    "  -m              Map the following FILEs into memory instead of reading them\n"
+    "  -e              Also count hardware events (cycles, cache misses...)\n"
+    "                  between tic and toc, if the system allows it\n"
     "  tic             Reset instrumentation counters and times.\n"
-    "  toc             Print instrumentation counters and times.\n"
+    "  toc             Print instrumentation counters and times,\n"
+    "                  and the profile of the operations called.\n"
+    "  tocthreads      Print instrumentation counters of each thread.\n"
+    "  profile F[,FILE] Print the profile of the operations called since tic\n"
+    "                  to FILE (default: stdout) in format F: text, csv or json\n"
     "\n"              
     "  neg             Apply photo-negative effect to CURR\n"
     "  thr LEVEL       Apply thresholding to CURR\n"
     "  bri FACTOR      Scale brightness in CURR by FACTOR\n"
+    "  equalize        Equalize the histogram of CURR\n"
     "\n"              
     "  create W,H      Create new black image with WxH pixels\n"
     "  rotate          Rotate CURR 90º counter-clockwise, creating new image\n"
+    "  rotatecw        Rotate CURR 90º clockwise, creating new image\n"
+    "  rotate180       Rotate CURR 180º, creating new image\n"
+    "  transpose       Transpose CURR (swap x and y), creating new image\n"
     "  mirror          Mirror CURR left-to-right, creating new image\n"
     "  crop X,Y,W,H    Crop a rectangle from CURR, creating new image\n"
+    "                  (a view of CURR, copied only if later modified)\n"
     "\n"              
     "  paste X,Y       Paste PRED into CURR at position (X,Y)\n"
     "  blend X,Y,alpha Blend PRED into CURR at position (X,Y) with given alpha\n"
     "\n"              
     "  locate          Search PRED in CURR, print matching position, or NOTFOUND\n"
+    "  index B,FILE    Build index of CURR with BxB blocks, save it to FILE\n"
+    "  ilocate FILE    Search PRED in CURR using the index of CURR in FILE,\n"
+    "                  print matching position, or NOTFOUND\n"
+    "  pyrlocate M     Search PRED in CURR from coarse to fine (image pyramids),\n"
+    "                  print position found or NOTFOUND; M: exact or best\n"
+    "                  (most similar position found, maybe not a match)\n"
+    "  ncc K[,FILE]    Normalized cross-correlation of PRED with CURR (FFT):\n"
+    "                  print its K highest peaks, and save the map to FILE\n"
+    "  locateall F,... Search all the template files F in CURR (in one pass),\n"
+    "                  print every matching position and the number found\n"
+    "  match M[,T]     Search the position of CURR most similar to PRED, by\n"
+    "                  metric M: sad or ssd; print it and its distance if\n"
+    "                  <= T (default: any distance), or NOMATCH\n"
     "\n"              
-    "  blur DX,DY      blur CURR using (2DX+1)x(2Dy+1) mean filter\n"
+    "  blur DX,DY[,M]  blur CURR using (2DX+1)x(2Dy+1) mean filter\n"
+    "                  with method M: sat (default), sep or direct\n"
     "\n"              
     "OPERANDS:\n"     
     "  X,Y             Pixel coordinates: 0,0 is top left corner\n"
@@ -74,6 +113,9 @@ static char* errors[] = {
   "Invalid operand",
   "Invalid rect (overflow)",
   "Invalid alpha",
+  "Operation not supported in streaming mode",
+  "Writing profile failed",
+  "Out of memory",
 };
 
 
@@ -85,6 +127,143 @@ static char* errors[] = {
 // Also, the program does not test every module function, but you may easily
 // add new operations for that purpose.
 
+// Crops are views of PRED (see ImageView), so cropping copies nothing.
+// Before an operation modifies a view in-place, the view gets its own
+// pixels (the image it was cropped from must not change).
+static int unshare(Image* img) {
+  if (!ImageIsView(*img)) return 1;
+  Image copy = ImageCrop(*img, 0, 0, ImageWidth(*img), ImageHeight(*img));
+  if (copy == NULL) return 0;
+  ImageDestroy(img);
+  *img = copy;
+  return 1;
+}
+
+// Runs of consecutive point operations (neg, thr, bri) on CURR are merged
+// into a single lookup table, so the run costs one pass over the image.
+struct pointRun {
+  int nops;         // operations in the run
+  uint8 lut[256];   // composition of the operations
+  char op;          // the operation, if there is only one
+  double arg;       // and its operand
+};
+
+// Add an operation to the run (the caller appends it to run->lut)
+static void pointRunAdd(struct pointRun* run, char op, double arg) {
+  if (run->nops++ == 0) {
+    ImageLUTIdentity(run->lut);
+    run->op = op;
+    run->arg = arg;
+  }
+}
+
+// Apply the pending run to img
+static void pointRunFlush(struct pointRun* run, Image img) {
+  if (run->nops == 1) {
+    // A single operation is faster with its own vectorized kernel
+    switch (run->op) {
+      case 'n': ImageNegative(img); break;
+      case 't': ImageThreshold(img, (uint8)run->arg); break;
+      case 'b': ImageBrighten(img, run->arg); break;
+    }
+  } else if (run->nops > 1) {
+    ImageApplyLUT(img, run->lut);
+  }
+  run->nops = 0;
+}
+
+// In pipeline mode (-p), CURR is produced by a pipeline, which is only
+// run when an operation needs the whole image.  Until then, a CURR
+// created by the pipeline is NULL in the buffer.
+
+// Is op one of the operations that become pipeline stages?
+static int isStage(const char* op) {
+  static const char* stages[] = {
+    "neg", "thr", "bri", "blur", "paste", "blend", "save", NULL
+  };
+  for (int i = 0; stages[i] != NULL; i++) {
+    if (strcmp(op, stages[i]) == 0) return 1;
+  }
+  return 0;
+}
+
+// Run the pipeline (if any) that produces img, and destroy it.
+// On failure, returns 0.
+static int pipeFlush(ImagePipeline* pipe, Image* img) {
+  if (*pipe == NULL) return 1;
+  Image res = ImagePipelineRun(*pipe);
+  ImagePipelineDestroy(pipe);
+  if (res == NULL) return 0;
+  *img = res;
+  return 1;
+}
+
+// Get the pipeline for CURR, creating one that works in-place if needed.
+// On failure, returns NULL.
+static ImagePipeline pipeCurr(ImagePipeline* pipe, Image img) {
+  if (*pipe == NULL) {
+    *pipe = ImagePipelineCreate();
+    if (*pipe != NULL) ImagePipelineImage(*pipe, img);
+  }
+  return *pipe;
+}
+
+// Does a w x h rectangle at (x,y) fit inside CURR?
+static int fitsCurr(ImagePipeline pipe, Image img, int x, int y, int w, int h) {
+  int W = pipe != NULL ? ImagePipelineWidth(pipe) : ImageWidth(img);
+  int H = pipe != NULL ? ImagePipelineHeight(pipe) : ImageHeight(img);
+  return 0 <= x && 0 <= w && w <= W - x && 0 <= y && 0 <= h && h <= H - y;
+}
+
+// Streaming mode (-s): stream the file av[k] through the operations
+// av[k+1..], that become the stages of a single pipeline.
+// Returns the error code.
+static int streamMain(int ac, char* av[], int k) {
+  if (k >= ac) return 1;
+  ImagePipeline pipe = ImagePipelineCreate();
+  if (pipe == NULL) return 4;
+  fprintf(stderr, "Streaming %s\n", av[k]);
+  int err = ImagePipelineLoad(pipe, av[k]) ? 0 : 4;
+  k++;
+  while (err == 0 && k < ac) {
+    if (strcmp(av[k], "neg") == 0) {
+      fprintf(stderr, "Negating\n");
+      if (!ImagePipelineNegative(pipe)) err = 4;
+    } else if (strcmp(av[k], "thr") == 0) {
+      uint8 thr;
+      if (++k >= ac) { err = 1; break; }
+      if (sscanf(av[k], "%hhu", &thr) != 1) { err = 5; break; }
+      fprintf(stderr, "Thresholding at %d\n", thr);
+      if (!ImagePipelineThreshold(pipe, thr)) err = 4;
+    } else if (strcmp(av[k], "bri") == 0) {
+      double factor;
+      if (++k >= ac) { err = 1; break; }
+      if (sscanf(av[k], "%lf", &factor) != 1) { err = 5; break; }
+      fprintf(stderr, "Brightening by %lf\n", factor);
+      if (!ImagePipelineBrighten(pipe, factor)) err = 4;
+    } else if (strcmp(av[k], "mirror") == 0) {
+      fprintf(stderr, "Mirroring\n");
+      if (!ImagePipelineMirror(pipe)) err = 4;
+    } else if (strcmp(av[k], "blur") == 0) {
+      int dx, dy;
+      if (++k >= ac) { err = 1; break; }
+      if (sscanf(av[k], "%d,%d", &dx, &dy) != 2 || dx < 0 || dy < 0) { err = 5; break; }
+      fprintf(stderr, "Blur with %dx%d mean filter\n", 2*dx+1, 2*dy+1);
+      if (!ImagePipelineBlur(pipe, dx, dy)) err = 4;
+    } else if (strcmp(av[k], "save") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      fprintf(stderr, "Saving %s\n", av[k]);
+      if (!ImagePipelineSave(pipe, av[k])) err = 4;
+    } else {
+      err = 8;
+    }
+    k++;
+  }
+  if (err == 0 && !ImagePipelineStream(pipe)) err = 4;
+  ImagePipelineDestroy(&pipe);
+  return err;
+}
+
 int main(int ac, char* av[]) {
   program_name = av[0];
   if (ac <= 1) {
@@ -101,8 +280,29 @@ int main(int ac, char* av[]) {
   Image img[N];     // the images
   int n = 0;          // number of images created
 
+  struct pointRun run = { 0 };
+
   int k = 1;
+  int pipelined = 0;        // pipeline mode?
+  int mapped = 0;           // map files into memory?
+  ImagePipeline pipe = NULL;  // the pipeline that produces CURR
+  if (k < ac && strcmp(av[k], "-s") == 0) {
+    err = streamMain(ac, av, k + 1);
+    error(err, errno, errors[err], ImageErrMsg());
+    return 0;
+  }
+  if (k < ac && strcmp(av[k], "-p") == 0) {
+    pipelined = 1;
+    k++;
+  }
   while (k < ac) {
+    int isPointOp = strcmp(av[k], "neg") == 0 || strcmp(av[k], "thr") == 0 ||
+                    strcmp(av[k], "bri") == 0;
+    if (!isPointOp && run.nops > 0) {
+      pointRunFlush(&run, img[n-1]);
+    }
+    if (!isStage(av[k]) && pipe != NULL && !pipeFlush(&pipe, &img[n-1])) { err = 4; break; }
+
     if (strcmp(av[k], "info") == 0) {
       if (n < 1) { err = 2; break; }
       fprintf(stderr, "Info on I%d\n", n-1);
@@ -113,36 +313,101 @@ int main(int ac, char* av[]) {
       ImageStats(img[n-1], &min, &max);
       printf("# Size: %dx%d\n# Maxval: %hhu\n", w, h, maxval);
       printf("# Gray level range: [%hhu, %hhu]\n", min, max);
+    } else if (strcmp(av[k], "hist") == 0) {
+      if (n < 1) { err = 2; break; }
+      fprintf(stderr, "Histogram of I%d\n", n-1);
+      uint64_t hist[256];
+      ImageHistogram(img[n-1], hist);
+      for (int v = 0; v < 256; v++) {
+        if (hist[v] != 0) printf("# %3d: %" PRIu64 "\n", v, hist[v]);
+      }
+    } else if (strcmp(av[k], "-j") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      int nthreads;
+      if (sscanf(av[k], "%d", &nthreads) != 1 || nthreads < 1) { err = 5; break; }
+      fprintf(stderr, "Using %d threads\n", nthreads);
+      if (!ImageSetThreads(nthreads)) { err = 4; break; }
+    } else if (strcmp(av[k], "-m") == 0) {
+      mapped = 1;
+    } else if (strcmp(av[k], "-e") == 0) {
+      int nevents = InstrHardware(1);
+      fprintf(stderr, "Counting %d hardware events\n", nevents);
     } else if (strcmp(av[k], "tic") == 0) {
       InstrReset();
     } else if (strcmp(av[k], "toc") == 0) {
       InstrPrint();
+      InstrProfilePrint(stdout, INSTR_TEXT);
+    } else if (strcmp(av[k], "tocthreads") == 0) {
+      InstrPrintThreads();
+    } else if (strcmp(av[k], "profile") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      char format[5];
+      char file[1024] = "";
+      if (sscanf(av[k], "%4[a-z],%1023s", format, file) < 1) { err = 5; break; }
+      InstrFormat f;
+      if (strcmp(format, "text") == 0) f = INSTR_TEXT;
+      else if (strcmp(format, "csv") == 0) f = INSTR_CSV;
+      else if (strcmp(format, "json") == 0) f = INSTR_JSON;
+      else { err = 5; break; }
+      FILE* out = file[0] != '\0' ? fopen(file, "w") : stdout;
+      if (out == NULL) { err = 9; break; }
+      InstrProfilePrint(out, f);
+      if (out != stdout && fclose(out) != 0) { err = 9; break; }
     } else if (strcmp(av[k], "neg") == 0) {
       if (n < 1) { err = 2; break; }
       fprintf(stderr, "Negating I%d\n", n-1);
-      ImageNegative(img[n-1]);
+      if (pipelined) {
+        if (pipeCurr(&pipe, img[n-1]) == NULL || !ImagePipelineNegative(pipe)) { err = 4; break; }
+      } else {
+        if (!unshare(&img[n-1])) { err = 4; break; }
+        pointRunAdd(&run, 'n', 0.0);
+        ImageLUTNegative(img[n-1], run.lut);
+      }
+    } else if (strcmp(av[k], "equalize") == 0) {
+      if (n < 1) { err = 2; break; }
+      fprintf(stderr, "Equalizing I%d\n", n-1);
+      if (!unshare(&img[n-1])) { err = 4; break; }
+      ImageEqualize(img[n-1]);
     } else if (strcmp(av[k], "thr") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 1) { err = 2; break; }
       uint8 thr;
       if (sscanf(av[k], "%hhu", &thr) != 1) { err = 5; break; }
       fprintf(stderr, "Thresholding I%d at %d\n", n-1, thr);
-      ImageThreshold(img[n-1], (uint8)thr);
+      if (pipelined) {
+        if (pipeCurr(&pipe, img[n-1]) == NULL || !ImagePipelineThreshold(pipe, thr)) { err = 4; break; }
+      } else {
+        if (!unshare(&img[n-1])) { err = 4; break; }
+        pointRunAdd(&run, 't', thr);
+        ImageLUTThreshold(img[n-1], run.lut, thr);
+      }
     } else if (strcmp(av[k], "bri") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 1) { err = 2; break; }
       double factor;
       if (sscanf(av[k], "%lf", &factor) != 1) { err = 5; break; }
       fprintf(stderr, "Brightening I%d by %lf\n", n-1, factor);
-      ImageBrighten(img[n-1], factor);
+      if (pipelined) {
+        if (pipeCurr(&pipe, img[n-1]) == NULL || !ImagePipelineBrighten(pipe, factor)) { err = 4; break; }
+      } else {
+        if (!unshare(&img[n-1])) { err = 4; break; }
+        pointRunAdd(&run, 'b', factor);
+        ImageLUTBrighten(img[n-1], run.lut, factor);
+      }
     } else if (strcmp(av[k], "create") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n >= N) { err = 3; break; }
       if (sscanf(av[k], "%d,%d", &w, &h) != 2) { err = 5; break; }
       if (w < 0 || h < 0) { err = 5; break; }   // precondition check!
       fprintf(stderr, "Creating black image (%d,%d) -> I%d\n", w, h, n);
-      img[n] = ImageCreate(w, h, PixMax);
-      if (img[n] == NULL) { err = 4; break; }
+      if (pipelined) {
+        if ((pipe = ImagePipelineCreate()) == NULL) { err = 4; break; }
+        ImagePipelineBlack(pipe, w, h, PixMax);
+        img[n] = NULL;
+      } else {
+        img[n] = ImageCreate(w, h, PixMax);
+        if (img[n] == NULL) { err = 4; break; }
+      }
       n++;
     } else if (strcmp(av[k], "rotate") == 0) {
       if (n < 1) { err = 2; break; }
@@ -151,6 +416,27 @@ int main(int ac, char* av[]) {
       img[n] = ImageRotate(img[n-1]);
       if (img[n] == NULL) { err = 4; break; }
       n++;
+    } else if (strcmp(av[k], "rotatecw") == 0) {
+      if (n < 1) { err = 2; break; }
+      if (n >= N) { err = 3; break; }
+      fprintf(stderr, "Rotating I%d clockwise -> I%d\n", n-1, n);
+      img[n] = ImageRotateCW(img[n-1]);
+      if (img[n] == NULL) { err = 4; break; }
+      n++;
+    } else if (strcmp(av[k], "rotate180") == 0) {
+      if (n < 1) { err = 2; break; }
+      if (n >= N) { err = 3; break; }
+      fprintf(stderr, "Rotating I%d 180º -> I%d\n", n-1, n);
+      img[n] = ImageRotate180(img[n-1]);
+      if (img[n] == NULL) { err = 4; break; }
+      n++;
+    } else if (strcmp(av[k], "transpose") == 0) {
+      if (n < 1) { err = 2; break; }
+      if (n >= N) { err = 3; break; }
+      fprintf(stderr, "Transposing I%d -> I%d\n", n-1, n);
+      img[n] = ImageTranspose(img[n-1]);
+      if (img[n] == NULL) { err = 4; break; }
+      n++;
     } else if (strcmp(av[k], "mirror") == 0) {
       if (n < 1) { err = 2; break; }
       if (n >= N) { err = 3; break; }
@@ -165,8 +451,14 @@ int main(int ac, char* av[]) {
       if (sscanf(av[k], "%d,%d,%d,%d", &x, &y, &w, &h) != 4) { err = 5; break; }
       if (!ImageValidRect(img[n-1], x, y, w, h)) { err = 5; break; }   // precondition check!
       fprintf(stderr, "Cropping I%d (%d,%d,%d,%d) -> I%d\n", n-1, x, y, w, h, n);
-      img[n] = ImageCrop(img[n-1], x, y, w, h);
-      if (img[n] == NULL) { err = 4; break; }
+      if (pipelined) {
+        if ((pipe = ImagePipelineCreate()) == NULL) { err = 4; break; }
+        ImagePipelineCrop(pipe, img[n-1], x, y, w, h);
+        img[n] = NULL;
+      } else {
+        img[n] = ImageView(img[n-1], x, y, w, h);
+        if (img[n] == NULL) { err = 4; break; }
+      }
       n++;
     } else if (strcmp(av[k], "paste") == 0) {
       if (++k >= ac) { err = 1; break; }
@@ -174,9 +466,14 @@ int main(int ac, char* av[]) {
       if (sscanf(av[k], "%d,%d", &x, &y) != 2) { err = 5; break; }
       w = ImageWidth(img[n-2]);
       h = ImageHeight(img[n-2]);
-      if (!ImageValidRect(img[n-1], x, y, w, h)) { err = 6; break; }
+      if (!fitsCurr(pipe, img[n-1], x, y, w, h)) { err = 6; break; }
       fprintf(stderr, "Pasting I%d at I%d (%d,%d)\n", n-2, n-1, x, y);
-      ImagePaste(img[n-1], x, y, img[n-2]);
+      if (pipelined) {
+        if (pipeCurr(&pipe, img[n-1]) == NULL || !ImagePipelinePaste(pipe, x, y, img[n-2])) { err = 4; break; }
+      } else {
+        if (!unshare(&img[n-1])) { err = 4; break; }
+        ImagePaste(img[n-1], x, y, img[n-2]);
+      }
     } else if (strcmp(av[k], "blend") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 2) { err = 2; break; }
@@ -184,9 +481,14 @@ int main(int ac, char* av[]) {
       if (sscanf(av[k], "%d,%d,%lf", &x, &y, &alpha) != 3) { err = 5; break; }
       w = ImageWidth(img[n-2]);
       h = ImageHeight(img[n-2]);
-      if (!ImageValidRect(img[n-1], x, y, w, h)) { err = 6; break; }
+      if (!fitsCurr(pipe, img[n-1], x, y, w, h)) { err = 6; break; }
       fprintf(stderr, "Blending I%d with I%d@(%d,%d) with alpha=%.3f\n", n-2, n-1, x, y, alpha);
-      ImageBlend(img[n-1], x, y, img[n-2], alpha);
+      if (pipelined) {
+        if (pipeCurr(&pipe, img[n-1]) == NULL || !ImagePipelineBlend(pipe, x, y, img[n-2], alpha)) { err = 4; break; }
+      } else {
+        if (!unshare(&img[n-1])) { err = 4; break; }
+        ImageBlend(img[n-1], x, y, img[n-2], alpha);
+      }
     } else if (strcmp(av[k], "locate") == 0) {
       if (n < 2) { err = 2; break; }
       fprintf(stderr, "Locating I%d in I%d\n", n-2, n-1);
@@ -195,28 +497,179 @@ int main(int ac, char* av[]) {
       } else {
         printf("# NOTFOUND\n");
       }
+    } else if (strcmp(av[k], "index") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      int block;
+      char file[1024];
+      if (sscanf(av[k], "%d,%1023s", &block, file) != 2) { err = 5; break; }
+      if (block <= 0 || block > ImageWidth(img[n-1]) || block > ImageHeight(img[n-1])) { err = 5; break; }
+      fprintf(stderr, "Indexing I%d with %dx%d blocks -> %s\n", n-1, block, block, file);
+      ImageIndex index = ImageIndexCreate(img[n-1], block);
+      if (index == NULL || !ImageIndexSave(index, file)) { ImageIndexDestroy(&index); err = 4; break; }
+      ImageIndexDestroy(&index);
+    } else if (strcmp(av[k], "ilocate") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 2) { err = 2; break; }
+      fprintf(stderr, "Locating I%d in I%d with index %s\n", n-2, n-1, av[k]);
+      ImageIndex index = ImageIndexLoad(img[n-1], av[k]);
+      if (index == NULL) { err = 4; break; }
+      if (ImageIndexLocate(index, &x, &y, img[n-2])) {
+        printf("# FOUND (%d,%d)\n", x, y);
+      } else {
+        printf("# NOTFOUND\n");
+      }
+      ImageIndexDestroy(&index);
+    } else if (strcmp(av[k], "pyrlocate") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 2) { err = 2; break; }
+      int exact;
+      if (strcmp(av[k], "exact") == 0) exact = 1;
+      else if (strcmp(av[k], "best") == 0) exact = 0;
+      else { err = 5; break; }
+      fprintf(stderr, "Locating I%d in I%d (pyramids, %s)\n", n-2, n-1, av[k]);
+      if (ImageLocatePyramid(img[n-1], &x, &y, img[n-2], exact)) {
+        printf("# FOUND (%d,%d)\n", x, y);
+      } else {
+        printf("# NOTFOUND\n");
+      }
+    } else if (strcmp(av[k], "ncc") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 2) { err = 2; break; }
+      int npeaks;
+      char file[1024] = "";
+      if (sscanf(av[k], "%d,%1023s", &npeaks, file) < 1 || npeaks < 0) { err = 5; break; }
+      if (ImageWidth(img[n-2]) > ImageWidth(img[n-1]) ||
+          ImageHeight(img[n-2]) > ImageHeight(img[n-1])) { err = 6; break; }
+      fprintf(stderr, "Correlating I%d with I%d\n", n-2, n-1);
+      ImageNCCMap map = ImageNCCCreate(img[n-1], img[n-2]);
+      if (map == NULL) { err = 4; break; }
+      ImagePeak* peaks = (ImagePeak*)malloc((size_t)(npeaks > 0 ? npeaks : 1) * sizeof(ImagePeak));
+      if (peaks == NULL) { ImageNCCDestroy(&map); err = 4; break; }
+      int found = ImageNCCPeaks(map, npeaks, peaks);
+      for (int i = 0; i < found; i++) {
+        printf("# PEAK (%d,%d) ncc=%.6f\n", peaks[i].x, peaks[i].y, peaks[i].score);
+      }
+      free(peaks);
+      if (file[0] != '\0') {
+        fprintf(stderr, "Saving %s <- correlation map\n", file);
+        Image mapImg = ImageNCCImage(map);
+        if (mapImg == NULL || ImageSave(mapImg, file) == 0) err = 4;
+        ImageDestroy(&mapImg);
+      }
+      ImageNCCDestroy(&map);
+      if (err != 0) break;
+    } else if (strcmp(av[k], "match") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 2) { err = 2; break; }
+      char metric[4];
+      uint64_t threshold = UINT64_MAX;
+      // The whole operand must be M or M,T (T a decimal number)
+      int mlen = 0, len = 0;
+      int nread = sscanf(av[k], "%3[a-z]%n,%" SCNu64 "%n", metric, &mlen, &threshold, &len);
+      if (nread < 1 || (nread == 1 ? mlen : len) != (int)strlen(av[k]) ||
+          (nread == 2 && !isdigit((unsigned char)av[k][mlen + 1]))) { err = 5; break; }
+      MatchMetric m;
+      if (strcmp(metric, "sad") == 0) m = MATCH_SAD;
+      else if (strcmp(metric, "ssd") == 0) m = MATCH_SSD;
+      else { err = 5; break; }
+      fprintf(stderr, "Matching I%d in I%d (%s)\n", n-2, n-1, metric);
+      uint64_t score;
+      if (ImageMatchBest(img[n-1], &x, &y, img[n-2], m, threshold, &score)) {
+        printf("# MATCH (%d,%d) %s=%" PRIu64 "\n", x, y, metric, score);
+      } else {
+        printf("# NOMATCH\n");
+      }
+    } else if (strcmp(av[k], "locateall") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      // Split the list of template files (in place).
+      // There are at most (number of commas + 1) names.
+      int maxtpl = 1;
+      for (const char* c = av[k]; *c != '\0'; c++) maxtpl += *c == ',';
+      char** files = malloc((size_t)maxtpl * sizeof(*files));
+      Image* tpl = malloc((size_t)maxtpl * sizeof(*tpl));
+      int ntpl = 0;
+      if (files == NULL || tpl == NULL) err = 10;
+      for (char* f = err == 0 ? strtok(av[k], ",") : NULL; f != NULL; f = strtok(NULL, ",")) {
+        files[ntpl] = f;
+        tpl[ntpl] = ImageLoad(f);
+        if (tpl[ntpl] == NULL) { err = 4; break; }
+        ntpl++;
+        if (ImageWidth(tpl[ntpl-1]) == 0 || ImageHeight(tpl[ntpl-1]) == 0) { err = 5; break; }
+      }
+      if (err == 0 && ntpl == 0) err = 5;
+      if (err == 0) {
+        fprintf(stderr, "Locating %d templates in I%d\n", ntpl, n-1);
+        int nocc;
+        ImageOccurrence* occ = ImageLocateAll(img[n-1], ntpl, tpl, &nocc);
+        if (occ == NULL) {
+          err = 4;
+        } else {
+          for (int i = 0; i < nocc; i++) {
+            printf("# FOUND %s (%d,%d)\n", files[occ[i].id], occ[i].x, occ[i].y);
+          }
+          printf("# Occurrences: %d\n", nocc);
+          free(occ);
+        }
+      }
+      while (ntpl > 0) ImageDestroy(&tpl[--ntpl]);
+      free(tpl);
+      free(files);
+      if (err != 0) break;
     } else if (strcmp(av[k], "blur") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 1) { err = 2; break; }
       int dx; int dy;
-      if (sscanf(av[k], "%d,%d", &dx, &dy) != 2) { err = 5; break; }
-      fprintf(stderr, "Blur I%d with %dx%d mean filter\n", n-1, 2*dx+1, 2*dy+1);
-      ImageBlur(img[n-1], dx, dy);
+      char method[16] = "sat";
+      if (sscanf(av[k], "%d,%d,%15s", &dx, &dy, method) < 2) { err = 5; break; }
+      BlurMode mode;
+      if (strcmp(method, "sat") == 0) mode = BLUR_SAT;
+      else if (strcmp(method, "sep") == 0) mode = BLUR_SEPARABLE;
+      else if (strcmp(method, "direct") == 0) mode = BLUR_DIRECT;
+      else { err = 5; break; }
+      fprintf(stderr, "Blur I%d with %dx%d mean filter (%s)\n", n-1, 2*dx+1, 2*dy+1, method);
+      if (pipelined) {
+        // The pipeline always blurs row by row (same result for any method)
+        if (dx < 0 || dy < 0) { err = 5; break; }
+        if (pipeCurr(&pipe, img[n-1]) == NULL || !ImagePipelineBlur(pipe, dx, dy)) { err = 4; break; }
+      } else {
+        if (!unshare(&img[n-1])) { err = 4; break; }
+        ImageBlurUsing(img[n-1], dx, dy, mode);
+      }
     } else if (strcmp(av[k], "save") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 1) { err = 2; break; }
       fprintf(stderr, "Saving %s <- I%d\n", av[k], n-1);
-      if (ImageSave(img[n-1], av[k]) == 0) { err = 4; break; }
+      if (pipelined) {
+        if (pipeCurr(&pipe, img[n-1]) == NULL || !ImagePipelineSave(pipe, av[k])) { err = 4; break; }
+      } else {
+        if (ImageSave(img[n-1], av[k]) == 0) { err = 4; break; }
+      }
     } else {  // image file
       if (n >= N) { err = 3; break; }
       fprintf(stderr, "Loading %s -> I%d\n", av[k], n);
-      img[n] = ImageLoad(av[k]);
-      if (img[n] == NULL) { err = 4; break; }
+      if (mapped) {
+        // Mapping is already lazy: no need for a pipeline source
+        img[n] = ImageLoadMapped(av[k]);
+        if (img[n] == NULL) { err = 4; break; }
+      } else if (pipelined) {
+        if ((pipe = ImagePipelineCreate()) == NULL) { err = 4; break; }
+        if (!ImagePipelineLoad(pipe, av[k])) { ImagePipelineDestroy(&pipe); err = 4; break; }
+        img[n] = NULL;
+      } else {
+        img[n] = ImageLoad(av[k]);
+        if (img[n] == NULL) { err = 4; break; }
+      }
       n++;
     }
     k++;
   }
-  
+  // A run still pending here is never observed, so it is not applied.
+  // A pending pipeline may save files, so it is run.
+  if (err == 0 && pipe != NULL && !pipeFlush(&pipe, &img[n-1])) err = 4;
+  ImagePipelineDestroy(&pipe);
+
   // Destroy remaining images
   while (n > 0) {
     ImageDestroy(&img[--n]);
@@ -20,8 +20,20 @@
 /// InstrPrint();  // to show time and counters
 
 #include "instrumentation.h"
+#include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+#if defined(__linux__)
+#include <dirent.h>
+#include <linux/perf_event.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
 /// Cpu time in seconds
 double cpu_time(void) ; ///
@@ -42,6 +54,14 @@ double cpu_time(void) {
   return (double)current_time.tv_sec + 1.0e-9 * (double)current_time.tv_nsec;
 }
 
+double wall_time(void) {
+  struct timespec current_time;
+
+  if (clock_gettime(CLOCK_MONOTONIC, &current_time) != 0)
+    return -1.0; // clock_gettime() failed!!!
+  return (double)current_time.tv_sec + 1.0e-9 * (double)current_time.tv_nsec;
+}
+
 #endif
 
 
@@ -66,10 +86,78 @@ double cpu_time(void) {
   return (double)current_time.QuadPart / (double)frequency.QuadPart;
 }
 
+double wall_time(void) {
+  return cpu_time();  // already elapsed time
+}
+
 #endif
 
-/// Array of operation counters:
-unsigned long InstrCount[NUMCOUNTERS];  ///extern
+// Counters of one thread.  Registered threads form a list, which only
+// grows: readers follow it without locks, and entries of threads that
+// ended are reused (with their counts) by new threads.
+struct instrThread {
+  unsigned long count[NUMCOUNTERS];
+  int id;                      // registration order
+  int live;                    // is the thread running?
+  struct instrThread* next;
+} __attribute__((aligned(64)));  // no false sharing between threads
+
+static struct instrThread* threads = NULL;
+static int numThreads = 0;
+static pthread_mutex_t threadsLock = PTHREAD_MUTEX_INITIALIZER;  // registration
+static pthread_key_t threadKey;    // to know when a thread ends
+static pthread_once_t threadKeyOnce = PTHREAD_ONCE_INIT;
+
+// Used if there is no memory for the counters of a thread
+static unsigned long lostCounts[NUMCOUNTERS];
+
+/// Counters of the calling thread (NULL until the thread first counts):
+__thread unsigned long* InstrLocal = NULL;  ///extern
+
+// The thread of entry t ended: t can be reused
+static void threadEnd(void* t) {
+  __atomic_store_n(&((struct instrThread*)t)->live, 0, __ATOMIC_RELEASE);
+}
+
+static void threadKeyCreate(void) {
+  pthread_key_create(&threadKey, threadEnd);
+}
+
+/// Register the calling thread (on its first use of InstrCount)
+/// and return its array of counters.
+unsigned long* InstrRegisterThread(void) { ///
+  pthread_once(&threadKeyOnce, threadKeyCreate);
+  pthread_mutex_lock(&threadsLock);
+  struct instrThread* t = threads;
+  while (t != NULL && __atomic_load_n(&t->live, __ATOMIC_ACQUIRE)) t = t->next;
+  if (t == NULL) {
+    void* mem = NULL;
+    if (posix_memalign(&mem, 64, sizeof(struct instrThread)) == 0) {
+      t = (struct instrThread*)mem;
+      memset(t, 0, sizeof(*t));
+      t->id = numThreads++;
+      t->next = threads;
+      __atomic_store_n(&threads, t, __ATOMIC_RELEASE);
+    }
+  }
+  if (t != NULL) {
+    t->live = 1;
+    pthread_setspecific(threadKey, t);
+  }
+  pthread_mutex_unlock(&threadsLock);
+  InstrLocal = t != NULL ? t->count : lostCounts;
+  return InstrLocal;
+}
+
+/// Value of counter i since the last reset: the sum over all threads.
+/// Counts made by other threads while this runs may be missed.
+unsigned long InstrValue(int i) { ///
+  unsigned long sum = lostCounts[i];
+  for (struct instrThread* t = __atomic_load_n(&threads, __ATOMIC_ACQUIRE); t != NULL; t = t->next) {
+    sum += __atomic_load_n(&t->count[i], __ATOMIC_RELAXED);
+  }
+  return sum;
+}
 
 /// Array of names for the counters:
 char* InstrName[NUMCOUNTERS] = {NULL};  ///extern
@@ -101,10 +189,158 @@ void InstrCalibrate(void) { ///
   InstrCTU = cpu_time() - time;
 }
 
-/// Reset counters to zero and store cpu_time.
+//
+// Hardware event counters
+//
+
+/// Number of hardware events (see InstrHardware)
+#define NUMEVENTS 6
+
+static const char* eventName[NUMEVENTS] = {
+  "cycles", "instructions", "L1D-misses", "LLC-misses", "dTLB-misses", "br-misses"
+};
+
+static int hwEnabled = 0;
+static int hwAvail[NUMEVENTS];   // events that could be opened
+
+/// Counter whose count is the unit of the misses-per-unit ratios of
+/// InstrPrint with hardware events (default: counter 0):
+int InstrPerfUnit = 0;  ///extern
+
+#if defined(__linux__)
+
+// Event definitions for perf_event_open
+#define CACHE_READ_MISS(cache) \
+  ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+static const struct { uint32_t type; uint64_t config; } eventDef[NUMEVENTS] = {
+  { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+  { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+  { PERF_TYPE_HW_CACHE, CACHE_READ_MISS(PERF_COUNT_HW_CACHE_L1D) },
+  { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+  { PERF_TYPE_HW_CACHE, CACHE_READ_MISS(PERF_COUNT_HW_CACHE_DTLB) },
+  { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+};
+
+// Open file descriptors: hwFd[t*NUMEVENTS + e] counts event e of task t
+// (-1 if not available).  Counting a thread includes the threads it
+// starts afterwards, but only once they end.
+static int* hwFd = NULL;
+static int hwTasks = 0;
+
+static int perfOpen(int e, pid_t tid) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = eventDef[e].type;
+  attr.config = eventDef[e].config;
+  attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+  attr.inherit = 1;
+  attr.exclude_kernel = 1;  // allowed with perf_event_paranoid <= 2
+  attr.exclude_hv = 1;
+  return (int)syscall(SYS_perf_event_open, &attr, tid, -1, -1, 0);
+}
+
+static void hwClose(void) {
+  for (int i = 0; i < hwTasks * NUMEVENTS; i++)
+    if (hwFd[i] >= 0) close(hwFd[i]);
+  free(hwFd);
+  hwFd = NULL;
+  hwTasks = 0;
+}
+
+// Open (again) the events of all threads of the process.
+// Returns the number of events available.
+static int hwOpen(void) {
+  hwClose();
+  DIR* dir = opendir("/proc/self/task");
+  if (dir == NULL) return 0;
+  int cap = 0;
+  struct dirent* d;
+  while ((d = readdir(dir)) != NULL) {
+    pid_t tid = (pid_t)atoi(d->d_name);
+    if (tid <= 0) continue;
+    if (hwTasks == cap) {
+      cap = cap > 0 ? 2 * cap : 16;
+      int* fd = (int*)realloc(hwFd, (size_t)cap * NUMEVENTS * sizeof(int));
+      if (fd == NULL) break;
+      hwFd = fd;
+    }
+    for (int e = 0; e < NUMEVENTS; e++)
+      hwFd[hwTasks * NUMEVENTS + e] = perfOpen(e, tid);
+    hwTasks++;
+  }
+  closedir(dir);
+  int n = 0;
+  for (int e = 0; e < NUMEVENTS; e++) {
+    hwAvail[e] = hwTasks > 0 && hwFd[e] >= 0;  // as for the first task
+    n += hwAvail[e];
+  }
+  return n;
+}
+
+// Value of event e since hwOpen, over all threads
+// (scaled up if the kernel had to multiplex the counters)
+static double hwRead(int e) {
+  double sum = 0.0;
+  for (int t = 0; t < hwTasks; t++) {
+    uint64_t v[3];  // value, time enabled, time running
+    int fd = hwFd[t * NUMEVENTS + e];
+    if (fd < 0 || read(fd, v, sizeof(v)) != (ssize_t)sizeof(v) || v[2] == 0) continue;
+    sum += (double)v[0] * ((double)v[1] / (double)v[2]);
+  }
+  return sum;
+}
+
+#else
+
+static void hwClose(void) {}
+static int hwOpen(void) { return 0; }
+static double hwRead(int e) { return 0.0; }
+
+#endif
+
+/// Count hardware events (cycles, instructions, L1 data cache, last level
+/// cache and data TLB misses, and branch misses) between InstrReset and
+/// InstrPrint, using Linux perf events (on=1), or stop counting (on=0).
+/// Returns the number of events that can be counted: if none (not Linux,
+/// not permitted, as in many containers, or no such events), counting
+/// stays off and InstrPrint output is as without hardware events.
+int InstrHardware(int on) { ///
+  int err = errno;
+  int n = on ? hwOpen() : 0;
+  if (n == 0) hwClose();
+  hwEnabled = n > 0;
+  errno = err;
+  return n;
+}
+
+// The profile: operations [0, numOps[, protected by opsLock
+static InstrOp ops[INSTR_MAXOPS];
+static int numOps = 0;
+static pthread_mutex_t opsLock = PTHREAD_MUTEX_INITIALIZER;
+
+/// Reset counters (of all threads) and profile to zero and store cpu_time.
+/// Call when no other thread is counting, or some counts may survive.
 void InstrReset(void) { ///
+  for (struct instrThread* t = __atomic_load_n(&threads, __ATOMIC_ACQUIRE); t != NULL; t = t->next) {
+    for (int i = 0; i < NUMCOUNTERS; i++)
+      __atomic_store_n(&t->count[i], 0ul, __ATOMIC_RELAXED);
+  }
   for (int i = 0; i < NUMCOUNTERS; i++)
-    InstrCount[i] = 0ul;
+    lostCounts[i] = 0ul;
+  if (hwEnabled) {
+    int err = errno;
+    hwOpen();  // including threads started since
+    errno = err;
+  }
+  pthread_mutex_lock(&opsLock);
+  for (int i = 0; i < numOps; i++) {
+    const char* name = ops[i].name;
+    memset(&ops[i], 0, sizeof(InstrOp));
+    ops[i].name = name;  // the operation numbers stay valid
+  }
+  pthread_mutex_unlock(&opsLock);
   InstrTime = cpu_time();
 }
 
@@ -123,7 +359,182 @@ void InstrPrint(void) { ///
   printf("%15.6f\t%15.6f", time, caltime);
   for (int i = 0; i < NUMCOUNTERS; i++)
     if (InstrName[i] != NULL)
-      printf("\t%15lu", InstrCount[i]);  
+      printf("\t%15lu", InstrValue(i));  
+  puts("");
+
+  if (hwEnabled) {
+    double value[NUMEVENTS];
+    for (int e = 0; e < NUMEVENTS; e++) value[e] = hwRead(e);
+    // Misses per unit of counter InstrPerfUnit (if named and nonzero)
+    int u = InstrPerfUnit;
+    unsigned long units = 0 <= u && u < NUMCOUNTERS && InstrName[u] != NULL ? InstrValue(u) : 0;
+    int ipc = hwAvail[0] && hwAvail[1] && value[0] > 0.0;
+    char label[32];
+
+    printf("#");
+    const char* sep = "";
+    for (int e = 0; e < NUMEVENTS; e++) {
+      if (!hwAvail[e]) continue;
+      printf("%s%*.15s", sep, *sep ? 15 : 14, eventName[e]);
+      sep = "\t";
+    }
+    if (ipc) printf("\t%15s", "IPC");
+    for (int e = 2; units > 0 && e < NUMEVENTS; e++) {
+      if (!hwAvail[e]) continue;
+      snprintf(label, sizeof(label), "%.*s/%s", (int)strcspn(eventName[e], "-"), eventName[e], InstrName[u]);
+      printf("\t%15.15s", label);
+    }
+    puts("");
+    sep = "";
+    for (int e = 0; e < NUMEVENTS; e++) {
+      if (!hwAvail[e]) continue;
+      printf("%s%15.0f", sep, value[e]);
+      sep = "\t";
+    }
+    if (ipc) printf("\t%15.3f", value[1] / value[0]);
+    for (int e = 2; units > 0 && e < NUMEVENTS; e++) {
+      if (!hwAvail[e]) continue;
+      printf("\t%15.6f", value[e] / (double)units);
+    }
+    puts("");
+  }
+}
+
+/// Print the named counter values of each thread that counted
+/// since the last reset.
+void InstrPrintThreads(void) { ///
+  printf("#%14.15s", "thread");
+  for (int i = 0; i < NUMCOUNTERS; i++)
+    if (InstrName[i] != NULL)
+      printf("\t%15.15s", InstrName[i]);
   puts("");
+  // In registration order (the list has the most recent first)
+  int n = __atomic_load_n(&numThreads, __ATOMIC_RELAXED);
+  for (int id = 0; id < n; id++) {
+    struct instrThread* t = __atomic_load_n(&threads, __ATOMIC_ACQUIRE);
+    while (t != NULL && t->id != id) t = t->next;
+    if (t == NULL) continue;
+    int counted = 0;
+    for (int i = 0; i < NUMCOUNTERS; i++)
+      counted |= InstrName[i] != NULL && __atomic_load_n(&t->count[i], __ATOMIC_RELAXED) != 0;
+    if (!counted) continue;
+    printf("%15d", id);
+    for (int i = 0; i < NUMCOUNTERS; i++)
+      if (InstrName[i] != NULL)
+        printf("\t%15lu", __atomic_load_n(&t->count[i], __ATOMIC_RELAXED));
+    puts("");
+  }
+}
+
+/// Start timing a call of operation name.
+///   op : address of a variable, initially -1, where the operation
+///        number is cached (usually a static variable of the caller).
+/// Returns the span to pass to InstrOpEnd when the call ends.
+/// Safe to call from several threads.  If there are already INSTR_MAXOPS
+/// operations, the call is not recorded.
+InstrSpan InstrOpBegin(int* op, const char* name) { ///
+  InstrSpan span;
+  span.op = __atomic_load_n(op, __ATOMIC_ACQUIRE);
+  if (span.op < 0) {
+    // First call: find the operation by name, or add it
+    pthread_mutex_lock(&opsLock);
+    int i = 0;
+    while (i < numOps && strcmp(ops[i].name, name) != 0) i++;
+    if (i == numOps && numOps < INSTR_MAXOPS) {
+      ops[numOps++].name = name;
+    }
+    span.op = i < numOps ? i : -1;
+    if (span.op >= 0) __atomic_store_n(op, span.op, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&opsLock);
+  }
+  span.cpu = cpu_time();
+  span.wall = wall_time();
+  return span;
+}
+
+/// Record the end of a call started by InstrOpBegin, which processed
+/// items items, and read and wrote the given numbers of bytes.
+/// Safe to call from several threads.  Preserves global errno.
+void InstrOpEnd(InstrSpan span, unsigned long items,
+                unsigned long bytesRead, unsigned long bytesWritten) { ///
+  if (span.op < 0) return;
+  int err = errno;
+  double wall = wall_time() - span.wall;
+  double cpu = cpu_time() - span.cpu;
+  pthread_mutex_lock(&opsLock);
+  InstrOp* o = &ops[span.op];
+  o->calls++;
+  o->cpu += cpu;
+  o->wall += wall;
+  o->items += items;
+  o->bytesRead += bytesRead;
+  o->bytesWritten += bytesWritten;
+  pthread_mutex_unlock(&opsLock);
+  errno = err;
 }
 
+/// Copy the profile of up to max operations to ops[].
+/// Returns the number of operations called since InstrReset.
+int InstrProfile(InstrOp out[], int max) { ///
+  int n = 0;
+  pthread_mutex_lock(&opsLock);
+  for (int i = 0; i < numOps; i++) {
+    if (ops[i].calls == 0) continue;
+    if (n < max) out[n] = ops[i];
+    n++;
+  }
+  pthread_mutex_unlock(&opsLock);
+  return n;
+}
+
+// Throughput (MB/s) and time per item (ns) of o (0 if not measurable)
+static double opMBps(const InstrOp* o) {
+  return o->wall > 0.0 ? (double)(o->bytesRead + o->bytesWritten) / o->wall * 1e-6 : 0.0;
+}
+
+static double opNsPerItem(const InstrOp* o) {
+  return o->items > 0 ? o->wall * 1e9 / (double)o->items : 0.0;
+}
+
+/// Print the profile of the operations called since InstrReset to f,
+/// with throughput (MB/s, from elapsed time and bytes read and written)
+/// and time per item (ns/item), as a table, CSV or JSON.
+void InstrProfilePrint(FILE* f, InstrFormat format) { ///
+  InstrOp prof[INSTR_MAXOPS];
+  int n = InstrProfile(prof, INSTR_MAXOPS);
+
+  switch (format) {
+  case INSTR_TEXT:
+    fprintf(f, "#%-23.24s\t%8s\t%12s\t%12s\t%12s\t%12s\t%12s\t%10s\t%10s\n",
+            "operation", "calls", "cpu", "wall", "items", "read", "written", "MB/s", "ns/item");
+    for (int i = 0; i < n; i++) {
+      const InstrOp* o = &prof[i];
+      fprintf(f, "%-24.24s\t%8lu\t%12.6f\t%12.6f\t%12lu\t%12lu\t%12lu\t%10.1f\t%10.3f\n",
+              o->name, o->calls, o->cpu, o->wall, o->items, o->bytesRead, o->bytesWritten,
+              opMBps(o), opNsPerItem(o));
+    }
+    break;
+  case INSTR_CSV:
+    fprintf(f, "operation,calls,cpu_s,wall_s,items,bytes_read,bytes_written,mb_per_s,ns_per_item\n");
+    for (int i = 0; i < n; i++) {
+      const InstrOp* o = &prof[i];
+      fprintf(f, "%s,%lu,%.9f,%.9f,%lu,%lu,%lu,%.3f,%.3f\n",
+              o->name, o->calls, o->cpu, o->wall, o->items, o->bytesRead, o->bytesWritten,
+              opMBps(o), opNsPerItem(o));
+    }
+    break;
+  case INSTR_JSON:
+    // Operation names are identifiers: they need no escaping
+    fprintf(f, "{\"operations\": [");
+    for (int i = 0; i < n; i++) {
+      const InstrOp* o = &prof[i];
+      fprintf(f, "%s\n  {\"operation\": \"%s\", \"calls\": %lu, \"cpu_s\": %.9f, \"wall_s\": %.9f, "
+              "\"items\": %lu, \"bytes_read\": %lu, \"bytes_written\": %lu, "
+              "\"mb_per_s\": %.3f, \"ns_per_item\": %.3f}",
+              i > 0 ? "," : "", o->name, o->calls, o->cpu, o->wall, o->items,
+              o->bytesRead, o->bytesWritten, opMBps(o), opNsPerItem(o));
+    }
+    fprintf(f, "\n]}\n");
+    break;
+  }
+}
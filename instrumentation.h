@@ -18,18 +18,49 @@
 ///   a[k] = a[i] + a[j];
 /// }
 /// InstrPrint();  // to show time and counters
+///
+/// Each thread counts in its own array of counters, so counting from
+/// several threads needs no locks or atomic operations (and the threads
+/// do not share cache lines).  InstrPrint and InstrReset combine the
+/// counters of all threads.
+///
+/// The time spent in operations of interest may also be profiled
+/// (see InstrOpBegin):
+///
+/// static int op = -1;
+/// InstrSpan s = InstrOpBegin(&op, "sort");
+/// ...
+/// InstrOpEnd(s, n, 4*n, 4*n);  // n items, 4*n bytes read and written
+/// ...
+/// InstrProfilePrint(stdout, INSTR_TEXT);  // to show the profile
 
 #ifndef INSTRUMENTATION_H
 #define INSTRUMENTATION_H
 
+#include <stdio.h>
+
 /// Cpu time in seconds
 double cpu_time(void) ; ///
 
+/// Elapsed (wall clock) time in seconds, from an arbitrary origin
+double wall_time(void) ; ///
+
 /// Ten counters should be more than enough
 #define NUMCOUNTERS 10
 
-/// Array of operation counters:
-extern unsigned long InstrCount[NUMCOUNTERS];  ///extern
+/// Array of operation counters of the calling thread:
+#define InstrCount (InstrLocal != NULL ? InstrLocal : InstrRegisterThread())
+
+/// Counters of the calling thread (NULL until the thread first counts):
+extern __thread unsigned long* InstrLocal;  ///extern
+
+/// Register the calling thread (on its first use of InstrCount)
+/// and return its array of counters.
+unsigned long* InstrRegisterThread(void) ;
+
+/// Value of counter i since the last reset: the sum over all threads.
+/// Counts made by other threads while this runs may be missed.
+unsigned long InstrValue(int i) ;
 
 /// Array of names for the counters:
 extern char* InstrName[NUMCOUNTERS];  ///extern
@@ -45,10 +76,79 @@ extern double InstrCTU;  ///extern
 /// a reasonably cpu-independent time unit.
 void InstrCalibrate(void) ;
 
-/// Reset counters to zero and store cpu_time.
+/// Reset counters (of all threads) and profile to zero and store cpu_time.
+/// Call when no other thread is counting, or some counts may survive.
 void InstrReset(void) ;
 
 void InstrPrint(void) ;
 
+/// Print the named counter values of each thread that counted
+/// since the last reset.
+void InstrPrintThreads(void) ;
+
+/// Count hardware events (cycles, instructions, L1 data cache, last level
+/// cache and data TLB misses, and branch misses) between InstrReset and
+/// InstrPrint, using Linux perf events (on=1), or stop counting (on=0).
+/// Returns the number of events that can be counted: if none (not Linux,
+/// not permitted, as in many containers, or no such events), counting
+/// stays off and InstrPrint output is as without hardware events.
+/// InstrPrint then also shows the instructions per cycle (IPC) and the
+/// misses per unit of counter InstrPerfUnit.
+int InstrHardware(int on) ;
+
+/// Counter whose count is the unit of the misses-per-unit ratios of
+/// InstrPrint with hardware events (default: counter 0):
+extern int InstrPerfUnit;  ///extern
+
+/// Per-operation profile
+
+/// Maximum number of profiled operations
+#define INSTR_MAXOPS 64
+
+/// Profile of one operation, accumulated over its calls since InstrReset.
+/// Calls of an operation made by another profiled operation are included
+/// in the times of both.
+typedef struct {
+  const char* name;
+  unsigned long calls;
+  double cpu;                  // cpu time, all threads (seconds)
+  double wall;                 // elapsed time (seconds)
+  unsigned long items;         // items (pixels, ...) processed
+  unsigned long bytesRead;     // bytes read
+  unsigned long bytesWritten;  // bytes written
+} InstrOp;
+
+/// An operation in progress (see InstrOpBegin).
+typedef struct {
+  int op;
+  double cpu, wall;
+} InstrSpan;
+
+/// Output formats of InstrProfilePrint.
+typedef enum { INSTR_TEXT, INSTR_CSV, INSTR_JSON } InstrFormat;
+
+/// Start timing a call of operation name.
+///   op : address of a variable, initially -1, where the operation
+///        number is cached (usually a static variable of the caller).
+/// Returns the span to pass to InstrOpEnd when the call ends.
+/// Safe to call from several threads.  If there are already INSTR_MAXOPS
+/// operations, the call is not recorded.
+InstrSpan InstrOpBegin(int* op, const char* name) ;
+
+/// Record the end of a call started by InstrOpBegin, which processed
+/// items items, and read and wrote the given numbers of bytes.
+/// Safe to call from several threads.  Preserves global errno.
+void InstrOpEnd(InstrSpan span, unsigned long items,
+                unsigned long bytesRead, unsigned long bytesWritten) ;
+
+/// Copy the profile of up to max operations to ops[].
+/// Returns the number of operations called since InstrReset.
+int InstrProfile(InstrOp ops[], int max) ;
+
+/// Print the profile of the operations called since InstrReset to f,
+/// with throughput (MB/s, from elapsed time and bytes read and written)
+/// and time per item (ns/item), as a table, CSV or JSON.
+void InstrProfilePrint(FILE* f, InstrFormat format) ;
+
 #endif
 
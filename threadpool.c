@@ -0,0 +1,136 @@
+/// A persistent pool of worker threads for data-parallel loops.
+///
+/// AED, 2023
+///
+/// See threadpool.h for usage.
+
+#include "threadpool.h"
+#include <pthread.h>
+#include <stdlib.h>
+
+// Pool state.  All fields are protected by lock, except jobNext, which
+// the threads running a job increment atomically to grab iterations.
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;  // new job or stop
+static pthread_cond_t idle = PTHREAD_COND_INITIALIZER;  // busy became 0
+static pthread_t* workers = NULL;
+static int nworkers = 0;
+static int stopping = 0;
+static unsigned long generation = 0;   // incremented for each new job
+static int busy = 0;                   // workers running the current job
+
+// The current job
+static void (*jobBody)(void* arg, int i);
+static void* jobArg;
+static int jobN;
+static int jobNext;
+
+// Only one thread at a time may submit jobs
+static pthread_mutex_t submit = PTHREAD_MUTEX_INITIALIZER;
+
+// Set while a thread is running pool iterations (to detect nested calls)
+static __thread int inPool = 0;
+
+// Grab and run iterations of the job until there are none left.
+static void runIterations(void (*body)(void*, int), void* arg, int n) {
+  inPool = 1;
+  for (;;) {
+    int i = __atomic_fetch_add(&jobNext, 1, __ATOMIC_RELAXED);
+    if (i >= n) break;
+    body(arg, i);
+  }
+  inPool = 0;
+}
+
+static void* worker(void* unused) {
+  (void)unused;
+  unsigned long seen = 0;
+  pthread_mutex_lock(&lock);
+  seen = generation;
+  for (;;) {
+    while (generation == seen && !stopping) {
+      pthread_cond_wait(&wake, &lock);
+    }
+    if (stopping) break;
+    seen = generation;
+    void (*body)(void*, int) = jobBody;
+    void* arg = jobArg;
+    int n = jobN;
+    busy++;
+    pthread_mutex_unlock(&lock);
+
+    runIterations(body, arg, n);
+
+    pthread_mutex_lock(&lock);
+    if (--busy == 0) pthread_cond_broadcast(&idle);
+  }
+  pthread_mutex_unlock(&lock);
+  return NULL;
+}
+
+/// Stop the pool and join all worker threads.
+void PoolStop(void) { ///
+  pthread_mutex_lock(&lock);
+  stopping = 1;
+  pthread_cond_broadcast(&wake);
+  pthread_mutex_unlock(&lock);
+  for (int i = 0; i < nworkers; i++) {
+    pthread_join(workers[i], NULL);
+  }
+  free(workers);
+  workers = NULL;
+  nworkers = 0;
+  stopping = 0;
+}
+
+/// Start the pool with nthreads threads in total (including the caller).
+/// A running pool is stopped first.  nthreads <= 1 means no workers.
+/// On success, returns nonzero.
+/// On failure, returns 0 and the pool is left stopped (PoolFor is serial).
+int PoolStart(int nthreads) { ///
+  PoolStop();
+  if (nthreads <= 1) return 1;
+  workers = (pthread_t*)malloc((size_t)(nthreads - 1) * sizeof(pthread_t));
+  if (workers == NULL) return 0;
+  for (int i = 0; i < nthreads - 1; i++) {
+    if (pthread_create(&workers[i], NULL, worker, NULL) != 0) {
+      PoolStop();
+      return 0;
+    }
+    nworkers++;
+  }
+  return 1;
+}
+
+/// Number of threads that run PoolFor iterations (at least 1).
+int PoolThreads(void) { ///
+  return nworkers + 1;
+}
+
+/// Run body(arg, i) for every i in [0, n[, distributed over the pool.
+void PoolFor(int n, void (*body)(void* arg, int i), void* arg) { ///
+  if (nworkers == 0 || inPool || n <= 1 || pthread_mutex_trylock(&submit) != 0) {
+    for (int i = 0; i < n; i++) body(arg, i);
+    return;
+  }
+
+  pthread_mutex_lock(&lock);
+  // Late workers may still be looking at the previous job
+  while (busy > 0) pthread_cond_wait(&idle, &lock);
+  jobBody = body;
+  jobArg = arg;
+  jobN = n;
+  jobNext = 0;
+  generation++;
+  pthread_cond_broadcast(&wake);
+  pthread_mutex_unlock(&lock);
+
+  runIterations(body, arg, n);
+
+  // Wait for the iterations still running in the workers
+  pthread_mutex_lock(&lock);
+  while (busy > 0) pthread_cond_wait(&idle, &lock);
+  pthread_mutex_unlock(&lock);
+
+  pthread_mutex_unlock(&submit);
+}
@@ -0,0 +1,36 @@
+/// A persistent pool of worker threads for data-parallel loops.
+///
+/// AED, 2023
+///
+/// Use as follows:
+///
+/// PoolStart(4);   // Call once: caller + 3 worker threads
+/// ...
+/// PoolFor(n, body, arg);  // runs body(arg, i) for i = 0..n-1 in parallel
+/// ...
+/// PoolStop();     // join the workers
+///
+/// The thread calling PoolFor also runs iterations and PoolFor only returns
+/// after all iterations are done.  Iterations must be independent.
+/// Calls to PoolFor from inside an iteration, or while another thread is
+/// using the pool, run serially in the calling thread.
+
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+/// Start the pool with nthreads threads in total (including the caller).
+/// A running pool is stopped first.  nthreads <= 1 means no workers.
+/// On success, returns nonzero.
+/// On failure, returns 0 and the pool is left stopped (PoolFor is serial).
+int PoolStart(int nthreads) ;
+
+/// Stop the pool and join all worker threads.
+void PoolStop(void) ;
+
+/// Number of threads that run PoolFor iterations (at least 1).
+int PoolThreads(void) ;
+
+/// Run body(arg, i) for every i in [0, n[, distributed over the pool.
+void PoolFor(int n, void (*body)(void* arg, int i), void* arg) ;
+
+#endif